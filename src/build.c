@@ -0,0 +1,324 @@
+/**
+    @file build.c
+
+    @brief Compiling script files, one or many at a time.
+
+    A program made of several files is compiled by a pool of worker
+    threads, one file at a time each, and then run a file at a time in
+    the order given. Each worker has a VM of its own (the VM is thread
+    local) with its own heap and intern table, so the compilers share
+    nothing and take no locks but the one handing out files.
+
+    Once every worker is done, the main VM adopts their heaps and walks
+    the compiled functions in file order, interning their strings as it
+    goes. A string that is already interned, whether by an earlier file
+    or by the VM itself, replaces the worker's copy, so which worker
+    compiled what makes no difference to the result. Compile errors are
+    buffered per file and printed in file order too.
+
+**/
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "build.h"
+#include "cache.h"
+#include "image.h"
+#include "output.h"
+#include "vm.h"
+
+/**
+    @brief One file to compile, and how compiling it went.
+**/
+typedef struct {
+  const char* path;
+  bool useCache;
+  ObjFunction* function;
+  // Compile errors, held until the files before this one are reported.
+  char* errors;
+  size_t errorsLength;
+  int status;
+} Job;
+
+/**
+    @brief The files still to compile, handed out to workers in order.
+**/
+typedef struct {
+  Job* jobs;
+  int count;
+  int next;
+  int optimizeLevel;
+  pthread_mutex_t lock;
+} JobQueue;
+
+/**
+    @brief A worker thread, and the heap it leaves behind.
+**/
+typedef struct {
+  pthread_t thread;
+  JobQueue* queue;
+  Heap heap;
+} Worker;
+
+/**
+    @brief Compile a script from its cache file, compiling it and writing
+           the cache first if there is none or the script has changed.
+
+    The cache sits next to the script, named after it with a trailing
+    'c'.
+
+    @param context
+    @param path
+    @param source
+    @param length
+    @param status Set to 74 if there is not enough memory to try.
+    @return ObjFunction*
+**/
+static ObjFunction* compileCached(CompileContext* context, const char* path,
+                                  const char* source, size_t length,
+                                  int* status) {
+  char* cachePath = (char*)malloc(strlen(path) + 2);
+  if (cachePath == NULL) {
+    fprintf(context->errors, "Not enough memory to read \"%s\".\n", path);
+    *status = 74;
+    return NULL;
+  }
+  strcpy(cachePath, path);
+  strcat(cachePath, "c");
+
+  ObjFunction* function = loadCache(cachePath, source, length);
+  if (function == NULL) {
+    function = compile(context, source);
+    if (function != NULL) saveCache(cachePath, source, length, function);
+  }
+  free(cachePath);
+  return function;
+}
+
+/**
+    @brief Compile the script at path, or on stdin if path is "-".
+
+    A regular file is mapped rather than read, so the scanner works on
+    the page cache's copy of it. Anything else, such as a pipe, is
+    compiled as it streams in, and is never cached.
+
+    @param context Its errors stream is where problems are reported.
+    @param path
+    @param useCache Whether to load and save the script's cache file.
+    @param status Set to the exit status to stop with if compiling
+           fails: 65 for a compile error, 74 if the file cannot be read.
+    @return ObjFunction* NULL if compiling failed.
+**/
+ObjFunction* compileFile(CompileContext* context, const char* path,
+                         bool useCache, int* status) {
+  *status = 0;
+  int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+  if (fd == -1) {
+    fprintf(context->errors, "Could not open file \"%s\".\n", path);
+    *status = 74;
+    return NULL;
+  }
+
+  size_t length;
+  const char* source = mapSource(fd, &length);
+  ObjFunction* function;
+  if (source == NULL) {
+    function = compileStream(context, fd);
+  } else if (useCache && fd != STDIN_FILENO) {
+    function = compileCached(context, path, source, length, status);
+  } else {
+    function = compile(context, source);
+  }
+
+  if (source != NULL) unmapSource(source, length); // [owner]
+  if (fd != STDIN_FILENO) close(fd);
+
+  if (function == NULL && *status == 0) *status = 65;
+  return function;
+}
+
+/**
+    @brief Compile a job's file on this thread's VM, keeping the result
+    in vm.scripts so that compiling later files cannot collect it.
+
+    @param job
+    @param errors
+**/
+static void compileJob(Job* job, FILE* errors) {
+  CompileContext context;
+  context.errors = errors;
+  job->function = compileFile(&context, job->path, job->useCache,
+                              &job->status);
+  if (job->function == NULL) return;
+
+  push(OBJ_VAL(job->function));
+  writeValueArray(&vm.scripts, OBJ_VAL(job->function));
+  pop();
+}
+
+/**
+    @brief
+
+    @param queue
+    @return Job* NULL once every file has been handed out.
+**/
+static Job* takeJob(JobQueue* queue) {
+  pthread_mutex_lock(&queue->lock);
+  Job* job = queue->next < queue->count ? &queue->jobs[queue->next++]
+                                        : NULL;
+  pthread_mutex_unlock(&queue->lock);
+  return job;
+}
+
+/**
+    @brief Body of a worker thread: compile files until there are none
+    left, then hand back the heap they were compiled into.
+
+    @param argument The Worker.
+    @return void*
+**/
+static void* runWorker(void* argument) {
+  Worker* worker = (Worker*)argument;
+  initVM();
+  vm.optimizeLevel = worker->queue->optimizeLevel;
+
+  Job* job;
+  while ((job = takeJob(worker->queue)) != NULL) {
+    FILE* errors = open_memstream(&job->errors, &job->errorsLength);
+    // Unbuffered errors are better than none, even if out of order.
+    compileJob(job, errors != NULL ? errors : stderr);
+    if (errors != NULL) fclose(errors);
+  }
+
+  worker->heap = detachHeap();
+  freeOutput();
+  return NULL;
+}
+
+/**
+    @brief Compile files on up to jobs worker threads, then adopt what
+    they compiled into this thread's VM.
+
+    @param queue
+    @param jobs
+    @return bool False if no worker could be started.
+**/
+static bool compileInParallel(JobQueue* queue, int jobs) {
+  Worker* workers = (Worker*)calloc(jobs, sizeof(Worker));
+  if (workers == NULL) return false;
+
+  pthread_mutex_init(&queue->lock, NULL);
+  int started = 0;
+  for (int i = 0; i < jobs; i++) {
+    workers[started].queue = queue;
+    if (pthread_create(&workers[started].thread, NULL, runWorker,
+                       &workers[started]) == 0) {
+      started++;
+    }
+  }
+
+  // The workers started drain the queue between them.
+  for (int i = 0; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  pthread_mutex_destroy(&queue->lock);
+  if (started == 0) {
+    free(workers);
+    return false;
+  }
+
+  // Room for every script is made before the heaps are adopted, so no
+  // collection runs between adopting the functions and rooting them.
+  int first = vm.scripts.count;
+  for (int i = 0; i < queue->count; i++) {
+    writeValueArray(&vm.scripts, NIL_VAL);
+  }
+  for (int i = 0; i < started; i++) adoptHeap(&workers[i].heap);
+  free(workers);
+
+  for (int i = 0; i < queue->count; i++) {
+    Job* job = &queue->jobs[i];
+    if (job->function != NULL) {
+      vm.scripts.values[first + i] = OBJ_VAL(job->function);
+    }
+  }
+
+  for (int i = 0; i < queue->count; i++) {
+    Job* job = &queue->jobs[i];
+    if (job->errors != NULL) {
+      fwrite(job->errors, 1, job->errorsLength, stderr);
+      free(job->errors);
+    }
+    if (job->function != NULL) adoptFunction(job->function);
+  }
+  return true;
+}
+
+/**
+    @brief Whether the file at index is listed earlier too. Only one
+    compilation of a file may write its cache.
+
+    @param paths
+    @param index
+    @return bool
+**/
+static bool listedBefore(const char* paths[], int index) {
+  for (int i = 0; i < index; i++) {
+    if (strcmp(paths[i], paths[index]) == 0) return true;
+  }
+  return false;
+}
+
+/**
+    @brief Compile a program made of several files into vm.scripts, in
+    the order given, ready to run one after another.
+
+    Every file is compiled, so that each one's errors are reported,
+    before the first failure's status is returned.
+
+    @param paths
+    @param count
+    @param jobs Worker threads to compile on, or 0 for one per processor.
+           With one, or with a single file, everything is compiled on
+           the calling thread.
+    @param useCache Whether to load and save each script's cache file.
+    @return int 0 if every file compiled, otherwise the exit status to
+            stop with, as compileFile() sets.
+**/
+int compileFiles(const char* paths[], int count, int jobs, bool useCache) {
+  if (count == 0) return 0;
+
+  Job* jobArray = (Job*)calloc(count, sizeof(Job));
+  if (jobArray == NULL) {
+    fprintf(stderr, "Not enough memory to compile %d files.\n", count);
+    return 74;
+  }
+  for (int i = 0; i < count; i++) {
+    jobArray[i].path = paths[i];
+    jobArray[i].useCache = useCache && !listedBefore(paths, i);
+  }
+
+  if (jobs < 1) jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs > count) jobs = count;
+
+  JobQueue queue;
+  queue.jobs = jobArray;
+  queue.count = count;
+  queue.next = 0;
+  queue.optimizeLevel = vm.optimizeLevel;
+  if (jobs <= 1 || !compileInParallel(&queue, jobs)) {
+    for (int i = 0; i < count; i++) compileJob(&jobArray[i], stderr);
+  }
+
+  int status = 0;
+  for (int i = 0; i < count && status == 0; i++) {
+    status = jobArray[i].status;
+  }
+  free(jobArray);
+  return status;
+}
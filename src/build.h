@@ -0,0 +1,16 @@
+/**
+    @file build.h
+
+    @brief Header for compiling script files.
+
+**/
+#ifndef clox_build_h
+#define clox_build_h
+
+#include "compiler.h"
+
+ObjFunction* compileFile(CompileContext* context, const char* path,
+                         bool useCache, int* status);
+int compileFiles(const char* paths[], int count, int jobs, bool useCache);
+
+#endif
@@ -0,0 +1,581 @@
+/**
+    @file cache.c
+
+    @brief Compiled bytecode cache files.
+
+    A cache file holds the script function a source file compiles to,
+    along with every function nested in it, so a later run of the same
+    source can skip the compiler. The header names the format version,
+    the optimization level the code was compiled at, and the length and
+    hash of the source, and a cache that disagrees with the current run
+    on any of them is ignored. A checksum of the rest of the file comes
+    last in the header, and a cache that fails it, or whose contents do
+    not hold together, is ignored too.
+
+    The file is mapped read-only on load and laid out so that the parts
+    worth sharing are used where they lie: each function's code, its
+    line table, and the characters of its string constants. Processes
+    running the same script share those pages instead of each holding a
+    copy. Since they are used in place, code and line tables are checked
+    to be well formed before anything runs. Line tables are stored in
+    the writer's byte order, aligned for direct use, and a byte order
+    mark in the header keeps a cache from being read on a machine that
+    disagrees. Everything else is copied out on load. Constants are tagged, and nested functions are stored
+    in place.
+
+**/
+#include <string.h>
+
+#include "cache.h"
+#include "image.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "vm.h"
+
+#define CACHE_MAGIC "CLXC"
+// Written in native byte order; reads back the same only on a machine
+// with the writer's byte order.
+#define CACHE_BYTE_ORDER 0x01020304u
+
+/**
+    @brief Tags for the constants a cache file can hold.
+**/
+typedef enum {
+  CACHED_NIL,
+  CACHED_TRUE,
+  CACHED_FALSE,
+  CACHED_NUMBER,
+  CACHED_STRING,
+  CACHED_FUNCTION
+} CachedTag;
+
+static void writeFunction(ImageWriter* writer, ObjFunction* function);
+
+/**
+    @brief
+
+    @param writer
+    @param value
+**/
+static void writeValue(ImageWriter* writer, Value value) {
+  if (IS_NIL(value)) {
+    writeInt(writer, CACHED_NIL, 1);
+  } else if (IS_BOOL(value)) {
+    writeInt(writer, AS_BOOL(value) ? CACHED_TRUE : CACHED_FALSE, 1);
+  } else if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    writeInt(writer, CACHED_NUMBER, 1);
+    writeInt(writer, bits, 8);
+  } else if (IS_STRING(value)) {
+    ObjString* string = AS_STRING(value);
+    writeInt(writer, CACHED_STRING, 1);
+    writeInt(writer, string->length, 4);
+    // With the terminator, so the characters can be used in place.
+    writeBytes(writer, string->chars, string->length + 1);
+  } else if (IS_FUNCTION(value)) {
+    writeInt(writer, CACHED_FUNCTION, 1);
+    writeFunction(writer, AS_FUNCTION(value));
+  } else {
+    // The compiler makes no other kind of constant.
+    writer->failed = true;
+  }
+}
+
+/**
+    @brief
+
+    @param writer
+    @param function
+**/
+static void writeFunction(ImageWriter* writer, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  writeInt(writer, function->arity, 4);
+  writeInt(writer, function->upvalueCount, 4);
+  writeInt(writer, function->maxSlots, 4);
+  writeInt(writer, function->inlineKind, 1);
+  writeInt(writer, function->inlineSlot, 1);
+  writeValue(writer, function->inlineValue);
+  writeValue(writer, function->name == NULL ? NIL_VAL
+                                            : OBJ_VAL(function->name));
+
+  writeInt(writer, chunk->count, 4);
+  writeInt(writer, chunk->lineCount, 4);
+  writePadding(writer, sizeof(int));
+  writeBytes(writer, chunk->lines, chunk->lineCount * sizeof(LineStart));
+  writeBytes(writer, chunk->code, chunk->count);
+
+  writeInt(writer, chunk->constants.count, 4);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    writeValue(writer, chunk->constants.values[i]);
+  }
+}
+
+static ObjFunction* readFunction(ImageReader* reader);
+
+/**
+    @brief
+
+    @param reader
+    @return Value nil if the file is malformed.
+**/
+static Value readValue(ImageReader* reader) {
+  switch (readInt(reader, 1)) {
+    case CACHED_NIL:   return NIL_VAL;
+    case CACHED_TRUE:  return BOOL_VAL(true);
+    case CACHED_FALSE: return BOOL_VAL(false);
+    case CACHED_NUMBER: {
+      uint64_t bits = readInt(reader, 8);
+      double number;
+      memcpy(&number, &bits, sizeof(number));
+      return NUMBER_VAL(number);
+    }
+    case CACHED_STRING: {
+      int length = readCount(reader);
+      const uint8_t* chars = readBytes(reader, (size_t)length + 1);
+      if (chars == NULL || chars[length] != '\0') {
+        reader->failed = true;
+        return NIL_VAL;
+      }
+      return OBJ_VAL(imageString((const char*)chars, length));
+    }
+    case CACHED_FUNCTION: {
+      ObjFunction* function = readFunction(reader);
+      if (function == NULL) return NIL_VAL;
+      return OBJ_VAL(function);
+    }
+    default:
+      reader->failed = true;
+      return NIL_VAL;
+  }
+}
+
+/**
+    @brief Whether an opcode has an index or jump operand that OP_WIDE
+    can widen.
+
+    @param op
+    @return bool
+**/
+static bool isWidenable(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_LOOP:
+    case OP_LOOP_IF_TRUE:
+    case OP_FOR_LOOP:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_CLOSURE:
+    case OP_FRAME_CLOSURE:
+    case OP_CLASS:
+    case OP_METHOD:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/**
+    @brief Whether an opcode's first operand is a constant index.
+
+    @param op
+    @return bool
+**/
+static bool takesConstant(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_CLOSURE:
+    case OP_FRAME_CLOSURE:
+    case OP_CLASS:
+    case OP_METHOD:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/**
+    @brief Whether an opcode jumps, and if so whether its distance is
+    encoded backwards.
+
+    @param op
+    @param backward Set for a backward jump.
+    @return bool
+**/
+static bool isJump(uint8_t op, bool* backward) {
+  switch (op) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+      *backward = false;
+      return true;
+    case OP_LOOP:
+    case OP_LOOP_IF_TRUE:
+    case OP_FOR_LOOP:
+      *backward = true;
+      return true;
+    default:
+      return false;
+  }
+}
+
+/**
+    @brief Check the operands of an instruction known to lie within the
+    chunk: constants of the kind the VM takes them for, and upvalues the
+    function has. A closure's captured locals are left to checkStack(),
+    which knows what is on the stack.
+
+    @param function
+    @param offset
+    @param length
+    @return bool
+**/
+static bool checkOperands(ObjFunction* function, int offset, int length) {
+  Chunk* chunk = &function->chunk;
+  bool wide = chunk->code[offset] == OP_WIDE;
+  uint8_t op = chunk->code[offset + (wide ? 1 : 0)];
+  int operand = readOperand(chunk, offset);
+
+  if (takesConstant(op)) {
+    if (operand >= chunk->constants.count) return false;
+    Value constant = chunk->constants.values[operand];
+    if (op == OP_CLOSURE || op == OP_FRAME_CLOSURE) {
+      if (!IS_FUNCTION(constant)) return false;
+    } else if (op != OP_CONSTANT && !IS_STRING(constant)) {
+      return false;
+    }
+  }
+
+  switch (op) {
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+      return operand < function->upvalueCount;
+    case OP_FOR_LOOP: {
+      int step = chunk->code[offset + length - 1];
+      return step < chunk->constants.count &&
+             IS_NUMBER(chunk->constants.values[step]);
+    }
+    case OP_CLOSURE:
+    case OP_FRAME_CLOSURE: {
+      ObjFunction* inner = AS_FUNCTION(chunk->constants.values[operand]);
+      int position = offset + (wide ? 5 : 2);
+      for (int i = 0; i < inner->upvalueCount; i++) {
+        uint8_t isLocal = chunk->code[position];
+        int index = chunk->code[position + 1];
+        if (wide) {
+          index = (index << 16) | (chunk->code[position + 2] << 8) |
+                  chunk->code[position + 3];
+        }
+        position += wide ? 4 : 2;
+        if (isLocal > 1 || (!isLocal && index >= function->upvalueCount)) {
+          return false;
+        }
+      }
+      return true;
+    }
+    default:
+      return true;
+  }
+}
+
+/**
+    @brief Find the length of the instruction at offset, if all of it
+    lies within the chunk and it is one the VM runs.
+
+    @param chunk
+    @param offset
+    @return int 0 if the instruction is malformed.
+**/
+static int checkedLength(Chunk* chunk, int offset) {
+  bool wide = chunk->code[offset] == OP_WIDE;
+  int prefix = wide ? 1 : 0;
+  if (chunk->count - offset <= prefix) return 0;
+  uint8_t op = chunk->code[offset + prefix];
+  if (op >= OP_WIDE || (wide && !isWidenable(op))) return 0;
+
+  // A closure's upvalues follow its constant index, and their count
+  // comes from the constant.
+  bool closure = op == OP_CLOSURE || op == OP_FRAME_CLOSURE;
+  int length = closure ? prefix + 1 + (wide ? 3 : 1)
+                       : instructionLength(chunk, offset);
+  if (length > chunk->count - offset) return 0;
+  if (closure) {
+    int constant = readOperand(chunk, offset);
+    if (constant >= chunk->constants.count ||
+        !IS_FUNCTION(chunk->constants.values[constant])) {
+      return 0;
+    }
+    length = instructionLength(chunk, offset);
+    if (length > chunk->count - offset) return 0;
+  }
+  return length;
+}
+
+/**
+    @brief Check that a function's code can run where it lies: it
+    decodes into whole instructions with operands in range, every jump
+    lands on an instruction, and the last one does not fall through.
+
+    That is as far as the checks go. Code that passes them, and
+    checkStack(), can still misuse a value, say by defining a method on
+    something other than a class; the checksum is what keeps a damaged
+    file from getting that far.
+
+    @param function
+    @return bool
+**/
+static bool checkCode(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  bool* starts = ALLOCATE(bool, chunk->count);
+  for (int i = 0; i < chunk->count; i++) starts[i] = false;
+
+  bool valid = true;
+  uint8_t last = OP_RETURN;
+  for (int offset = 0; valid && offset < chunk->count;) {
+    int length = checkedLength(chunk, offset);
+    valid = length > 0 && checkOperands(function, offset, length);
+    starts[offset] = true;
+    last = chunk->code[offset + (chunk->code[offset] == OP_WIDE ? 1 : 0)];
+    offset += length;
+  }
+  valid = valid && (last == OP_RETURN || last == OP_JUMP || last == OP_LOOP);
+
+  // Every instruction's start is known now, so jumps can be checked.
+  for (int offset = 0; valid && offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    bool wide = chunk->code[offset] == OP_WIDE;
+    bool backward;
+    if (!isJump(chunk->code[offset + (wide ? 1 : 0)], &backward)) continue;
+
+    int next = offset + instructionLength(chunk, offset);
+    int distance = readOperand(chunk, offset);
+    int target = backward ? next - distance : next + distance;
+    valid = target >= 0 && target < chunk->count && starts[target];
+  }
+
+  FREE_ARRAY(bool, starts, chunk->count);
+  return valid;
+}
+
+/**
+    @brief Check that a line table starts at the first instruction and
+    that its runs are in order within the code.
+
+    @param chunk
+    @return bool
+**/
+static bool checkLines(Chunk* chunk) {
+  for (int i = 0; i < chunk->lineCount; i++) {
+    int offset = chunk->lines[i].offset;
+    if (offset >= chunk->count ||
+        (i == 0 ? offset != 0 : offset <= chunk->lines[i - 1].offset)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+    @brief Read a function and the functions nested in it.
+
+    The code and line table are left in the image. The function stays
+    on the VM stack while its constants are read, so a collection along
+    the way finds everything read so far. Every count is checked
+    against what the function can use and what is left of the image.
+
+    @param reader
+    @return ObjFunction* NULL if the file is malformed.
+**/
+static ObjFunction* readFunction(ImageReader* reader) {
+  ObjFunction* function = newFunction();
+  push(OBJ_VAL(function));
+
+  function->arity = readCount(reader);
+  function->upvalueCount = readCount(reader);
+  function->maxSlots = readCount(reader);
+  function->inlineKind = (InlineKind)readInt(reader, 1);
+  function->inlineSlot = (uint8_t)readInt(reader, 1);
+  function->inlineValue = readValue(reader);
+  Value name = readValue(reader);
+  if (IS_STRING(name)) {
+    function->name = AS_STRING(name);
+  } else if (!IS_NIL(name)) {
+    reader->failed = true;
+  }
+
+  if (function->arity > UINT8_MAX ||
+      function->upvalueCount > UINT16_COUNT ||
+      function->inlineKind > INLINE_FIELD ||
+      (function->inlineKind == INLINE_SLOT &&
+       function->inlineSlot > function->arity) ||
+      (function->inlineKind == INLINE_FIELD &&
+       !IS_STRING(function->inlineValue))) {
+    reader->failed = true;
+  }
+
+  Chunk* chunk = &function->chunk;
+  int count = readCount(reader);
+  int lineCount = readCount(reader);
+  // Every function ends in a return, and no run of lines is empty.
+  if (count == 0 || lineCount == 0 || lineCount > count ||
+      function->maxSlots <= function->arity ||
+      function->maxSlots - function->arity - 1 > count) {
+    reader->failed = true;
+  }
+  readPadding(reader, sizeof(int));
+  const uint8_t* lines = readBytes(reader,
+                                   (size_t)lineCount * sizeof(LineStart));
+  const uint8_t* code = readBytes(reader, count);
+  if (code != NULL) {
+    function->obj.inImage = true;
+    chunk->count = count;
+    chunk->code = (uint8_t*)code;
+    chunk->lineCount = lineCount;
+    chunk->lines = (LineStart*)lines;
+  }
+
+  // Each constant takes at least a byte.
+  int constantCount = readCount(reader);
+  if ((size_t)constantCount > reader->length - reader->position) {
+    reader->failed = true;
+  }
+  for (int i = 0; i < constantCount && !reader->failed; i++) {
+    addConstant(chunk, readValue(reader));
+  }
+  // The code and lines are used where they lie, so nothing in them is
+  // taken on trust.
+  if (!reader->failed &&
+      (!checkLines(chunk) || !checkCode(function) || !checkStack(function))) {
+    reader->failed = true;
+  }
+
+  pop();
+  return reader->failed ? NULL : function;
+}
+
+/**
+    @brief Load the compiled form of source from a cache file.
+
+    Nothing past the header is read until the checksum of the rest of
+    the file matches the one the header records, which catches a file
+    damaged on disk. Once it does, the file stays mapped even if the
+    rest turns out to be malformed, since strings read before the
+    problem was found may already be interned.
+
+    @param path
+    @param source
+    @param length
+    @return ObjFunction* NULL if there is no usable cache, in which case
+            the source needs compiling.
+**/
+ObjFunction* loadCache(const char* path, const char* source, size_t length) {
+  size_t size;
+  uint8_t* data = mapImage(path, &size);
+  if (data == NULL) return NULL;
+
+  ImageReader reader = { data, size, 0, false };
+  uint32_t byteOrder = CACHE_BYTE_ORDER;
+  const uint8_t* magic = readBytes(&reader, strlen(CACHE_MAGIC));
+  const uint8_t* order = readBytes(&reader, sizeof(byteOrder));
+  bool current = order != NULL &&
+      memcmp(magic, CACHE_MAGIC, strlen(CACHE_MAGIC)) == 0 &&
+      memcmp(order, &byteOrder, sizeof(byteOrder)) == 0 &&
+      readInt(&reader, 4) == CACHE_VERSION &&
+      readInt(&reader, 1) == (uint64_t)vm.optimizeLevel &&
+      readInt(&reader, 8) == length &&
+      readInt(&reader, 8) == hashBytes(HASH_SEED, source, length);
+  uint64_t checksum = readInt(&reader, 8);
+  if (!current || reader.failed ||
+      checksum != hashBytes(HASH_SEED, data + reader.position,
+                            size - reader.position)) {
+    unmapImage(data, size);
+    return NULL;
+  }
+
+  CacheImage* image = ALLOCATE(CacheImage, 1);
+  image->data = data;
+  image->length = size;
+  image->next = vm.cacheImages;
+  vm.cacheImages = image;
+
+  // The script takes no arguments and closes over nothing.
+  ObjFunction* function = readFunction(&reader);
+  if (reader.position != reader.length || function == NULL ||
+      function->arity != 0 || function->upvalueCount != 0 ||
+      function->inlineKind != INLINE_NONE) {
+    function = NULL;
+  }
+  return function;
+}
+
+/**
+    @brief Unmap every cache image. Only safe once no object loaded from
+    them is referenced, which is when the VM is freed.
+
+**/
+void unmapCacheImages() {
+  CacheImage* image = vm.cacheImages;
+  while (image != NULL) {
+    CacheImage* next = image->next;
+    unmapImage(image->data, image->length);
+    FREE(CacheImage, image);
+    image = next;
+  }
+
+  vm.cacheImages = NULL;
+}
+
+/**
+    @brief Write the compiled form of source to a cache file.
+
+    Failing to write it is not an error; the next run compiles again.
+
+    @param path
+    @param source
+    @param length
+    @param function
+**/
+void saveCache(const char* path, const char* source, size_t length,
+               ObjFunction* function) {
+  ImageWriter writer;
+  if (!openImage(&writer, path)) return;
+
+  uint32_t byteOrder = CACHE_BYTE_ORDER;
+  writeBytes(&writer, CACHE_MAGIC, strlen(CACHE_MAGIC));
+  writeBytes(&writer, &byteOrder, sizeof(byteOrder));
+  writeInt(&writer, CACHE_VERSION, 4);
+  writeInt(&writer, vm.optimizeLevel, 1);
+  writeInt(&writer, length, 8);
+  writeInt(&writer, hashBytes(HASH_SEED, source, length), 8);
+
+  // The checksum covers everything after it, so it is filled in last.
+  size_t checksumPosition = writer.position;
+  writeInt(&writer, 0, 8);
+  writer.hash = HASH_SEED;
+  writeFunction(&writer, function);
+  patchInt(&writer, checksumPosition, writer.hash, 8);
+
+  closeImage(&writer);
+}
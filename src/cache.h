@@ -0,0 +1,32 @@
+/**
+    @file cache.h
+
+    @brief Header for compiled bytecode cache files.
+
+**/
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "object.h"
+
+// Bumped whenever the instruction set or the file layout changes, so
+// caches written by another build are recompiled rather than misread.
+#define CACHE_VERSION 5
+
+/**
+    @brief A cache file mapped into memory. Code, line tables and string
+    characters loaded from it point into the mapping, so it stays mapped
+    until the VM is freed.
+**/
+typedef struct sCacheImage {
+  struct sCacheImage* next;
+  void* data;
+  size_t length;
+} CacheImage;
+
+ObjFunction* loadCache(const char* path, const char* source, size_t length);
+void saveCache(const char* path, const char* source, size_t length,
+               ObjFunction* function);
+void unmapCacheImages();
+
+#endif
@@ -19,6 +19,8 @@ void initChunk(Chunk* chunk) {
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = NULL;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
   chunk->lines = NULL;
   initValueArray(&chunk->constants);
 }
@@ -30,7 +32,7 @@ void initChunk(Chunk* chunk) {
 **/
 void freeChunk(Chunk* chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
   freeValueArray(&chunk->constants);
   initChunk(chunk);
 }
@@ -48,13 +50,64 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
     chunk->capacity = GROW_CAPACITY(oldCapacity);
     chunk->code = GROW_ARRAY(chunk->code, uint8_t,
         oldCapacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(chunk->lines, int,
-        oldCapacity, chunk->capacity);
   }
 
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
   chunk->count++;
+
+  if (chunk->lineCount > 0 &&
+      chunk->lines[chunk->lineCount - 1].line == line) {
+    return;
+  }
+
+  if (chunk->lineCapacity < chunk->lineCount + 1) {
+    int oldCapacity = chunk->lineCapacity;
+    chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->lines = GROW_ARRAY(chunk->lines, LineStart,
+        oldCapacity, chunk->lineCapacity);
+  }
+
+  LineStart* lineStart = &chunk->lines[chunk->lineCount++];
+  lineStart->offset = chunk->count - 1;
+  lineStart->line = line;
+}
+
+/**
+    @brief Drop the code from count on, along with its lines.
+
+    @param chunk
+    @param count
+**/
+void truncateChunk(Chunk* chunk, int count) {
+  chunk->count = count;
+  while (chunk->lineCount > 0 &&
+         chunk->lines[chunk->lineCount - 1].offset >= count) {
+    chunk->lineCount--;
+  }
+}
+
+/**
+    @brief Find the line the byte at offset was compiled from, by binary
+           search for the last run starting at or before it.
+
+    @param chunk
+    @param offset
+    @return int 0 if the chunk has no line information.
+**/
+int getLine(Chunk* chunk, int offset) {
+  int low = 0;
+  int high = chunk->lineCount - 1;
+  int line = 0;
+  while (low <= high) {
+    int middle = low + (high - low) / 2;
+    if (chunk->lines[middle].offset <= offset) {
+      line = chunk->lines[middle].line;
+      low = middle + 1;
+    } else {
+      high = middle - 1;
+    }
+  }
+  return line;
 }
 
 /**
@@ -70,3 +123,81 @@ int addConstant(Chunk* chunk, Value value) {
   pop();
   return chunk->constants.count - 1;
 }
+
+/**
+    @brief Size in bytes of the instruction at offset, operands and any
+           OP_WIDE prefix included.
+
+    @param chunk
+    @param offset
+    @return int
+**/
+int instructionLength(Chunk* chunk, int offset) {
+  bool wide = chunk->code[offset] == OP_WIDE;
+  int prefix = wide ? 1 : 0;
+  int index = wide ? 3 : 1;
+
+  switch (chunk->code[offset + prefix]) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_CLASS:
+    case OP_METHOD:
+      return prefix + 1 + index;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_LOOP:
+    case OP_LOOP_IF_TRUE:
+      return prefix + 1 + (wide ? 3 : 2);
+    case OP_FOR_LOOP:
+      return prefix + 1 + (wide ? 3 : 2) + 2;
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+      return prefix + 2 + index;
+    case OP_CLOSURE:
+    case OP_FRAME_CLOSURE: {
+      Value constant = chunk->constants.values[readOperand(chunk, offset)];
+      int upvalueCount = AS_FUNCTION(constant)->upvalueCount;
+      return prefix + 1 + index + upvalueCount * (1 + index);
+    }
+    default:
+      return 1;
+  }
+}
+
+/**
+    @brief Read the first operand of the instruction at offset: an index,
+           argument count or jump distance, 24 bits wide after OP_WIDE.
+
+    @param chunk
+    @param offset
+    @return int
+**/
+int readOperand(Chunk* chunk, int offset) {
+  uint8_t* code = &chunk->code[offset];
+  if (code[0] == OP_WIDE) return (code[2] << 16) | (code[3] << 8) | code[4];
+
+  switch (code[0]) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_LOOP:
+    case OP_LOOP_IF_TRUE:
+    case OP_FOR_LOOP:
+      return (code[1] << 8) | code[2];
+    default:
+      return code[1];
+  }
+}
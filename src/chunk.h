@@ -19,6 +19,7 @@ typedef enum {
   OP_TRUE,
   OP_FALSE,
   OP_POP,
+  OP_DUP,
   OP_GET_LOCAL,
   OP_SET_LOCAL,
   OP_GET_GLOBAL,
@@ -36,37 +37,78 @@ typedef enum {
   OP_SUBTRACT,
   OP_MULTIPLY,
   OP_DIVIDE,
+  // Arithmetic and comparisons on operands the optimizer has proven to be
+  // numbers. They skip the type checks of the plain forms.
+  OP_GREATER_NUMBER,
+  OP_LESS_NUMBER,
+  OP_ADD_NUMBER,
+  OP_SUBTRACT_NUMBER,
+  OP_MULTIPLY_NUMBER,
+  OP_DIVIDE_NUMBER,
   OP_NOT,
   OP_NEGATE,
   OP_PRINT,
   OP_JUMP,
   OP_JUMP_IF_FALSE,
+  OP_JUMP_IF_TRUE,
   OP_LOOP,
+  // Pops the condition and jumps back if it was truthy.
+  OP_LOOP_IF_TRUE,
+  // Counted loop step: pops a limit, adds a step constant to a local, and
+  // jumps back while the local is below the limit. The jump distance is
+  // followed by the local's slot and the step's constant index.
+  OP_FOR_LOOP,
   OP_CALL,
+  OP_TAIL_CALL,
   OP_INVOKE,
   OP_SUPER_INVOKE,
   OP_CLOSURE,
+  // OP_CLOSURE for a closure that cannot outlive its frame. It and its
+  // upvalues are carved out of the frame arena instead of the heap.
+  OP_FRAME_CLOSURE,
   OP_CLOSE_UPVALUE,
+  // Pops a local holding a frame closure, releasing the closure.
+  OP_POP_FRAME_CLOSURE,
   OP_RETURN,
   OP_CLASS,
   OP_INHERIT,
-  OP_METHOD
+  OP_METHOD,
+  // Prefix widening the next instruction's index or jump operand, and
+  // the indexes of an OP_CLOSURE's upvalues, to 24 bits.
+  OP_WIDE
 } OpCode;
 
+/**
+    @brief The start of a run of bytecode compiled from the same line.
+**/
+typedef struct {
+  int offset;
+  int line;
+} LineStart;
+
 /**
     @brief Chunk data structure.
+
+    Lines are run-length encoded: one LineStart per run of consecutive
+    bytes from the same source line, in order of offset.
 **/
 typedef struct {
   int count;
   int capacity;
   uint8_t* code;
-  int* lines;
+  int lineCount;
+  int lineCapacity;
+  LineStart* lines;
   ValueArray constants;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void truncateChunk(Chunk* chunk, int count);
+int getLine(Chunk* chunk, int offset);
 int addConstant(Chunk* chunk, Value value);
+int instructionLength(Chunk* chunk, int offset);
+int readOperand(Chunk* chunk, int offset);
 
 #endif
@@ -19,6 +19,16 @@
 #define DEBUG_LOG_GC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+#define UINT24_MAX ((1 << 24) - 1)
+
+// Storage with a copy per thread. Compile workers each run a VM of
+// their own.
+#ifdef __GNUC__
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
 
 #endif
 // In the book, we show them defined, but for working on them locally,
@@ -4,6 +4,7 @@
     @brief Parser and compiler combined.
 
 **/
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,19 +12,14 @@
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "number.h"
+#include "optimizer.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
-typedef struct {
-  Token current;
-  Token previous;
-  bool hadError;
-  bool panicMode;
-} Parser;
-
 typedef enum {
   PREC_NONE,
   PREC_ASSIGNMENT,  // =
@@ -38,7 +34,7 @@ typedef enum {
   PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(CompileContext* context, bool canAssign);
 
 typedef struct {
   ParseFn prefix;
@@ -50,10 +46,16 @@ typedef struct {
   Token name;
   int depth;
   bool isCaptured;
+  // Offset of the OP_CLOSURE a local function declaration initialized
+  // this local with, or -1.
+  int closure;
+  // Whether the local was read other than to call it directly, or
+  // captured, letting its closure outlive the call that made it.
+  bool escapes;
 } Local;
 
 typedef struct {
-  uint8_t index;
+  int index;
   bool isLocal;
 } Upvalue;
 
@@ -69,147 +71,353 @@ typedef struct Compiler {
   ObjFunction* function;
   FunctionType type;
 
-  Local locals[UINT8_COUNT];
+  Local* locals;
   int localCount;
-  Upvalue upvalues[UINT8_COUNT];
+  int localCapacity;
+  Upvalue* upvalues;
+  int upvalueCapacity;
   int scopeDepth;
+  // Whether a nested function captured one of this function's upvalues,
+  // which then has to outlive this function's closure.
+  bool upvaluesShared;
+
+  // Jumps too long for their 16-bit operand, widened by the optimizer.
+  FarJump* farJumps;
+  int farJumpCount;
+  int farJumpCapacity;
+
+  // Offset of the most recent constant load that can be folded, or -1.
+  int constantStart;
+  // Chunk count right after the most recent instruction known to leave
+  // a number on the stack, or -1.
+  int numericEnd;
+  // Chunk count right after the most recent OP_CALL, or -1.
+  int callEnd;
 } Compiler;
 
+/**
+    @brief Code cut from the end of the chunk to be emitted again later,
+           such as a loop condition that belongs after the loop body.
+**/
+typedef struct {
+  uint8_t* code;
+  int count;
+  // Line runs, with offsets relative to the start of the code.
+  LineStart* lines;
+  int lineCount;
+  // Far jumps inside the code, with offsets relative to its start.
+  FarJump* farJumps;
+  int farJumpCount;
+} CodeSpan;
+
 typedef struct ClassCompiler {
   struct ClassCompiler* enclosing;
   Token name;
   bool hasSuperclass;
 } ClassCompiler;
 
-Parser parser;
-
-Compiler* current = NULL;
-
-ClassCompiler* currentClass = NULL;
-
-static Chunk* currentChunk() {
-  return &current->function->chunk;
+static Chunk* currentChunk(CompileContext* context) {
+  return &context->current->function->chunk;
 }
 
-static void errorAt(Token* token, const char* message) {
-  if (parser.panicMode) return;
-  parser.panicMode = true;
+static void errorAt(CompileContext* context, Token* token,
+                    const char* message) {
+  if (context->parser.panicMode) return;
+  context->parser.panicMode = true;
 
-  fprintf(stderr, "[line %d] Error", token->line);
+  fprintf(context->errors, "[line %d] Error", token->line);
 
   if (token->type == TOKEN_EOF) {
-    fprintf(stderr, " at end");
+    fprintf(context->errors, " at end");
   } else if (token->type == TOKEN_ERROR) {
     // Nothing.
   } else {
-    fprintf(stderr, " at '%.*s'", token->length, token->start);
+    fprintf(context->errors, " at '%.*s'", token->length, token->start);
   }
 
-  fprintf(stderr, ": %s\n", message);
-  parser.hadError = true;
+  fprintf(context->errors, ": %s\n", message);
+  context->parser.hadError = true;
 }
-static void error(const char* message) {
-  errorAt(&parser.previous, message);
+static void error(CompileContext* context, const char* message) {
+  errorAt(context, &context->parser.previous, message);
 }
-static void errorAtCurrent(const char* message) {
-  errorAt(&parser.current, message);
+static void errorAtCurrent(CompileContext* context, const char* message) {
+  errorAt(context, &context->parser.current, message);
 }
 
-static void advance() {
-  parser.previous = parser.current;
+static void advance(CompileContext* context) {
+  context->parser.previous = context->parser.current;
 
   for (;;) {
-    parser.current = scanToken();
-    if (parser.current.type != TOKEN_ERROR) break;
+    context->parser.current = scanToken(&context->scanner);
+    if (context->parser.current.type != TOKEN_ERROR) break;
 
-    errorAtCurrent(parser.current.start);
+    errorAtCurrent(context, context->parser.current.start);
   }
 }
-static void consume(TokenType type, const char* message) {
-  if (parser.current.type == type) {
-    advance();
+static void consume(CompileContext* context, TokenType type,
+                    const char* message) {
+  if (context->parser.current.type == type) {
+    advance(context);
     return;
   }
 
-  errorAtCurrent(message);
+  errorAtCurrent(context, message);
 }
-static bool check(TokenType type) {
-  return parser.current.type == type;
+static bool check(CompileContext* context, TokenType type) {
+  return context->parser.current.type == type;
 }
-static bool match(TokenType type) {
-  if (!check(type)) return false;
-  advance();
+static bool match(CompileContext* context, TokenType type) {
+  if (!check(context, type)) return false;
+  advance(context);
   return true;
 }
-static void emitByte(uint8_t byte) {
-  writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(CompileContext* context, uint8_t byte) {
+  writeChunk(currentChunk(context), byte, context->parser.previous.line);
+}
+static void emitBytes(CompileContext* context, uint8_t byte1, uint8_t byte2) {
+  emitByte(context, byte1);
+  emitByte(context, byte2);
+}
+/**
+    @brief Emit an instruction with an index operand, prefixed with
+           OP_WIDE when the index does not fit in a byte.
+
+    @param context
+    @param instruction
+    @param operand
+**/
+static void emitOperand(CompileContext* context, uint8_t instruction,
+                        int operand) {
+  if (operand <= UINT8_MAX) {
+    emitBytes(context, instruction, (uint8_t)operand);
+    return;
+  }
+
+  emitBytes(context, OP_WIDE, instruction);
+  emitByte(context, (operand >> 16) & 0xff);
+  emitByte(context, (operand >> 8) & 0xff);
+  emitByte(context, operand & 0xff);
 }
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-  emitByte(byte1);
-  emitByte(byte2);
+
+/**
+    @brief Record a jump whose distance does not fit its operand. The
+           optimizer re-encodes the chunk with the jump widened.
+
+    @param context
+    @param offset Offset of the jump instruction.
+    @param target Offset it jumps to.
+**/
+static void addFarJump(CompileContext* context, int offset, int target) {
+  Compiler* compiler = context->current;
+  if (compiler->farJumpCount + 1 > compiler->farJumpCapacity) {
+    int oldCapacity = compiler->farJumpCapacity;
+    compiler->farJumpCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->farJumps = GROW_ARRAY(compiler->farJumps, FarJump,
+        oldCapacity, compiler->farJumpCapacity);
+  }
+
+  FarJump* jump = &compiler->farJumps[compiler->farJumpCount++];
+  jump->offset = offset;
+  jump->target = target;
 }
-static void emitLoop(int loopStart) {
-  emitByte(OP_LOOP);
+static void emitLoop(CompileContext* context, uint8_t instruction,
+                     int loopStart) {
+  emitByte(context, instruction);
 
-  int offset = currentChunk()->count - loopStart + 2;
-  if (offset > UINT16_MAX) error("Loop body too large.");
+  int offset = currentChunk(context)->count - loopStart + 2;
+  if (offset > UINT16_MAX) {
+    addFarJump(context, currentChunk(context)->count - 1, loopStart);
+    offset = 0;
+  }
 
-  emitByte((offset >> 8) & 0xff);
-  emitByte(offset & 0xff);
+  emitByte(context, (offset >> 8) & 0xff);
+  emitByte(context, offset & 0xff);
 }
-static int emitJump(uint8_t instruction) {
-  emitByte(instruction);
-  emitByte(0xff);
-  emitByte(0xff);
-  return currentChunk()->count - 2;
+/**
+    @brief Cut the code from start to the end of the chunk. The jumps in
+           a span are relative, so it can be pasted back anywhere.
+
+    @param context
+    @param start
+    @param span
+**/
+static void cutCode(CompileContext* context, int start, CodeSpan* span) {
+  Chunk* chunk = currentChunk(context);
+  span->count = chunk->count - start;
+  span->code = ALLOCATE(uint8_t, span->count);
+  if (span->count > 0) {
+    memcpy(span->code, &chunk->code[start], span->count);
+  }
+
+  // The run holding start may have begun before it.
+  int firstLine = chunk->lineCount;
+  while (firstLine > 0 && chunk->lines[firstLine - 1].offset > start) {
+    firstLine--;
+  }
+  if (firstLine > 0 && span->count > 0) firstLine--;
+  span->lineCount = chunk->lineCount - firstLine;
+  span->lines = ALLOCATE(LineStart, span->lineCount);
+  for (int i = 0; i < span->lineCount; i++) {
+    span->lines[i].offset = chunk->lines[firstLine + i].offset - start;
+    span->lines[i].line = chunk->lines[firstLine + i].line;
+  }
+
+  span->farJumpCount = 0;
+  for (int i = 0; i < context->current->farJumpCount; i++) {
+    if (context->current->farJumps[i].offset >= start) span->farJumpCount++;
+  }
+
+  span->farJumps = ALLOCATE(FarJump, span->farJumpCount);
+  int moved = 0;
+  int kept = 0;
+  for (int i = 0; i < context->current->farJumpCount; i++) {
+    FarJump jump = context->current->farJumps[i];
+    if (jump.offset >= start) {
+      jump.offset -= start;
+      jump.target -= start;
+      span->farJumps[moved++] = jump;
+    } else {
+      context->current->farJumps[kept++] = jump;
+    }
+  }
+  context->current->farJumpCount = kept;
+
+  truncateChunk(chunk, start);
+  context->current->constantStart = -1;
+  context->current->numericEnd = -1;
+  context->current->callEnd = -1;
 }
-static void emitReturn() {
-  if (current->type == TYPE_INITIALIZER) {
-    emitBytes(OP_GET_LOCAL, 0);
+
+/**
+    @brief Append a span cut by cutCode() and free it.
+
+    @param context
+    @param span
+**/
+static void pasteCode(CompileContext* context, CodeSpan* span) {
+  Chunk* chunk = currentChunk(context);
+  int start = chunk->count;
+  int line = 0;
+  for (int i = 0; i < span->count; i++) {
+    while (line + 1 < span->lineCount && span->lines[line + 1].offset <= i) {
+      line++;
+    }
+    writeChunk(chunk, span->code[i], span->lines[line].line);
+  }
+  for (int i = 0; i < span->farJumpCount; i++) {
+    addFarJump(context, start + span->farJumps[i].offset,
+               start + span->farJumps[i].target);
+  }
+
+  FREE_ARRAY(uint8_t, span->code, span->count);
+  FREE_ARRAY(LineStart, span->lines, span->lineCount);
+  FREE_ARRAY(FarJump, span->farJumps, span->farJumpCount);
+  context->current->constantStart = -1;
+  context->current->numericEnd = -1;
+  context->current->callEnd = -1;
+}
+static int emitJump(CompileContext* context, uint8_t instruction) {
+  emitByte(context, instruction);
+  emitByte(context, 0xff);
+  emitByte(context, 0xff);
+  return currentChunk(context)->count - 2;
+}
+static void emitReturn(CompileContext* context) {
+  if (context->current->type == TYPE_INITIALIZER) {
+    emitOperand(context, OP_GET_LOCAL, 0);
   } else {
-    emitByte(OP_NIL);
+    emitByte(context, OP_NIL);
   }
 
-  emitByte(OP_RETURN);
+  emitByte(context, OP_RETURN);
 }
-static uint8_t makeConstant(Value value) {
-  int constant = addConstant(currentChunk(), value);
-  if (constant > UINT8_MAX) {
-    error("Too many constants in one chunk.");
+static int makeConstant(CompileContext* context, Value value) {
+  int constant = addConstant(currentChunk(context), value);
+  if (constant > UINT24_MAX) {
+    error(context, "Too many constants in one chunk.");
     return 0;
   }
 
-  return (uint8_t)constant;
+  return constant;
 }
-static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
-}
-static void patchJump(int offset) {
+static void patchJump(CompileContext* context, int offset) {
   // -2 to adjust for the bytecode for the jump offset itself.
-  int jump = currentChunk()->count - offset - 2;
+  int jump = currentChunk(context)->count - offset - 2;
 
   if (jump > UINT16_MAX) {
-    error("Too much code to jump over.");
+    addFarJump(context, offset - 1, currentChunk(context)->count);
+    jump = 0;
   }
 
-  currentChunk()->code[offset] = (jump >> 8) & 0xff;
-  currentChunk()->code[offset + 1] = jump & 0xff;
+  currentChunk(context)->code[offset] = (jump >> 8) & 0xff;
+  currentChunk(context)->code[offset + 1] = jump & 0xff;
+
+  // Code before the jump target can no longer be folded away.
+  context->current->constantStart = -1;
+  context->current->numericEnd = -1;
 }
-static void initCompiler(Compiler* compiler, FunctionType type) {
-  compiler->enclosing = current;
+/**
+    @brief Claim the next local slot, growing the locals array as needed.
+
+    @param context
+    @return Local*
+**/
+static Local* pushLocal(CompileContext* context) {
+  Compiler* compiler = context->current;
+  if (compiler->localCount + 1 > compiler->localCapacity) {
+    int oldCapacity = compiler->localCapacity;
+    compiler->localCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->locals = GROW_ARRAY(compiler->locals, Local,
+        oldCapacity, compiler->localCapacity);
+  }
+
+  if (compiler->localCount + 1 > compiler->function->maxSlots) {
+    compiler->function->maxSlots = compiler->localCount + 1;
+  }
+
+  Local* local = &compiler->locals[compiler->localCount++];
+  local->closure = -1;
+  local->escapes = false;
+  return local;
+}
+/**
+    @brief Free the arrays a compiler owns once its function is emitted.
+
+    @param compiler
+**/
+static void freeCompiler(Compiler* compiler) {
+  FREE_ARRAY(Local, compiler->locals, compiler->localCapacity);
+  FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalueCapacity);
+  FREE_ARRAY(FarJump, compiler->farJumps, compiler->farJumpCapacity);
+}
+static void initCompiler(CompileContext* context, Compiler* compiler,
+                         FunctionType type) {
+  compiler->enclosing = context->current;
   compiler->function = NULL;
   compiler->type = type;
+  compiler->locals = NULL;
   compiler->localCount = 0;
+  compiler->localCapacity = 0;
+  compiler->upvalues = NULL;
+  compiler->upvalueCapacity = 0;
   compiler->scopeDepth = 0;
+  compiler->upvaluesShared = false;
+  compiler->farJumps = NULL;
+  compiler->farJumpCount = 0;
+  compiler->farJumpCapacity = 0;
+  compiler->constantStart = -1;
+  compiler->numericEnd = -1;
+  compiler->callEnd = -1;
   compiler->function = newFunction();
-  current = compiler;
+  context->current = compiler;
 
   if (type != TYPE_SCRIPT) {
-    current->function->name = copyString(parser.previous.start,
-                                         parser.previous.length);
+    compiler->function->name = copyString(context->parser.previous.start,
+                                          context->parser.previous.length);
   }
 
-  Local* local = &current->locals[current->localCount++];
+  Local* local = pushLocal(context);
   local->depth = 0;
   local->isCaptured = false;
   if (type != TYPE_FUNCTION) {
@@ -220,57 +428,316 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     local->name.length = 0;
   }
 }
-static ObjFunction* endCompiler() {
-  emitReturn();
-  ObjFunction* function = current->function;
+/**
+    @brief Record whether a finished function's body is simple enough for
+           callers to evaluate in place, without pushing a frame.
+
+    Only the code before the first OP_RETURN is matched. None of the
+    shapes jump, so nothing after that return is reachable.
+
+    @param function
+**/
+static void classifyInline(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  uint8_t* code = chunk->code;
+
+  switch (code[0]) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      if (chunk->count < 2 || code[1] != OP_RETURN) return;
+      function->inlineKind = INLINE_CONSTANT;
+      function->inlineValue = code[0] == OP_NIL ? NIL_VAL
+                                                : BOOL_VAL(code[0] == OP_TRUE);
+      return;
+
+    case OP_CONSTANT:
+      if (chunk->count < 3 || code[2] != OP_RETURN) return;
+      function->inlineKind = INLINE_CONSTANT;
+      function->inlineValue = chunk->constants.values[code[1]];
+      return;
+
+    case OP_GET_LOCAL:
+      if (chunk->count >= 3 && code[2] == OP_RETURN) {
+        function->inlineKind = INLINE_SLOT;
+        function->inlineSlot = code[1];
+      } else if (chunk->count >= 5 && code[1] == 0 &&
+                 code[2] == OP_GET_PROPERTY && code[4] == OP_RETURN) {
+        function->inlineKind = INLINE_FIELD;
+        function->inlineValue = chunk->constants.values[code[3]];
+      }
+      return;
+  }
+}
+
+/**
+    @brief If a local holds a closure that never escapes, switch the
+           OP_CLOSURE that made it to OP_FRAME_CLOSURE.
+
+    @param context
+    @param local
+    @return bool Whether the closure lives in the frame.
+**/
+static bool keepClosureInFrame(CompileContext* context, Local* local) {
+  if (local->closure == -1 || local->escapes) return false;
+
+  uint8_t* code = &currentChunk(context)->code[local->closure];
+  if (code[0] == OP_WIDE) code++;
+  *code = OP_FRAME_CLOSURE;
+  return true;
+}
+
+static ObjFunction* endCompiler(CompileContext* context) {
+  emitReturn(context);
+  ObjFunction* function = context->current->function;
+
+  // Locals of the outermost scope are never popped; their closures are
+  // released when the frame returns.
+  for (int i = 0; i < context->current->localCount; i++) {
+    keepClosureInFrame(context, &context->current->locals[i]);
+  }
+
+  if (!context->parser.hadError &&
+      (vm.optimizeLevel > 0 || context->current->farJumpCount > 0)) {
+    optimizeFunction(function, vm.optimizeLevel, context->current->farJumps,
+                     context->current->farJumpCount);
+  }
+  if (!context->parser.hadError) measureStack(function);
+  if (!context->parser.hadError && context->current->type != TYPE_SCRIPT) {
+    classifyInline(function);
+  }
 
 #ifdef DEBUG_PRINT_CODE
-  if (!parser.hadError) {
-    disassembleChunk(currentChunk(),
+  if (!context->parser.hadError) {
+    disassembleChunk(currentChunk(context),
         function->name != NULL ? function->name->chars : "<script>");
   }
 #endif
 
-  current = current->enclosing;
+  context->current = context->current->enclosing;
   return function;
 }
-static void beginScope() {
-  current->scopeDepth++;
+static void beginScope(CompileContext* context) {
+  context->current->scopeDepth++;
 }
-static void endScope() {
-  current->scopeDepth--;
+static void endScope(CompileContext* context) {
+  context->current->scopeDepth--;
 
-  while (current->localCount > 0 &&
-         current->locals[current->localCount - 1].depth >
-            current->scopeDepth) {
-    if (current->locals[current->localCount - 1].isCaptured) {
-      emitByte(OP_CLOSE_UPVALUE);
+  while (context->current->localCount > 0 &&
+         context->current->locals[context->current->localCount - 1].depth >
+            context->current->scopeDepth) {
+    Local* local = &context->current->locals[context->current->localCount - 1];
+    if (local->isCaptured) {
+      emitByte(context, OP_CLOSE_UPVALUE);
+    } else if (keepClosureInFrame(context, local)) {
+      emitByte(context, OP_POP_FRAME_CLOSURE);
     } else {
-      emitByte(OP_POP);
+      emitByte(context, OP_POP);
     }
-    current->localCount--;
+    context->current->localCount--;
+  }
+}
+
+/**
+    @brief Decode the constant load at offset, if there is one.
+
+    @param context
+    @param offset
+    @param value
+    @return int The offset just past the load, or -1.
+**/
+static int readConstantLoad(CompileContext* context, int offset, Value* value) {
+  Chunk* chunk = currentChunk(context);
+  switch (chunk->code[offset]) {
+    case OP_WIDE:
+      if (chunk->code[offset + 1] != OP_CONSTANT) return -1;
+      // Fallthrough.
+    case OP_CONSTANT:
+      *value = chunk->constants.values[readOperand(chunk, offset)];
+      return offset + instructionLength(chunk, offset);
+    case OP_NIL:   *value = NIL_VAL; return offset + 1;
+    case OP_TRUE:  *value = BOOL_VAL(true); return offset + 1;
+    case OP_FALSE: *value = BOOL_VAL(false); return offset + 1;
+    default:       return -1;
+  }
+}
+
+/**
+    @brief Check whether the code from start to the end of the chunk is
+    exactly one foldable constant load.
+
+    @param context
+    @param start
+    @param value
+    @return true
+    @return false
+**/
+static bool endsWithConstant(CompileContext* context, int start,
+                             Value* value) {
+  if (context->current->constantStart != start || start == -1) return false;
+  return readConstantLoad(context, start, value) ==
+         currentChunk(context)->count;
+}
+
+/**
+    @brief Remove the code from start to the end of the chunk. Constants
+    it loaded are dropped too if nothing was added to the table after
+    them.
+
+    @param context
+    @param start
+**/
+static void truncateCode(CompileContext* context, int start) {
+  Chunk* chunk = currentChunk(context);
+
+  // The code being removed is at most two constant loads.
+  int indexes[2];
+  int indexCount = 0;
+  Value value;
+  for (int offset = start; offset < chunk->count;
+       offset = readConstantLoad(context, offset, &value)) {
+    if (chunk->code[offset] == OP_CONSTANT ||
+        chunk->code[offset] == OP_WIDE) {
+      indexes[indexCount++] = readOperand(chunk, offset);
+    }
+  }
+
+  while (indexCount > 0 &&
+         indexes[indexCount - 1] == chunk->constants.count - 1) {
+    chunk->constants.count--;
+    indexCount--;
+  }
+
+  truncateChunk(chunk, start);
+  context->current->constantStart = -1;
+  context->current->numericEnd = -1;
+}
+
+/**
+    @brief Emit the instruction that loads value, remembering it so that
+    an enclosing expression can fold it in turn.
+
+    @param context
+    @param value
+**/
+static void emitConstantLoad(CompileContext* context, Value value) {
+  int start = currentChunk(context)->count;
+
+  if (IS_NIL(value)) {
+    emitByte(context, OP_NIL);
+  } else if (IS_BOOL(value)) {
+    emitByte(context, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else {
+    emitOperand(context, OP_CONSTANT, makeConstant(context, value));
+  }
+
+  context->current->constantStart = start;
+  if (IS_NUMBER(value)) {
+    context->current->numericEnd = currentChunk(context)->count;
+  }
+}
+
+/**
+    @brief Evaluate a binary operator on two constants at compile time.
+    Operand types that would be a runtime error are left alone so that
+    the error still happens when the code runs.
+
+    @param operatorType
+    @param a
+    @param b
+    @param result
+    @return true
+    @return false
+**/
+static bool foldBinary(TokenType operatorType, Value a, Value b,
+                       Value* result) {
+  switch (operatorType) {
+    case TOKEN_EQUAL_EQUAL:
+      *result = BOOL_VAL(valuesEqual(a, b));
+      return true;
+    case TOKEN_BANG_EQUAL:
+      *result = BOOL_VAL(!valuesEqual(a, b));
+      return true;
+    default:
+      break;
+  }
+
+  if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+    ObjString* left = AS_STRING(a);
+    ObjString* right = AS_STRING(b);
+    int length = left->length + right->length;
+
+    char* chars = ALLOCATE(char, length + 1);
+    memcpy(chars, left->chars, left->length);
+    memcpy(chars + left->length, right->chars, right->length);
+    chars[length] = '\0';
+
+    *result = OBJ_VAL(takeString(chars, length));
+    return true;
+  }
+
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  switch (operatorType) {
+    case TOKEN_GREATER:       *result = BOOL_VAL(x > y); break;
+    case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); break;
+    case TOKEN_LESS:          *result = BOOL_VAL(x < y); break;
+    case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(!(x > y)); break;
+    case TOKEN_PLUS:          *result = NUMBER_VAL(x + y); break;
+    case TOKEN_MINUS:         *result = NUMBER_VAL(x - y); break;
+    case TOKEN_STAR:          *result = NUMBER_VAL(x * y); break;
+    case TOKEN_SLASH:         *result = NUMBER_VAL(x / y); break;
+    default:
+      return false;
+  }
+
+  return true;
+}
+
+/**
+    @brief Check for a right operand that leaves a number unchanged:
+    x * 1, x / 1 and x - 0. Only used when x is known to be a number,
+    since otherwise dropping the operator would hide a runtime error.
+
+    @param operatorType
+    @param b
+    @return true
+    @return false
+**/
+static bool isIdentity(TokenType operatorType, Value b) {
+  if (!IS_NUMBER(b)) return false;
+
+  switch (operatorType) {
+    case TOKEN_STAR:
+    case TOKEN_SLASH: return AS_NUMBER(b) == 1;
+    // Not "+ 0", because -0 + 0 is 0.
+    case TOKEN_MINUS: return AS_NUMBER(b) == 0 && !signbit(AS_NUMBER(b));
+    default:          return false;
   }
 }
 
-static void expression();
-static void statement();
-static void declaration();
+static void expression(CompileContext* context);
+static void statement(CompileContext* context);
+static void declaration(CompileContext* context);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(CompileContext* context, Precedence precedence);
 
-static uint8_t identifierConstant(Token* name) {
-  return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+static int identifierConstant(CompileContext* context, Token* name) {
+  return makeConstant(context, OBJ_VAL(copyString(name->start, name->length)));
 }
 static bool identifiersEqual(Token* a, Token* b) {
   if (a->length != b->length) return false;
   return memcmp(a->start, b->start, a->length) == 0;
 }
-static int resolveLocal(Compiler* compiler, Token* name) {
+static int resolveLocal(CompileContext* context, Compiler* compiler,
+                        Token* name) {
   for (int i = compiler->localCount - 1; i >= 0; i--) {
     Local* local = &compiler->locals[i];
     if (identifiersEqual(name, &local->name)) {
       if (local->depth == -1) {
-        error("Cannot read local variable in its own initializer.");
+        error(context, "Cannot read local variable in its own initializer.");
       }
       return i;
     }
@@ -278,7 +745,8 @@ static int resolveLocal(Compiler* compiler, Token* name) {
 
   return -1;
 }
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(CompileContext* context, Compiler* compiler, int index,
+                      bool isLocal) {
   int upvalueCount = compiler->function->upvalueCount;
 
   for (int i = 0; i < upvalueCount; i++) {
@@ -288,211 +756,256 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
     }
   }
 
-  if (upvalueCount == UINT8_COUNT) {
-    error("Too many closure variables in function.");
+  if (upvalueCount == UINT16_COUNT) {
+    error(context, "Too many closure variables in function.");
     return 0;
   }
 
+  if (upvalueCount + 1 > compiler->upvalueCapacity) {
+    int oldCapacity = compiler->upvalueCapacity;
+    compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->upvalues = GROW_ARRAY(compiler->upvalues, Upvalue,
+        oldCapacity, compiler->upvalueCapacity);
+  }
+
   compiler->upvalues[upvalueCount].isLocal = isLocal;
   compiler->upvalues[upvalueCount].index = index;
   return compiler->function->upvalueCount++;
 }
-static int resolveUpvalue(Compiler* compiler, Token* name) {
+static int resolveUpvalue(CompileContext* context, Compiler* compiler,
+                          Token* name) {
   if (compiler->enclosing == NULL) return -1;
 
-  int local = resolveLocal(compiler->enclosing, name);
+  int local = resolveLocal(context, compiler->enclosing, name);
   if (local != -1) {
     compiler->enclosing->locals[local].isCaptured = true;
-    return addUpvalue(compiler, (uint8_t)local, true);
+    compiler->enclosing->locals[local].escapes = true;
+    return addUpvalue(context, compiler, local, true);
   }
 
-  int upvalue = resolveUpvalue(compiler->enclosing, name);
+  int upvalue = resolveUpvalue(context, compiler->enclosing, name);
   if (upvalue != -1) {
-    return addUpvalue(compiler, (uint8_t)upvalue, false);
+    compiler->enclosing->upvaluesShared = true;
+    return addUpvalue(context, compiler, upvalue, false);
   }
 
   return -1;
 }
-static void addLocal(Token name) {
-  if (current->localCount == UINT8_COUNT) {
-    error("Too many local variables in function.");
+static void addLocal(CompileContext* context, Token name) {
+  if (context->current->localCount == UINT16_COUNT) {
+    error(context, "Too many local variables in function.");
     return;
   }
 
-  Local* local = &current->locals[current->localCount++];
+  Local* local = pushLocal(context);
   local->name = name;
   local->depth = -1;
   local->isCaptured = false;
 }
-static void declareVariable() {
+static void declareVariable(CompileContext* context) {
   // Global variables are implicitly declared.
-  if (current->scopeDepth == 0) return;
+  if (context->current->scopeDepth == 0) return;
 
-  Token* name = &parser.previous;
-  for (int i = current->localCount - 1; i >= 0; i--) {
-    Local* local = &current->locals[i];
-    if (local->depth != -1 && local->depth < current->scopeDepth) {
+  Token* name = &context->parser.previous;
+  for (int i = context->current->localCount - 1; i >= 0; i--) {
+    Local* local = &context->current->locals[i];
+    if (local->depth != -1 && local->depth < context->current->scopeDepth) {
       break; // [negative]
     }
 
     if (identifiersEqual(name, &local->name)) {
-      error("Variable with this name already declared in this scope.");
+      error(context, "Variable with this name already declared in this scope.");
     }
   }
 
-  addLocal(*name);
+  addLocal(context, *name);
 }
-static uint8_t parseVariable(const char* errorMessage) {
-  consume(TOKEN_IDENTIFIER, errorMessage);
+static int parseVariable(CompileContext* context, const char* errorMessage) {
+  consume(context, TOKEN_IDENTIFIER, errorMessage);
 
-  declareVariable();
-  if (current->scopeDepth > 0) return 0;
+  declareVariable(context);
+  if (context->current->scopeDepth > 0) return 0;
 
-  return identifierConstant(&parser.previous);
+  return identifierConstant(context, &context->parser.previous);
 }
-static void markInitialized() {
-  if (current->scopeDepth == 0) return;
-  current->locals[current->localCount - 1].depth =
-      current->scopeDepth;
+static void markInitialized(CompileContext* context) {
+  if (context->current->scopeDepth == 0) return;
+  context->current->locals[context->current->localCount - 1].depth =
+      context->current->scopeDepth;
 }
-static void defineVariable(uint8_t global) {
-  if (current->scopeDepth > 0) {
-    markInitialized();
+static void defineVariable(CompileContext* context, int global) {
+  if (context->current->scopeDepth > 0) {
+    markInitialized(context);
     return;
   }
 
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitOperand(context, OP_DEFINE_GLOBAL, global);
 }
-static uint8_t argumentList() {
+static uint8_t argumentList(CompileContext* context) {
   uint8_t argCount = 0;
-  if (!check(TOKEN_RIGHT_PAREN)) {
+  if (!check(context, TOKEN_RIGHT_PAREN)) {
     do {
-      expression();
+      expression(context);
 
       if (argCount == 255) {
-        error("Cannot have more than 255 arguments.");
+        error(context, "Cannot have more than 255 arguments.");
       }
       argCount++;
-    } while (match(TOKEN_COMMA));
+    } while (match(context, TOKEN_COMMA));
   }
 
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  consume(context, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
   return argCount;
 }
-static void and_(bool canAssign) {
+static void and_(CompileContext* context, bool canAssign) {
   (void)canAssign;
-  int endJump = emitJump(OP_JUMP_IF_FALSE);
+  int endJump = emitJump(context, OP_JUMP_IF_FALSE);
 
-  emitByte(OP_POP);
-  parsePrecedence(PREC_AND);
+  emitByte(context, OP_POP);
+  parsePrecedence(context, PREC_AND);
 
-  patchJump(endJump);
+  patchJump(context, endJump);
 }
-static void binary(bool canAssign) {
+static void binary(CompileContext* context, bool canAssign) {
   (void)canAssign;
   // Remember the operator.
-  TokenType operatorType = parser.previous.type;
+  TokenType operatorType = context->parser.previous.type;
+
+  // Remember whether the left operand is a constant or a number.
+  int leftStart = context->current->constantStart;
+  int rightStart = currentChunk(context)->count;
+  Value left;
+  bool leftConstant = endsWithConstant(context, leftStart, &left);
+  bool leftNumeric = context->current->numericEnd == rightStart;
 
   // Compile the right operand.
   ParseRule* rule = getRule(operatorType);
-  parsePrecedence((Precedence)(rule->precedence + 1));
+  parsePrecedence(context, (Precedence)(rule->precedence + 1));
+
+  Value right;
+  if (endsWithConstant(context, rightStart, &right)) {
+    Value result;
+    if (leftConstant && foldBinary(operatorType, left, right, &result)) {
+      truncateCode(context, leftStart);
+      emitConstantLoad(context, result);
+      return;
+    }
+
+    if (leftNumeric && isIdentity(operatorType, right)) {
+      truncateCode(context, rightStart);
+      context->current->numericEnd = rightStart;
+      return;
+    }
+  }
 
   // Emit the operator instruction.
   switch (operatorType) {
-    case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
-    case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
-    case TOKEN_GREATER:       emitByte(OP_GREATER); break;
-    case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-    case TOKEN_LESS:          emitByte(OP_LESS); break;
-    case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;
-    case TOKEN_PLUS:          emitByte(OP_ADD); break;
-    case TOKEN_MINUS:         emitByte(OP_SUBTRACT); break;
-    case TOKEN_STAR:          emitByte(OP_MULTIPLY); break;
-    case TOKEN_SLASH:         emitByte(OP_DIVIDE); break;
+    case TOKEN_BANG_EQUAL:    emitBytes(context, OP_EQUAL, OP_NOT); break;
+    case TOKEN_EQUAL_EQUAL:   emitByte(context, OP_EQUAL); break;
+    case TOKEN_GREATER:       emitByte(context, OP_GREATER); break;
+    case TOKEN_GREATER_EQUAL: emitBytes(context, OP_LESS, OP_NOT); break;
+    case TOKEN_LESS:          emitByte(context, OP_LESS); break;
+    case TOKEN_LESS_EQUAL:    emitBytes(context, OP_GREATER, OP_NOT); break;
+    case TOKEN_PLUS:          emitByte(context, OP_ADD); break;
+    case TOKEN_MINUS:         emitByte(context, OP_SUBTRACT); break;
+    case TOKEN_STAR:          emitByte(context, OP_MULTIPLY); break;
+    case TOKEN_SLASH:         emitByte(context, OP_DIVIDE); break;
     default:
       return; // Unreachable.
   }
+
+  if (operatorType == TOKEN_MINUS || operatorType == TOKEN_STAR ||
+      operatorType == TOKEN_SLASH) {
+    context->current->numericEnd = currentChunk(context)->count;
+  }
 }
-static void call(bool canAssign) {
+static void call(CompileContext* context, bool canAssign) {
   (void)canAssign;
-  uint8_t argCount = argumentList();
-  emitBytes(OP_CALL, argCount);
-}
-static void dot(bool canAssign) {
-  consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-  uint8_t name = identifierConstant(&parser.previous);
-
-  if (canAssign && match(TOKEN_EQUAL)) {
-    expression();
-    emitBytes(OP_SET_PROPERTY, name);
-  } else if (match(TOKEN_LEFT_PAREN)) {
-    uint8_t argCount = argumentList();
-    emitBytes(OP_INVOKE, name);
-    emitByte(argCount);
+  uint8_t argCount = argumentList(context);
+  emitBytes(context, OP_CALL, argCount);
+  context->current->callEnd = currentChunk(context)->count;
+}
+static void dot(CompileContext* context, bool canAssign) {
+  consume(context, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  int name = identifierConstant(context, &context->parser.previous);
+
+  if (canAssign && match(context, TOKEN_EQUAL)) {
+    expression(context);
+    emitOperand(context, OP_SET_PROPERTY, name);
+  } else if (match(context, TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList(context);
+    emitOperand(context, OP_INVOKE, name);
+    emitByte(context, argCount);
   } else {
-    emitBytes(OP_GET_PROPERTY, name);
+    emitOperand(context, OP_GET_PROPERTY, name);
   }
 }
-static void literal(bool canAssign) {
+static void literal(CompileContext* context, bool canAssign) {
   (void)canAssign;
-  switch (parser.previous.type) {
-    case TOKEN_FALSE: emitByte(OP_FALSE); break;
-    case TOKEN_NIL: emitByte(OP_NIL); break;
-    case TOKEN_TRUE: emitByte(OP_TRUE); break;
+  switch (context->parser.previous.type) {
+    case TOKEN_FALSE: emitConstantLoad(context, BOOL_VAL(false)); break;
+    case TOKEN_NIL: emitConstantLoad(context, NIL_VAL); break;
+    case TOKEN_TRUE: emitConstantLoad(context, BOOL_VAL(true)); break;
     default:
       return; // Unreachable.
   }
 }
-static void grouping(bool canAssign) {
+static void grouping(CompileContext* context, bool canAssign) {
   (void)canAssign;
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+  expression(context);
+  consume(context, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
-static void number(bool canAssign) {
+static void number(CompileContext* context, bool canAssign) {
   (void)canAssign;
-  double value = strtod(parser.previous.start, NULL);
-  emitConstant(NUMBER_VAL(value));
+  double value = parseNumber(context->parser.previous.start,
+                             context->parser.previous.length);
+  emitConstantLoad(context, NUMBER_VAL(value));
 }
-static void or_(bool canAssign) {
+static void or_(CompileContext* context, bool canAssign) {
   (void)canAssign;
-  int elseJump = emitJump(OP_JUMP_IF_FALSE);
-  int endJump = emitJump(OP_JUMP);
+  int elseJump = emitJump(context, OP_JUMP_IF_FALSE);
+  int endJump = emitJump(context, OP_JUMP);
 
-  patchJump(elseJump);
-  emitByte(OP_POP);
+  patchJump(context, elseJump);
+  emitByte(context, OP_POP);
 
-  parsePrecedence(PREC_OR);
-  patchJump(endJump);
+  parsePrecedence(context, PREC_OR);
+  patchJump(context, endJump);
 }
-static void string(bool canAssign) {
+static void string(CompileContext* context, bool canAssign) {
   (void)canAssign;
-  emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,
-                                  parser.previous.length - 2)));
+  Token* token = &context->parser.previous;
+  emitConstantLoad(context,
+                   OBJ_VAL(copyString(token->start + 1, token->length - 2)));
 }
-static void namedVariable(Token name, bool canAssign) {
+static void namedVariable(CompileContext* context, Token name, bool canAssign) {
   uint8_t getOp, setOp;
-  int arg = resolveLocal(current, &name);
+  int arg = resolveLocal(context, context->current, &name);
   if (arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
-  } else if ((arg = resolveUpvalue(current, &name)) != -1) {
+  } else if ((arg = resolveUpvalue(context, context->current, &name)) != -1) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(&name);
+    arg = identifierConstant(context, &name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
 
-  if (canAssign && match(TOKEN_EQUAL)) {
-    expression();
-    emitBytes(setOp, (uint8_t)arg);
+  if (canAssign && match(context, TOKEN_EQUAL)) {
+    expression(context);
+    emitOperand(context, setOp, arg);
   } else {
-    emitBytes(getOp, (uint8_t)arg);
+    // Only a direct call keeps a local closure from escaping.
+    if (getOp == OP_GET_LOCAL && !check(context, TOKEN_LEFT_PAREN)) {
+      context->current->locals[arg].escapes = true;
+    }
+    emitOperand(context, getOp, arg);
   }
 }
-static void variable(bool canAssign) {
-  namedVariable(parser.previous, canAssign);
+static void variable(CompileContext* context, bool canAssign) {
+  namedVariable(context, context->parser.previous, canAssign);
 }
 static Token syntheticToken(const char* text) {
   Token token;
@@ -500,48 +1013,70 @@ static Token syntheticToken(const char* text) {
   token.length = (int)strlen(text);
   return token;
 }
-static void super_(bool canAssign) {
+static void super_(CompileContext* context, bool canAssign) {
   (void)canAssign;
-  if (currentClass == NULL) {
-    error("Cannot use 'super' outside of a class.");
-  } else if (!currentClass->hasSuperclass) {
-    error("Cannot use 'super' in a class with no superclass.");
-  }
-
-  consume(TOKEN_DOT, "Expect '.' after 'super'.");
-  consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-  uint8_t name = identifierConstant(&parser.previous);
-
-  namedVariable(syntheticToken("this"), false);
-  if (match(TOKEN_LEFT_PAREN)) {
-    uint8_t argCount = argumentList();
-    namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_SUPER_INVOKE, name);
-    emitByte(argCount);
+  if (context->currentClass == NULL) {
+    error(context, "Cannot use 'super' outside of a class.");
+  } else if (!context->currentClass->hasSuperclass) {
+    error(context, "Cannot use 'super' in a class with no superclass.");
+  }
+
+  consume(context, TOKEN_DOT, "Expect '.' after 'super'.");
+  consume(context, TOKEN_IDENTIFIER, "Expect superclass method name.");
+  int name = identifierConstant(context, &context->parser.previous);
+
+  namedVariable(context, syntheticToken("this"), false);
+  if (match(context, TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList(context);
+    namedVariable(context, syntheticToken("super"), false);
+    emitOperand(context, OP_SUPER_INVOKE, name);
+    emitByte(context, argCount);
   } else {
-    namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_GET_SUPER, name);
+    namedVariable(context, syntheticToken("super"), false);
+    emitOperand(context, OP_GET_SUPER, name);
   }
 }
-static void this_(bool canAssign) {
+static void this_(CompileContext* context, bool canAssign) {
   (void)canAssign;
-  if (currentClass == NULL) {
-    error("Cannot use 'this' outside of a class.");
+  if (context->currentClass == NULL) {
+    error(context, "Cannot use 'this' outside of a class.");
     return;
   }
-  variable(false);
+  variable(context, false);
 } // [this]
-static void unary(bool canAssign) {
+static void unary(CompileContext* context, bool canAssign) {
   (void)canAssign;
-  TokenType operatorType = parser.previous.type;
+  TokenType operatorType = context->parser.previous.type;
+  int operandStart = currentChunk(context)->count;
 
   // Compile the operand.
-  parsePrecedence(PREC_UNARY);
+  parsePrecedence(context, PREC_UNARY);
+
+  // Fold constant operands. Negating anything but a number is left for
+  // the runtime error.
+  Value operand;
+  if (endsWithConstant(context, operandStart, &operand)) {
+    if (operatorType == TOKEN_BANG) {
+      truncateCode(context, operandStart);
+      emitConstantLoad(context, BOOL_VAL(IS_NIL(operand) ||
+          (IS_BOOL(operand) && !AS_BOOL(operand))));
+      return;
+    }
+
+    if (operatorType == TOKEN_MINUS && IS_NUMBER(operand)) {
+      truncateCode(context, operandStart);
+      emitConstantLoad(context, NUMBER_VAL(-AS_NUMBER(operand)));
+      return;
+    }
+  }
 
   // Emit the operator instruction.
   switch (operatorType) {
-    case TOKEN_BANG: emitByte(OP_NOT); break;
-    case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+    case TOKEN_BANG: emitByte(context, OP_NOT); break;
+    case TOKEN_MINUS:
+      emitByte(context, OP_NEGATE);
+      context->current->numericEnd = currentChunk(context)->count;
+      break;
     default:
       return; // Unreachable.
   }
@@ -588,266 +1123,310 @@ ParseRule rules[] = {
   { NULL,     NULL,    PREC_NONE },       // TOKEN_ERROR
   { NULL,     NULL,    PREC_NONE },       // TOKEN_EOF
 };
-static void parsePrecedence(Precedence precedence) {
-  advance();
-  ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+static void parsePrecedence(CompileContext* context, Precedence precedence) {
+  advance(context);
+  ParseFn prefixRule = getRule(context->parser.previous.type)->prefix;
   if (prefixRule == NULL) {
-    error("Expect expression.");
+    error(context, "Expect expression.");
     return;
   }
 
   bool canAssign = precedence <= PREC_ASSIGNMENT;
-  prefixRule(canAssign);
+  prefixRule(context, canAssign);
 
-  while (precedence <= getRule(parser.current.type)->precedence) {
-    advance();
-    ParseFn infixRule = getRule(parser.previous.type)->infix;
-    infixRule(canAssign);
+  while (precedence <= getRule(context->parser.current.type)->precedence) {
+    advance(context);
+    ParseFn infixRule = getRule(context->parser.previous.type)->infix;
+    infixRule(context, canAssign);
   }
 
-  if (canAssign && match(TOKEN_EQUAL)) {
-    error("Invalid assignment target.");
+  if (canAssign && match(context, TOKEN_EQUAL)) {
+    error(context, "Invalid assignment target.");
   }
 }
 static ParseRule* getRule(TokenType type) {
   return &rules[type];
 }
-static void expression() {
-  parsePrecedence(PREC_ASSIGNMENT);
+static void expression(CompileContext* context) {
+  parsePrecedence(context, PREC_ASSIGNMENT);
 }
-static void block() {
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    declaration();
+static void block(CompileContext* context) {
+  while (!check(context, TOKEN_RIGHT_BRACE) && !check(context, TOKEN_EOF)) {
+    declaration(context);
   }
 
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+  consume(context, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
-static void function(FunctionType type) {
+/**
+    @brief Compile a function and emit the closure that makes it.
+
+    @param context
+    @param type
+    @return bool Whether the function shares its upvalues with functions
+            nested in it, which rules out keeping its closure in a frame.
+**/
+static bool function(CompileContext* context, FunctionType type) {
   Compiler compiler;
-  initCompiler(&compiler, type);
-  beginScope(); // [no-end-scope]
+  initCompiler(context, &compiler, type);
+  beginScope(context); // [no-end-scope]
 
   // Compile the parameter list.
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-  if (!check(TOKEN_RIGHT_PAREN)) {
+  consume(context, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  if (!check(context, TOKEN_RIGHT_PAREN)) {
     do {
-      current->function->arity++;
-      if (current->function->arity > 255) {
-        errorAtCurrent("Cannot have more than 255 parameters.");
+      context->current->function->arity++;
+      if (context->current->function->arity > 255) {
+        errorAtCurrent(context, "Cannot have more than 255 parameters.");
       }
 
-      uint8_t paramConstant = parseVariable("Expect parameter name.");
-      defineVariable(paramConstant);
-    } while (match(TOKEN_COMMA));
+      int paramConstant = parseVariable(context, "Expect parameter name.");
+      defineVariable(context, paramConstant);
+    } while (match(context, TOKEN_COMMA));
   }
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+  consume(context, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
 
   // The body.
-  consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-  block();
+  consume(context, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  block(context);
 
   // Create the function object.
-  ObjFunction* function = endCompiler();
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+  ObjFunction* function = endCompiler(context);
+  int constant = makeConstant(context, OBJ_VAL(function));
 
+  // One OP_WIDE covers the constant and every upvalue index.
+  bool wide = constant > UINT8_MAX;
   for (int i = 0; i < function->upvalueCount; i++) {
-    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-    emitByte(compiler.upvalues[i].index);
+    if (compiler.upvalues[i].index > UINT8_MAX) wide = true;
   }
+
+  if (wide) emitByte(context, OP_WIDE);
+  emitByte(context, OP_CLOSURE);
+  int width = wide ? 3 : 1;
+  for (int shift = (width - 1) * 8; shift >= 0; shift -= 8) {
+    emitByte(context, (constant >> shift) & 0xff);
+  }
+
+  for (int i = 0; i < function->upvalueCount; i++) {
+    emitByte(context, compiler.upvalues[i].isLocal ? 1 : 0);
+    int index = compiler.upvalues[i].index;
+    for (int shift = (width - 1) * 8; shift >= 0; shift -= 8) {
+      emitByte(context, (index >> shift) & 0xff);
+    }
+  }
+
+  freeCompiler(&compiler);
+  return compiler.upvaluesShared;
 }
-static void method() {
-  consume(TOKEN_IDENTIFIER, "Expect method name.");
-  uint8_t constant = identifierConstant(&parser.previous);
+static void method(CompileContext* context) {
+  consume(context, TOKEN_IDENTIFIER, "Expect method name.");
+  int constant = identifierConstant(context, &context->parser.previous);
 
   FunctionType type = TYPE_METHOD;
-  if (parser.previous.length == 4 &&
-      memcmp(parser.previous.start, "init", 4) == 0) {
+  if (context->parser.previous.length == 4 &&
+      memcmp(context->parser.previous.start, "init", 4) == 0) {
     type = TYPE_INITIALIZER;
   }
 
-  function(type);
-  emitBytes(OP_METHOD, constant);
+  function(context, type);
+  emitOperand(context, OP_METHOD, constant);
 }
-static void classDeclaration() {
-  consume(TOKEN_IDENTIFIER, "Expect class name.");
-  Token className = parser.previous;
-  uint8_t nameConstant = identifierConstant(&parser.previous);
-  declareVariable();
+static void classDeclaration(CompileContext* context) {
+  consume(context, TOKEN_IDENTIFIER, "Expect class name.");
+  Token className = context->parser.previous;
+  int nameConstant = identifierConstant(context, &context->parser.previous);
+  declareVariable(context);
 
-  emitBytes(OP_CLASS, nameConstant);
-  defineVariable(nameConstant);
+  emitOperand(context, OP_CLASS, nameConstant);
+  defineVariable(context, nameConstant);
 
   ClassCompiler classCompiler;
-  classCompiler.name = parser.previous;
+  classCompiler.name = context->parser.previous;
   classCompiler.hasSuperclass = false;
-  classCompiler.enclosing = currentClass;
-  currentClass = &classCompiler;
+  classCompiler.enclosing = context->currentClass;
+  context->currentClass = &classCompiler;
 
-  if (match(TOKEN_LESS)) {
-    consume(TOKEN_IDENTIFIER, "Expect superclass name.");
-    variable(false);
+  if (match(context, TOKEN_LESS)) {
+    consume(context, TOKEN_IDENTIFIER, "Expect superclass name.");
+    variable(context, false);
 
-    if (identifiersEqual(&className, &parser.previous)) {
-      error("A class cannot inherit from itself.");
+    if (identifiersEqual(&className, &context->parser.previous)) {
+      error(context, "A class cannot inherit from itself.");
     }
 
-    beginScope();
-    addLocal(syntheticToken("super"));
-    defineVariable(0);
+    beginScope(context);
+    addLocal(context, syntheticToken("super"));
+    defineVariable(context, 0);
 
-    namedVariable(className, false);
-    emitByte(OP_INHERIT);
+    namedVariable(context, className, false);
+    emitByte(context, OP_INHERIT);
     classCompiler.hasSuperclass = true;
   }
 
-  namedVariable(className, false);
-  consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    method();
+  namedVariable(context, className, false);
+  consume(context, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (!check(context, TOKEN_RIGHT_BRACE) && !check(context, TOKEN_EOF)) {
+    method(context);
   }
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-  emitByte(OP_POP);
+  consume(context, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  emitByte(context, OP_POP);
 
   if (classCompiler.hasSuperclass) {
-    endScope();
+    endScope(context);
   }
 
-  currentClass = currentClass->enclosing;
+  context->currentClass = context->currentClass->enclosing;
 }
-static void funDeclaration() {
-  uint8_t global = parseVariable("Expect function name.");
-  markInitialized();
-  function(TYPE_FUNCTION);
-  defineVariable(global);
+static void funDeclaration(CompileContext* context) {
+  int global = parseVariable(context, "Expect function name.");
+  markInitialized(context);
+
+  int closure = currentChunk(context)->count;
+  bool upvaluesShared = function(context, TYPE_FUNCTION);
+  if (context->current->scopeDepth > 0) {
+    Local* local = &context->current->locals[context->current->localCount - 1];
+    local->closure = closure;
+    if (upvaluesShared) local->escapes = true;
+  }
+  defineVariable(context, global);
 }
-static void varDeclaration() {
-  uint8_t global = parseVariable("Expect variable name.");
+static void varDeclaration(CompileContext* context) {
+  int global = parseVariable(context, "Expect variable name.");
 
-  if (match(TOKEN_EQUAL)) {
-    expression();
+  if (match(context, TOKEN_EQUAL)) {
+    expression(context);
   } else {
-    emitByte(OP_NIL);
+    emitByte(context, OP_NIL);
   }
-  consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+  consume(context, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
-  defineVariable(global);
+  defineVariable(context, global);
 }
-static void expressionStatement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-  emitByte(OP_POP);
+static void expressionStatement(CompileContext* context) {
+  expression(context);
+  consume(context, TOKEN_SEMICOLON, "Expect ';' after expression.");
+  emitByte(context, OP_POP);
 }
-static void forStatement() {
-  beginScope();
+static void forStatement(CompileContext* context) {
+  beginScope(context);
 
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-  if (match(TOKEN_SEMICOLON)) {
+  consume(context, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  if (match(context, TOKEN_SEMICOLON)) {
     // No initializer.
-  } else if (match(TOKEN_VAR)) {
-    varDeclaration();
+  } else if (match(context, TOKEN_VAR)) {
+    varDeclaration(context);
   } else {
-    expressionStatement();
+    expressionStatement(context);
   }
 
-  int loopStart = currentChunk()->count;
-
-  int exitJump = -1;
-  if (!match(TOKEN_SEMICOLON)) {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
-
-    // Jump out of the loop if the condition is false.
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP); // Condition.
+  // As in whileStatement(), the condition is moved after the body, and
+  // the increment is moved between the two.
+  int entryJump = -1;
+  CodeSpan condition;
+  if (!match(context, TOKEN_SEMICOLON)) {
+    entryJump = emitJump(context, OP_JUMP);
+
+    int conditionStart = currentChunk(context)->count;
+    expression(context);
+    consume(context, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+    cutCode(context, conditionStart, &condition);
   }
 
-  if (!match(TOKEN_RIGHT_PAREN)) {
-    int bodyJump = emitJump(OP_JUMP);
-
-    int incrementStart = currentChunk()->count;
-    expression();
-    emitByte(OP_POP);
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
-
-    emitLoop(loopStart);
-    loopStart = incrementStart;
-    patchJump(bodyJump);
+  int incrementStart = currentChunk(context)->count;
+  if (!match(context, TOKEN_RIGHT_PAREN)) {
+    expression(context);
+    emitByte(context, OP_POP);
+    consume(context, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
   }
+  CodeSpan increment;
+  cutCode(context, incrementStart, &increment);
 
-  statement();
-
-  emitLoop(loopStart);
+  int loopStart = currentChunk(context)->count;
+  statement(context);
+  pasteCode(context, &increment);
 
-  if (exitJump != -1) {
-    patchJump(exitJump);
-    emitByte(OP_POP); // Condition.
+  if (entryJump != -1) {
+    patchJump(context, entryJump);
+    pasteCode(context, &condition);
+    emitLoop(context, OP_LOOP_IF_TRUE, loopStart);
+  } else {
+    emitLoop(context, OP_LOOP, loopStart);
   }
 
-  endScope();
+  endScope(context);
 }
-static void ifStatement() {
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition."); // [paren]
+static void ifStatement(CompileContext* context) {
+  consume(context, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  expression(context);
+  consume(context, TOKEN_RIGHT_PAREN, "Expect ')' after condition."); // [paren]
 
-  int thenJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
-  statement();
+  int thenJump = emitJump(context, OP_JUMP_IF_FALSE);
+  emitByte(context, OP_POP);
+  statement(context);
 
-  int elseJump = emitJump(OP_JUMP);
+  int elseJump = emitJump(context, OP_JUMP);
 
-  patchJump(thenJump);
-  emitByte(OP_POP);
+  patchJump(context, thenJump);
+  emitByte(context, OP_POP);
 
-  if (match(TOKEN_ELSE)) statement();
-  patchJump(elseJump);
+  if (match(context, TOKEN_ELSE)) statement(context);
+  patchJump(context, elseJump);
 }
-static void printStatement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-  emitByte(OP_PRINT);
+static void printStatement(CompileContext* context) {
+  expression(context);
+  consume(context, TOKEN_SEMICOLON, "Expect ';' after value.");
+  emitByte(context, OP_PRINT);
 }
-static void returnStatement() {
-  if (current->type == TYPE_SCRIPT) {
-    error("Cannot return from top-level code.");
+static void returnStatement(CompileContext* context) {
+  if (context->current->type == TYPE_SCRIPT) {
+    error(context, "Cannot return from top-level code.");
   }
 
-  if (match(TOKEN_SEMICOLON)) {
-    emitReturn();
+  if (match(context, TOKEN_SEMICOLON)) {
+    emitReturn(context);
   } else {
-    if (current->type == TYPE_INITIALIZER) {
-      error("Cannot return a value from an initializer.");
+    if (context->current->type == TYPE_INITIALIZER) {
+      error(context, "Cannot return a value from an initializer.");
     }
 
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-    emitByte(OP_RETURN);
+    expression(context);
+    consume(context, TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+    // A call whose result is returned directly can reuse this frame.
+    Chunk* chunk = currentChunk(context);
+    if (context->current->callEnd == chunk->count &&
+        chunk->code[chunk->count - 2] == OP_CALL) {
+      chunk->code[chunk->count - 2] = OP_TAIL_CALL;
+    }
+    emitByte(context, OP_RETURN);
   }
 }
-static void whileStatement() {
-  int loopStart = currentChunk()->count;
-
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+static void whileStatement(CompileContext* context) {
+  // The condition is emitted after the body, where one conditional jump
+  // both tests it and loops back. The loop is entered by jumping to it.
+  int entryJump = emitJump(context, OP_JUMP);
 
-  int exitJump = emitJump(OP_JUMP_IF_FALSE);
+  consume(context, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+  int conditionStart = currentChunk(context)->count;
+  expression(context);
+  consume(context, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-  emitByte(OP_POP);
-  statement();
+  CodeSpan condition;
+  cutCode(context, conditionStart, &condition);
 
-  emitLoop(loopStart);
+  int loopStart = currentChunk(context)->count;
+  statement(context);
 
-  patchJump(exitJump);
-  emitByte(OP_POP);
+  patchJump(context, entryJump);
+  pasteCode(context, &condition);
+  emitLoop(context, OP_LOOP_IF_TRUE, loopStart);
 }
-static void synchronize() {
-  parser.panicMode = false;
+static void synchronize(CompileContext* context) {
+  context->parser.panicMode = false;
 
-  while (parser.current.type != TOKEN_EOF) {
-    if (parser.previous.type == TOKEN_SEMICOLON) return;
+  while (context->parser.current.type != TOKEN_EOF) {
+    if (context->parser.previous.type == TOKEN_SEMICOLON) return;
 
-    switch (parser.current.type) {
+    switch (context->parser.current.type) {
       case TOKEN_CLASS:
       case TOKEN_FUN:
       case TOKEN_VAR:
@@ -863,63 +1442,149 @@ static void synchronize() {
         ;
     }
 
-    advance();
+    advance(context);
   }
 }
-static void declaration() {
-  if (match(TOKEN_CLASS)) {
-    classDeclaration();
-  } else if (match(TOKEN_FUN)) {
-    funDeclaration();
-  } else if (match(TOKEN_VAR)) {
-    varDeclaration();
+static void declaration(CompileContext* context) {
+  if (match(context, TOKEN_CLASS)) {
+    classDeclaration(context);
+  } else if (match(context, TOKEN_FUN)) {
+    funDeclaration(context);
+  } else if (match(context, TOKEN_VAR)) {
+    varDeclaration(context);
   } else {
-    statement();
-  }
-
-  if (parser.panicMode) synchronize();
-}
-static void statement() {
-  if (match(TOKEN_PRINT)) {
-    printStatement();
-  } else if (match(TOKEN_FOR)) {
-    forStatement();
-  } else if (match(TOKEN_IF)) {
-    ifStatement();
-  } else if (match(TOKEN_RETURN)) {
-    returnStatement();
-  } else if (match(TOKEN_WHILE)) {
-    whileStatement();
-  } else if (match(TOKEN_LEFT_BRACE)) {
-    beginScope();
-    block();
-    endScope();
+    statement(context);
+  }
+
+  if (context->parser.panicMode) synchronize(context);
+}
+static void statement(CompileContext* context) {
+  if (match(context, TOKEN_PRINT)) {
+    printStatement(context);
+  } else if (match(context, TOKEN_FOR)) {
+    forStatement(context);
+  } else if (match(context, TOKEN_IF)) {
+    ifStatement(context);
+  } else if (match(context, TOKEN_RETURN)) {
+    returnStatement(context);
+  } else if (match(context, TOKEN_WHILE)) {
+    whileStatement(context);
+  } else if (match(context, TOKEN_LEFT_BRACE)) {
+    beginScope(context);
+    block(context);
+    endScope(context);
   } else {
-    expressionStatement();
+    expressionStatement(context);
   }
 }
 
-ObjFunction* compile(const char* source) {
-  initScanner(source);
-  Compiler compiler;
-  initCompiler(&compiler, TYPE_SCRIPT);
+// Roughly how many times each identifier or string literal appears in
+// a script. Used to turn a token count into a count of distinct strings.
+// Measured on the scripts in test/language/benchmark, it is mostly
+// between 2.4 and 8, with a median of 3.3. Rounding up errs toward a
+// block too small, whose overflow is allocated as usual, rather than
+// one whose unused end lives as long as its strings.
+#define TOKENS_PER_STRING 4
 
-  parser.hadError = false;
-  parser.panicMode = false;
+/**
+    @brief Scan the source once to estimate how many distinct strings it
+    will intern, and prepare vm.strings and a string block for them.
+
+    @param source
+**/
+static void reserveStrings(const char* source) {
+  Scanner scanner;
+  initScanner(&scanner, source);
 
-  advance();
+  int count = 0;
+  size_t chars = 0;
+  for (;;) {
+    Token token = scanToken(&scanner);
+    if (token.type == TOKEN_EOF) break;
 
-  while (!match(TOKEN_EOF)) {
-    declaration();
+    if (token.type == TOKEN_IDENTIFIER || token.type == TOKEN_STRING) {
+      count++;
+      chars += token.length;
+    }
   }
 
-  ObjFunction* function = endCompiler();
-  return parser.hadError ? NULL : function;
+  beginStringBatch(count / TOKENS_PER_STRING, chars / TOKENS_PER_STRING);
+}
+
+/**
+    @brief Compile the script the context's scanner has been set up to
+    read.
+
+    The context is linked into vm.compiling while it runs, so the
+    collector can find the functions it has under construction.
+
+    @param context
+    @return ObjFunction* NULL if it has a compile error.
+**/
+static ObjFunction* compileScript(CompileContext* context) {
+  context->parser.hadError = false;
+  context->parser.panicMode = false;
+  context->current = NULL;
+  context->currentClass = NULL;
+  context->next = vm.compiling;
+  vm.compiling = context;
+
+  Compiler compiler;
+  initCompiler(context, &compiler, TYPE_SCRIPT);
+
+  advance(context);
+
+  while (!match(context, TOKEN_EOF)) {
+    declaration(context);
+  }
+
+  ObjFunction* function = endCompiler(context);
+  freeCompiler(&compiler);
+  endStringBatch();
+
+  CompileContext** link = &vm.compiling;
+  while (*link != context) link = &(*link)->next;
+  *link = context->next;
+  return context->parser.hadError ? NULL : function;
+}
+
+/**
+    @brief Compile a script held in memory.
+
+    @param context Where the compilation keeps its state. It need not
+           be initialized, and is free to reuse once this returns.
+    @param source
+    @return ObjFunction* NULL if it has a compile error.
+**/
+ObjFunction* compile(CompileContext* context, const char* source) {
+  reserveStrings(source);
+  initScanner(&context->scanner, source);
+  return compileScript(context);
+}
+
+/**
+    @brief Compile a script read from fd as it is scanned.
+
+    A stream can only be read once, so unlike compile() this makes no
+    first pass to size the string table.
+
+    @param context As for compile().
+    @param fd
+    @return ObjFunction* NULL if it has a compile error.
+**/
+ObjFunction* compileStream(CompileContext* context, int fd) {
+  initStreamScanner(&context->scanner, fd);
+  ObjFunction* function = compileScript(context);
+  freeScanner(&context->scanner);
+  return function;
 }
 void markCompilerRoots() {
-  Compiler* compiler = current;
-  while (compiler != NULL) {
-    markObject((Obj*)compiler->function);
-    compiler = compiler->enclosing;
+  for (CompileContext* context = vm.compiling; context != NULL;
+       context = context->next) {
+    Compiler* compiler = context->current;
+    while (compiler != NULL) {
+      markObject((Obj*)compiler->function);
+      compiler = compiler->enclosing;
+    }
   }
 }
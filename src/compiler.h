@@ -7,10 +7,37 @@
 #ifndef clox_compiler_h
 #define clox_compiler_h
 
+#include <stdio.h>
+
 #include "object.h"
+#include "scanner.h"
 #include "vm.h"
 
-ObjFunction* compile(const char* source);
+typedef struct {
+  Token current;
+  Token previous;
+  bool hadError;
+  bool panicMode;
+} Parser;
+
+/**
+    @brief Everything one compilation works on. Compilations with their
+    own contexts share nothing but the VM's heap.
+**/
+typedef struct sCompileContext {
+  Scanner scanner;
+  Parser parser;
+  // Where compile errors are reported.
+  FILE* errors;
+  // The innermost function and class being compiled.
+  struct Compiler* current;
+  struct ClassCompiler* currentClass;
+  // The next compilation in progress, in vm.compiling.
+  struct sCompileContext* next;
+} CompileContext;
+
+ObjFunction* compile(CompileContext* context, const char* source);
+ObjFunction* compileStream(CompileContext* context, int fd);
 void markCompilerRoots();
 
 #endif
@@ -8,6 +8,7 @@
 
 #include "debug.h"
 #include "object.h"
+#include "output.h"
 #include "value.h"
 
 /**
@@ -17,7 +18,7 @@
     @param name
 **/
 void disassembleChunk(Chunk* chunk, const char* name) {
-  printf("== %s ==\n", name);
+  formatOutput("== %s ==\n", name);
 
   for (int offset = 0; offset < chunk->count;) {
     offset = disassembleInstruction(chunk, offset);
@@ -34,11 +35,11 @@ void disassembleChunk(Chunk* chunk, const char* name) {
 **/
 static int constantInstruction(const char* name, Chunk* chunk,
                                int offset) {
-  uint8_t constant = chunk->code[offset + 1];
-  printf("%-16s %4d '", name, constant);
+  int constant = readOperand(chunk, offset);
+  formatOutput("%-16s %4d '", name, constant);
   printValue(chunk->constants.values[constant]);
-  printf("'\n");
-  return offset + 2;
+  formatOutput("'\n");
+  return offset + instructionLength(chunk, offset);
 }
 
 /**
@@ -51,12 +52,13 @@ static int constantInstruction(const char* name, Chunk* chunk,
 **/
 static int invokeInstruction(const char* name, Chunk* chunk,
                                 int offset) {
-  uint8_t constant = chunk->code[offset + 1];
-  uint8_t argCount = chunk->code[offset + 2];
-  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  int constant = readOperand(chunk, offset);
+  int length = instructionLength(chunk, offset);
+  uint8_t argCount = chunk->code[offset + length - 1];
+  formatOutput("%-16s (%d args) %4d '", name, argCount, constant);
   printValue(chunk->constants.values[constant]);
-  printf("'\n");
-  return offset + 3;
+  formatOutput("'\n");
+  return offset + length;
 }
 
 /**
@@ -67,7 +69,7 @@ static int invokeInstruction(const char* name, Chunk* chunk,
     @return int
 **/
 static int simpleInstruction(const char* name, int offset) {
-  printf("%s\n", name);
+  formatOutput("%s\n", name);
   return offset + 1;
 }
 
@@ -80,9 +82,9 @@ static int simpleInstruction(const char* name, int offset) {
     @return int
 **/
 static int byteInstruction(const char* name, Chunk* chunk, int offset) {
-  uint8_t slot = chunk->code[offset + 1];
-  printf("%-16s %4d\n", name, slot);
-  return offset + 2; // [debug]
+  int slot = readOperand(chunk, offset);
+  formatOutput("%-16s %4d\n", name, slot);
+  return offset + instructionLength(chunk, offset); // [debug]
 }
 
 /**
@@ -96,10 +98,29 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
 **/
 static int jumpInstruction(const char* name, int sign, Chunk* chunk,
                            int offset) {
-  uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
-  jump |= chunk->code[offset + 2];
-  printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
-  return offset + 3;
+  int jump = readOperand(chunk, offset);
+  int length = instructionLength(chunk, offset);
+  formatOutput("%-16s %4d -> %d\n", name, offset, offset + length + sign * jump);
+  return offset + length;
+}
+
+/**
+    @brief
+
+    @param chunk
+    @param offset
+    @return int
+**/
+static int forLoopInstruction(Chunk* chunk, int offset) {
+  int jump = readOperand(chunk, offset);
+  int length = instructionLength(chunk, offset);
+  uint8_t slot = chunk->code[offset + length - 2];
+  uint8_t step = chunk->code[offset + length - 1];
+  formatOutput("%-16s %4d -> %d slot %d step '", "OP_FOR_LOOP",
+               offset, offset + length - jump, slot);
+  printValue(chunk->constants.values[step]);
+  formatOutput("'\n");
+  return offset + length;
 }
 
 /**
@@ -110,14 +131,23 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk,
     @return int
 **/
 int disassembleInstruction(Chunk* chunk, int offset) {
-  printf("%04d ", offset);
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
-    printf("   | ");
+  formatOutput("%04d ", offset);
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
+    formatOutput("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    formatOutput("%4d ", line);
   }
 
+  // OP_WIDE only changes how operands are read, which the helpers below
+  // leave to readOperand() and instructionLength().
   uint8_t instruction = chunk->code[offset];
+  bool wide = instruction == OP_WIDE;
+  if (wide) {
+    formatOutput("OP_WIDE ");
+    instruction = chunk->code[offset + 1];
+  }
+
   switch (instruction) {
     case OP_CONSTANT:
       return constantInstruction("OP_CONSTANT", chunk, offset);
@@ -129,6 +159,8 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return simpleInstruction("OP_FALSE", offset);
     case OP_POP:
       return simpleInstruction("OP_POP", offset);
+    case OP_DUP:
+      return simpleInstruction("OP_DUP", offset);
     case OP_GET_LOCAL:
       return byteInstruction("OP_GET_LOCAL", chunk, offset);
     case OP_SET_LOCAL:
@@ -163,6 +195,18 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return simpleInstruction("OP_MULTIPLY", offset);
     case OP_DIVIDE:
       return simpleInstruction("OP_DIVIDE", offset);
+    case OP_GREATER_NUMBER:
+      return simpleInstruction("OP_GREATER_NUMBER", offset);
+    case OP_LESS_NUMBER:
+      return simpleInstruction("OP_LESS_NUMBER", offset);
+    case OP_ADD_NUMBER:
+      return simpleInstruction("OP_ADD_NUMBER", offset);
+    case OP_SUBTRACT_NUMBER:
+      return simpleInstruction("OP_SUBTRACT_NUMBER", offset);
+    case OP_MULTIPLY_NUMBER:
+      return simpleInstruction("OP_MULTIPLY_NUMBER", offset);
+    case OP_DIVIDE_NUMBER:
+      return simpleInstruction("OP_DIVIDE_NUMBER", offset);
     case OP_NOT:
       return simpleInstruction("OP_NOT", offset);
     case OP_NEGATE:
@@ -173,34 +217,54 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return jumpInstruction("OP_JUMP", 1, chunk, offset);
     case OP_JUMP_IF_FALSE:
       return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_JUMP_IF_TRUE:
+      return jumpInstruction("OP_JUMP_IF_TRUE", 1, chunk, offset);
     case OP_LOOP:
       return jumpInstruction("OP_LOOP", -1, chunk, offset);
+    case OP_LOOP_IF_TRUE:
+      return jumpInstruction("OP_LOOP_IF_TRUE", -1, chunk, offset);
+    case OP_FOR_LOOP:
+      return forLoopInstruction(chunk, offset);
     case OP_CALL:
       return byteInstruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+      return byteInstruction("OP_TAIL_CALL", chunk, offset);
     case OP_INVOKE:
       return invokeInstruction("OP_INVOKE", chunk, offset);
     case OP_SUPER_INVOKE:
       return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
-    case OP_CLOSURE: {
-      offset++;
-      uint8_t constant = chunk->code[offset++];
-      printf("%-16s %4d ", "OP_CLOSURE", constant);
+    case OP_CLOSURE:
+    case OP_FRAME_CLOSURE: {
+      int constant = readOperand(chunk, offset);
+      offset += wide ? 5 : 2;
+      formatOutput("%-16s %4d ",
+                   instruction == OP_CLOSURE ? "OP_CLOSURE"
+                                             : "OP_FRAME_CLOSURE",
+                   constant);
       printValue(chunk->constants.values[constant]);
-      printf("\n");
+      formatOutput("\n");
 
       ObjFunction* function = AS_FUNCTION(
           chunk->constants.values[constant]);
       for (int j = 0; j < function->upvalueCount; j++) {
+        int start = offset;
         int isLocal = chunk->code[offset++];
         int index = chunk->code[offset++];
-        printf("%04d      |                     %s %d\n",
-               offset - 2, isLocal ? "local" : "upvalue", index);
+        if (wide) {
+          index = (index << 16) | (chunk->code[offset] << 8) |
+                  chunk->code[offset + 1];
+          offset += 2;
+        }
+        formatOutput("%04d      |                     %s %d\n",
+                     start, isLocal ? "local" : "upvalue", index);
       }
 
       return offset;
     }
     case OP_CLOSE_UPVALUE:
       return simpleInstruction("OP_CLOSE_UPVALUE", offset);
+    case OP_POP_FRAME_CLOSURE:
+      return simpleInstruction("OP_POP_FRAME_CLOSURE", offset);
     case OP_RETURN:
       return simpleInstruction("OP_RETURN", offset);
     case OP_CLASS:
@@ -210,7 +274,7 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_METHOD:
       return constantInstruction("OP_METHOD", chunk, offset);
     default:
-      printf("Unknown opcode %d\n", instruction);
+      formatOutput("Unknown opcode %d\n", instruction);
       return offset + 1;
   }
 }
@@ -0,0 +1,297 @@
+/**
+    @file image.c
+
+    @brief Reading and writing binary image files.
+
+    Cache files and heap snapshots are both written through an
+    ImageWriter and read back through an ImageReader. Integers are
+    written little-endian in fixed widths. Files are written under a
+    temporary name and renamed into place, so a process reading one
+    never sees it half written, and are mapped read-only to be read.
+
+    Script sources are mapped here too, with room for the NUL the
+    scanner stops at.
+
+**/
+#define _POSIX_C_SOURCE 200809L
+// For MAP_ANONYMOUS.
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+
+/**
+    @brief Continue a 64-bit FNV-1a hash over more bytes.
+
+    @param hash HASH_SEED, or the hash of the bytes before these.
+    @param bytes
+    @param count
+    @return uint64_t
+**/
+uint64_t hashBytes(uint64_t hash, const void* bytes, size_t count) {
+  const uint8_t* data = (const uint8_t*)bytes;
+  for (size_t i = 0; i < count; i++) {
+    hash ^= data[i];
+    hash *= 1099511628211u;
+  }
+  return hash;
+}
+
+/**
+    @brief Start writing an image to a temporary file beside path.
+
+    @param writer
+    @param path
+    @return bool False if the file cannot be created.
+**/
+bool openImage(ImageWriter* writer, const char* path) {
+  size_t tempLength = strlen(path) + 32;
+  writer->path = (char*)malloc(strlen(path) + 1);
+  writer->temp = (char*)malloc(tempLength);
+  writer->file = NULL;
+  writer->position = 0;
+  writer->hash = HASH_SEED;
+  writer->failed = false;
+  if (writer->path != NULL && writer->temp != NULL) {
+    strcpy(writer->path, path);
+    snprintf(writer->temp, tempLength, "%s.%ld.tmp", path, (long)getpid());
+    writer->file = fopen(writer->temp, "wb");
+  }
+
+  if (writer->file == NULL) {
+    free(writer->path);
+    free(writer->temp);
+    return false;
+  }
+  return true;
+}
+
+/**
+    @brief Finish an image, moving it into place if every write worked.
+
+    @param writer
+    @return bool Whether the image was written.
+**/
+bool closeImage(ImageWriter* writer) {
+  if (fclose(writer->file) != 0) writer->failed = true;
+  if (writer->failed || rename(writer->temp, writer->path) != 0) {
+    remove(writer->temp);
+    writer->failed = true;
+  }
+
+  free(writer->path);
+  free(writer->temp);
+  return !writer->failed;
+}
+
+/**
+    @brief
+
+    @param writer
+    @param bytes
+    @param count
+**/
+void writeBytes(ImageWriter* writer, const void* bytes, size_t count) {
+  if (count > 0 && fwrite(bytes, 1, count, writer->file) != count) {
+    writer->failed = true;
+  }
+  writer->position += count;
+  writer->hash = hashBytes(writer->hash, bytes, count);
+}
+
+/**
+    @brief Pad with zeros up to a multiple of alignment.
+
+    @param writer
+    @param alignment
+**/
+void writePadding(ImageWriter* writer, size_t alignment) {
+  static const uint8_t zeros[8] = { 0 };
+  size_t padding = (alignment - writer->position % alignment) % alignment;
+  writeBytes(writer, zeros, padding);
+}
+
+/**
+    @brief Write an unsigned integer in width bytes, low byte first.
+
+    @param writer
+    @param value
+    @param width
+**/
+void writeInt(ImageWriter* writer, uint64_t value, int width) {
+  uint8_t bytes[8];
+  for (int i = 0; i < width; i++) bytes[i] = (value >> (8 * i)) & 0xff;
+  writeBytes(writer, bytes, width);
+}
+
+/**
+    @brief Overwrite an integer written earlier, such as a header field
+    that depends on what followed it. The hash is left alone.
+
+    @param writer
+    @param position Where the integer was written.
+    @param value
+    @param width
+**/
+void patchInt(ImageWriter* writer, size_t position, uint64_t value,
+              int width) {
+  uint8_t bytes[8];
+  for (int i = 0; i < width; i++) bytes[i] = (value >> (8 * i)) & 0xff;
+  if (fseek(writer->file, (long)position, SEEK_SET) != 0 ||
+      fwrite(bytes, 1, width, writer->file) != (size_t)width ||
+      fseek(writer->file, 0, SEEK_END) != 0) {
+    writer->failed = true;
+  }
+}
+
+/**
+    @brief Map a whole file into memory, read-only.
+
+    @param path
+    @param length Receives the file's size.
+    @return uint8_t* NULL if it cannot be mapped.
+**/
+uint8_t* mapImage(const char* path, size_t* length) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return NULL;
+
+  uint8_t* data = NULL;
+  struct stat status;
+  if (fstat(fd, &status) == 0 && status.st_size > 0) {
+    *length = (size_t)status.st_size;
+    data = mmap(NULL, *length, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) data = NULL;
+  }
+
+  close(fd);
+  return data;
+}
+
+/**
+    @brief
+
+    @param data
+    @param length
+**/
+void unmapImage(uint8_t* data, size_t length) {
+  munmap(data, length);
+}
+
+/**
+    @brief How much address space a mapped source of length bytes takes:
+    whole pages, with at least one byte past the end.
+
+    @param length
+    @return size_t
+**/
+static size_t sourceSpan(size_t length) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  return (length / page + 1) * page;
+}
+
+/**
+    @brief Map a script's source read-only, followed by a NUL.
+
+    The file is mapped over a slightly larger run of zeroed pages. The
+    rest of the file's last page reads as zeros already, and the zero
+    page behind it supplies the NUL when the file ends exactly on a page
+    boundary, so the source is never copied to terminate it.
+
+    @param fd
+    @param length Receives the source's length.
+    @return const char* NULL if fd is not a regular file or cannot be
+            mapped, in which case it can still be read as a stream.
+**/
+const char* mapSource(int fd, size_t* length) {
+  struct stat status;
+  if (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode)) return NULL;
+
+  *length = (size_t)status.st_size;
+  size_t span = sourceSpan(*length);
+  char* data = mmap(NULL, span, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1, 0);
+  if (data == MAP_FAILED) return NULL;
+
+  if (*length > 0 &&
+      mmap(data, *length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) ==
+          MAP_FAILED) {
+    munmap(data, span);
+    return NULL;
+  }
+  return data;
+}
+
+/**
+    @brief
+
+    @param source
+    @param length
+**/
+void unmapSource(const char* source, size_t length) {
+  munmap((void*)source, sourceSpan(length));
+}
+
+/**
+    @brief Take the next count bytes of the image.
+
+    @param reader
+    @param count
+    @return const uint8_t* The bytes, or NULL past the end of the file.
+**/
+const uint8_t* readBytes(ImageReader* reader, size_t count) {
+  if (reader->failed || count > reader->length - reader->position) {
+    reader->failed = true;
+    return NULL;
+  }
+
+  const uint8_t* bytes = reader->data + reader->position;
+  reader->position += count;
+  return bytes;
+}
+
+/**
+    @brief Skip the padding writePadding() wrote.
+
+    @param reader
+    @param alignment
+**/
+void readPadding(ImageReader* reader, size_t alignment) {
+  readBytes(reader, (alignment - reader->position % alignment) % alignment);
+}
+
+/**
+    @brief Read an unsigned integer written by writeInt().
+
+    @param reader
+    @param width
+    @return uint64_t 0 past the end of the file.
+**/
+uint64_t readInt(ImageReader* reader, int width) {
+  const uint8_t* bytes = readBytes(reader, width);
+  if (bytes == NULL) return 0;
+
+  uint64_t value = 0;
+  for (int i = width - 1; i >= 0; i--) value = (value << 8) | bytes[i];
+  return value;
+}
+
+/**
+    @brief Read a count that must fit in an int.
+
+    @param reader
+    @return int
+**/
+int readCount(ImageReader* reader) {
+  uint64_t count = readInt(reader, 4);
+  if (count > INT32_MAX) {
+    reader->failed = true;
+    return 0;
+  }
+  return (int)count;
+}
@@ -0,0 +1,60 @@
+/**
+    @file image.h
+
+    @brief Header for reading and writing binary image files.
+
+**/
+#ifndef clox_image_h
+#define clox_image_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+// Where hashBytes() starts.
+#define HASH_SEED 14695981039346656037u
+
+/**
+    @brief An image file being written, and whether any write has failed.
+**/
+typedef struct {
+  FILE* file;
+  char* path;
+  char* temp;
+  size_t position;
+  // Hash of the bytes written since it was last set to HASH_SEED.
+  uint64_t hash;
+  bool failed;
+} ImageWriter;
+
+/**
+    @brief A mapped image file and the read position within it.
+**/
+typedef struct {
+  const uint8_t* data;
+  size_t length;
+  size_t position;
+  bool failed;
+} ImageReader;
+
+uint64_t hashBytes(uint64_t hash, const void* bytes, size_t count);
+
+bool openImage(ImageWriter* writer, const char* path);
+bool closeImage(ImageWriter* writer);
+void writeBytes(ImageWriter* writer, const void* bytes, size_t count);
+void writePadding(ImageWriter* writer, size_t alignment);
+void writeInt(ImageWriter* writer, uint64_t value, int width);
+void patchInt(ImageWriter* writer, size_t position, uint64_t value,
+              int width);
+
+uint8_t* mapImage(const char* path, size_t* length);
+void unmapImage(uint8_t* data, size_t length);
+const uint8_t* readBytes(ImageReader* reader, size_t count);
+void readPadding(ImageReader* reader, size_t alignment);
+uint64_t readInt(ImageReader* reader, int width);
+int readCount(ImageReader* reader);
+
+const char* mapSource(int fd, size_t* length);
+void unmapSource(const char* source, size_t length);
+
+#endif
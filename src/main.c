@@ -7,12 +7,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "build.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "output.h"
+#include "snapshot.h"
 #include "vm.h"
 
+// Whether scripts are run from, and compiled into, cache files.
+static bool useCache = false;
+// Threads to compile on, or 0 for one per processor.
+static int jobs = 0;
+// Where to save the heap once the script has run, if anywhere.
+static const char* snapshotPath = NULL;
+
 /**
     @brief
 
@@ -20,10 +32,11 @@
 static void repl() {
   char line[1024];
   for (;;) {
-    printf("> ");
+    writeOutputString("> ");
+    flushOutput();
 
     if (!fgets(line, sizeof(line), stdin)) {
-      printf("\n");
+      writeOutputString("\n");
       break;
     }
 
@@ -32,52 +45,97 @@ static void repl() {
 }
 
 /**
-    @brief
+    @brief Run a program made of the scripts at paths, one after another
+    in the order given, once they have all compiled.
 
-    @param path
-    @return char*
+    "-" stands for stdin. With more than one script, they are compiled
+    concurrently; see compileFiles().
+
+    @param paths
+    @param count
 **/
-static char* readFile(const char* path) {
-  FILE* file = fopen(path, "rb");
-  if (file == NULL) {
-    fprintf(stderr, "Could not open file \"%s\".\n", path);
+static void runFiles(const char* paths[], int count) {
+  int status = compileFiles(paths, count, jobs, useCache);
+  if (status != 0) exit(status);
+
+  for (int i = 0; i < vm.scripts.count; i++) {
+    InterpretResult result =
+        interpretFunction(AS_FUNCTION(vm.scripts.values[i]));
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+  }
+
+  if (snapshotPath != NULL && !saveSnapshot(snapshotPath)) {
+    fprintf(stderr, "Could not write snapshot \"%s\".\n", snapshotPath);
     exit(74);
   }
+}
 
-  fseek(file, 0L, SEEK_END);
-  size_t fileSize = ftell(file);
-  rewind(file);
+/**
+    @brief Add a copy of a path to the list of scripts to run.
 
-  char* buffer = (char*)malloc(fileSize + 1);
-  if (buffer == NULL) {
-    fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+    @param paths
+    @param count
+    @param capacity
+    @param path
+    @param length
+**/
+static void addPath(char*** paths, int* count, int* capacity,
+                    const char* path, size_t length) {
+  if (*count == *capacity) {
+    *capacity = *capacity < 8 ? 8 : *capacity * 2;
+    *paths = (char**)realloc(*paths, sizeof(char*) * *capacity);
+  }
+  char* copy = (char*)malloc(length + 1);
+  if (*paths == NULL || copy == NULL) {
+    fprintf(stderr, "Not enough memory to list scripts.\n");
     exit(74);
   }
+  memcpy(copy, path, length);
+  copy[length] = '\0';
+  (*paths)[(*count)++] = copy;
+}
 
-  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-  if (bytesRead < fileSize) {
-    fprintf(stderr, "Could not read file \"%s\".\n", path);
+/**
+    @brief Add the scripts listed in a manifest file, one path per line.
+    Blank lines are skipped. Paths are taken as they are, relative to
+    the current directory rather than the manifest.
+
+    @param manifest
+    @param paths
+    @param count
+    @param capacity
+**/
+static void addManifest(const char* manifest, char*** paths,
+                        int* count, int* capacity) {
+  FILE* file = fopen(manifest, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open manifest \"%s\".\n", manifest);
     exit(74);
   }
 
-  buffer[bytesRead] = '\0';
-
+  char line[4096];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    size_t length = strcspn(line, "\r\n");
+    if (line[length] == '\0' && !feof(file)) {
+      fprintf(stderr, "Path too long in manifest \"%s\".\n", manifest);
+      exit(74);
+    }
+    if (length > 0) addPath(paths, count, capacity, line, length);
+  }
   fclose(file);
-  return buffer;
 }
 
 /**
-    @brief
+    @brief Print command line usage and exit.
 
-    @param path
 **/
-static void runFile(const char* path) {
-  char* source = readFile(path);
-  InterpretResult result = interpret(source);
-  free(source); // [owner]
-
-  if (result == INTERPRET_COMPILE_ERROR) exit(65);
-  if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+static void usage() {
+  fprintf(stderr,
+          "Usage: clox [-O0|-O1|-O2] [--max-frames=N] [--cache] "
+          "[--jobs=N] [--output-buffer=BYTES] [--line-buffered] "
+          "[--snapshot=FILE] [--restore=FILE] "
+          "[path | @manifest | -]...\n");
+  exit(64);
 }
 
 /**
@@ -90,15 +148,70 @@ static void runFile(const char* path) {
 int main(int argc, const char* argv[]) {
   initVM();
 
-  if (argc == 1) {
+  // Whether any scripts were named, even by an empty manifest.
+  bool listed = false;
+  char** paths = NULL;
+  int pathCount = 0;
+  int pathCapacity = 0;
+  const char* restorePath = NULL;
+  size_t outputSize = OUTPUT_BUFFER_SIZE;
+  // Output to a terminal is for a person, who wants each line as it
+  // comes.
+  OutputMode outputMode = isatty(STDOUT_FILENO) ? OUTPUT_LINE_BUFFERED
+                                                : OUTPUT_BLOCK_BUFFERED;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-O0") == 0) {
+      vm.optimizeLevel = 0;
+    } else if (strcmp(argv[i], "-O1") == 0) {
+      vm.optimizeLevel = 1;
+    } else if (strcmp(argv[i], "-O2") == 0) {
+      vm.optimizeLevel = 2;
+    } else if (strncmp(argv[i], "--max-frames=", 13) == 0) {
+      int limit = atoi(argv[i] + 13);
+      if (limit < 1) usage();
+      vm.frameLimit = limit;
+    } else if (strcmp(argv[i], "--cache") == 0) {
+      useCache = true;
+    } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+      jobs = atoi(argv[i] + 7);
+      if (jobs < 1) usage();
+    } else if (strncmp(argv[i], "--output-buffer=", 16) == 0) {
+      long size = atol(argv[i] + 16);
+      if (size < 1) usage();
+      outputSize = (size_t)size;
+    } else if (strcmp(argv[i], "--line-buffered") == 0) {
+      outputMode = OUTPUT_LINE_BUFFERED;
+    } else if (strncmp(argv[i], "--snapshot=", 11) == 0) {
+      snapshotPath = argv[i] + 11;
+    } else if (strncmp(argv[i], "--restore=", 10) == 0) {
+      restorePath = argv[i] + 10;
+    } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+      usage();
+    } else if (argv[i][0] == '@') {
+      addManifest(argv[i] + 1, &paths, &pathCount, &pathCapacity);
+      listed = true;
+    } else {
+      addPath(&paths, &pathCount, &pathCapacity, argv[i], strlen(argv[i]));
+      listed = true;
+    }
+  }
+
+  initOutput(outputSize, outputMode);
+
+  if (restorePath != NULL && !restoreSnapshot(restorePath)) {
+    fprintf(stderr, "Could not restore snapshot \"%s\".\n", restorePath);
+    exit(74);
+  }
+
+  if (!listed) {
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    runFiles((const char**)paths, pathCount);
   }
 
   freeVM();
+  freeOutput();
+  for (int i = 0; i < pathCount; i++) free(paths[i]);
+  free(paths);
   return 0;
 }
@@ -6,14 +6,16 @@
 **/
 #include <stdlib.h>
 
+#include "cache.h"
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "snapshot.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
+#include "output.h"
 #endif
 
 #define GC_HEAP_GROW_FACTOR 2
@@ -57,12 +59,15 @@ void markObject(Obj* object) {
   if (object->isMarked) return;
 
 #ifdef DEBUG_LOG_GC
-  printf("%p mark ", (void*)object);
+  formatOutput("%p mark ", (void*)object);
   printValue(OBJ_VAL(object));
-  printf("\n");
+  formatOutput("\n");
 #endif
 
-  object->isMarked = true;
+  // Frame closures are not on the object list, so sweep() would never
+  // clear their mark. They are traced each time they are reached instead;
+  // nothing they refer to leads back to them.
+  if (!object->inFrame) object->isMarked = true;
 
   if (vm.grayCapacity < vm.grayCount + 1) {
     vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
@@ -95,9 +100,9 @@ static void markArray(ValueArray* array) {
 **/
 static void blackenObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
-  printf("%p blacken ", (void*)object);
+  formatOutput("%p blacken ", (void*)object);
   printValue(OBJ_VAL(object));
-  printf("\n");
+  formatOutput("\n");
 #endif
 
   switch (object->type) {
@@ -127,6 +132,7 @@ static void blackenObject(Obj* object) {
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
       markObject((Obj*)function->name);
+      markValue(function->inlineValue);
       markArray(&function->chunk.constants);
       break;
     }
@@ -138,6 +144,22 @@ static void blackenObject(Obj* object) {
       break;
     }
 
+    case OBJ_ROPE: {
+      ObjRope* rope = (ObjRope*)object;
+      markObject(rope->left);
+      markObject(rope->right);
+      markObject((Obj*)rope->flat);
+      break;
+    }
+
+    case OBJ_SLICE:
+      markObject((Obj*)((ObjSlice*)object)->parent);
+      break;
+
+    case OBJ_STRING_BUILDER:
+      markObject((Obj*)((ObjStringBuilder*)object)->string);
+      break;
+
     case OBJ_UPVALUE:
       markValue(((ObjUpvalue*)object)->closed);
       break;
@@ -155,9 +177,11 @@ static void blackenObject(Obj* object) {
 **/
 static void freeObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
-  printf("%p free type %d\n", (void*)object, object->type);
+  formatOutput("%p free type %d\n", (void*)object, object->type);
 #endif
 
+  if (object->inBlock) return;
+
   switch (object->type) {
     case OBJ_BOUND_METHOD:
       FREE(ObjBoundMethod, object);
@@ -179,7 +203,11 @@ static void freeObject(Obj* object) {
 
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
-      freeChunk(&function->chunk);
+      if (object->inImage) {
+        freeValueArray(&function->chunk.constants);
+      } else {
+        freeChunk(&function->chunk);
+      }
       FREE(ObjFunction, object);
       break;
     }
@@ -195,10 +223,31 @@ static void freeObject(Obj* object) {
       FREE(ObjNative, object);
       break;
 
+    case OBJ_ROPE:
+      FREE(ObjRope, object);
+      break;
+
+    case OBJ_SLICE:
+      FREE(ObjSlice, object);
+      break;
+
     case OBJ_STRING: {
       ObjString* string = (ObjString*)object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, object);
+      if (string->chars == string->storage) {
+        reallocate(object, sizeof(ObjString) + string->length + 1, 0);
+      } else if (object->inImage) {
+        FREE(ObjString, object);
+      } else {
+        FREE_ARRAY(char, string->chars, string->length + 1);
+        FREE(ObjString, object);
+      }
+      break;
+    }
+
+    case OBJ_STRING_BUILDER: {
+      ObjStringBuilder* builder = (ObjStringBuilder*)object;
+      FREE_ARRAY(char, builder->chars, builder->capacity);
+      FREE(ObjStringBuilder, object);
       break;
     }
 
@@ -228,7 +277,10 @@ static void markRoots() {
   }
 
   markTable(&vm.globals);
+  markTable(&vm.stringBuilderMethods);
+  markArray(&vm.scripts);
   markCompilerRoots();
+  markSnapshotRoots();
   markObject((Obj*)vm.initString);
 }
 
@@ -276,22 +328,24 @@ static void sweep() {
 **/
 void collectGarbage() {
 #ifdef DEBUG_LOG_GC
-  printf("-- gc begin\n");
+  formatOutput("-- gc begin\n");
   size_t before = vm.bytesAllocated;
 #endif
 
   markRoots();
   traceReferences();
   tableRemoveWhite(&vm.strings);
+  markStringBlocks();
   sweep();
+  sweepStringBlocks();
 
   vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
 
 #ifdef DEBUG_LOG_GC
-  printf("-- gc end\n");
-  printf("   collected %ld bytes (from %ld to %ld) next at %ld\n",
-         before - vm.bytesAllocated, before, vm.bytesAllocated,
-         vm.nextGC);
+  formatOutput("-- gc end\n");
+  formatOutput("   collected %ld bytes (from %ld to %ld) next at %ld\n",
+               before - vm.bytesAllocated, before, vm.bytesAllocated,
+               vm.nextGC);
 #endif
 }
 
@@ -307,5 +361,7 @@ void freeObjects() {
     object = next;
   }
 
+  freeStringBlocks();
+  unmapCacheImages();
   free(vm.grayStack);
 }
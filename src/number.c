@@ -0,0 +1,288 @@
+/**
+    @file number.c
+
+    @brief Converting numbers to and from text.
+
+    Number literals are parsed, and numbers printed, the way strtod()
+    and printf("%g") would, down to the last digit. Both fast paths only
+    take cases they can get exactly right with plain double arithmetic
+    and hand anything else to the C library, so the output never
+    differs from it.
+
+    Parsing uses Clinger's fast path: a literal whose digits fit in the
+    53 bits of a double and that has at most 22 decimal places is the
+    quotient of two exactly representable numbers, which one division
+    rounds correctly.
+
+    Printing scales the number by a power of ten into [100000, 1000000)
+    so that its integer part holds the six significant digits "%g"
+    keeps. The scaling is a single correctly rounded multiplication or
+    division, so the result is within half a unit in the last place; if
+    that leaves the rounding of the sixth digit in doubt, the library
+    decides.
+
+**/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "number.h"
+
+// Significant digits printed, as "%g" does by default.
+#define PRINT_DIGITS 6
+// The smallest and one past the largest number PRINT_DIGITS digits hold.
+#define DIGITS_MIN 100000
+#define DIGITS_LIMIT 1000000
+// How close to a half the scaled number may come before its rounding
+// is left to the library. A unit in the last place is 2^-33 below
+// DIGITS_LIMIT, so this is comfortably wider than the scaling error.
+#define ROUNDING_MARGIN 1e-9
+// Integers below this are exact in a double and in a uint64_t.
+#define EXACT_INTEGER_LIMIT 1e15
+
+// Every power of ten a double holds exactly.
+static const double powersOfTen[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define POWERS_MAX ((int)(sizeof(powersOfTen) / sizeof(powersOfTen[0])) - 1)
+
+/**
+    @brief Parse a literal the fast path cannot take with strtod(), which
+    needs it terminated.
+
+    @param start
+    @param length
+    @return double
+**/
+static double parseSlow(const char* start, int length) {
+  char small[64];
+  char* copy = length < (int)sizeof(small) ? small
+                                           : (char*)malloc(length + 1);
+  if (copy == NULL) {
+    fprintf(stderr, "Not enough memory to parse a number.\n");
+    exit(74);
+  }
+  memcpy(copy, start, length);
+  copy[length] = '\0';
+
+  double value = strtod(copy, NULL);
+  if (copy != small) free(copy);
+  return value;
+}
+
+/**
+    @brief Parse a number literal: digits, optionally followed by a
+    point and more digits.
+
+    @param start
+    @param length
+    @return double The closest double to the literal.
+**/
+double parseNumber(const char* start, int length) {
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int places = 0;
+  bool fraction = false;
+  for (int i = 0; i < length; i++) {
+    if (start[i] == '.') {
+      fraction = true;
+      continue;
+    }
+
+    // Leading zeros take no room in the mantissa.
+    if (mantissa != 0 || start[i] != '0') digits++;
+    if (digits > 19) return parseSlow(start, length);
+    mantissa = mantissa * 10 + (uint64_t)(start[i] - '0');
+    if (fraction) places++;
+  }
+
+  if (places == 0) return (double)mantissa;
+  if (places > POWERS_MAX || mantissa > ((uint64_t)1 << 53)) {
+    return parseSlow(start, length);
+  }
+  return (double)mantissa / powersOfTen[places];
+}
+
+/**
+    @brief Write an unsigned integer's decimal digits.
+
+    @param buffer
+    @param value
+    @return int The number of digits written.
+**/
+static int writeDigits(char* buffer, uint64_t value) {
+  char reversed[20];
+  int count = 0;
+  do {
+    reversed[count++] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+
+  for (int i = 0; i < count; i++) buffer[i] = reversed[count - 1 - i];
+  return count;
+}
+
+/**
+    @brief Write PRINT_DIGITS significant digits the way "%g" lays them
+    out: trailing zeros dropped, and in exponent form if the exponent is
+    below -4 or not below the number of digits.
+
+    @param buffer
+    @param digits The significant digits, at least DIGITS_MIN.
+    @param exponent The power of ten of the first digit.
+    @return int The number of characters written.
+**/
+static int layOutDigits(char* buffer, uint32_t digits, int exponent) {
+  char chars[PRINT_DIGITS];
+  writeDigits(chars, digits);
+  int count = PRINT_DIGITS;
+  while (count > 1 && chars[count - 1] == '0') count--;
+
+  int length = 0;
+  if (exponent < -4 || exponent >= PRINT_DIGITS) {
+    buffer[length++] = chars[0];
+    if (count > 1) {
+      buffer[length++] = '.';
+      memcpy(buffer + length, chars + 1, count - 1);
+      length += count - 1;
+    }
+    buffer[length++] = 'e';
+    buffer[length++] = exponent < 0 ? '-' : '+';
+    int magnitude = abs(exponent);
+    if (magnitude < 10) buffer[length++] = '0';
+    length += writeDigits(buffer + length, (uint64_t)magnitude);
+  } else if (exponent >= 0) {
+    int whole = exponent + 1;
+    for (int i = 0; i < whole; i++) {
+      buffer[length++] = i < count ? chars[i] : '0';
+    }
+    if (count > whole) {
+      buffer[length++] = '.';
+      memcpy(buffer + length, chars + whole, count - whole);
+      length += count - whole;
+    }
+  } else {
+    buffer[length++] = '0';
+    buffer[length++] = '.';
+    for (int i = -1; i > exponent; i--) buffer[length++] = '0';
+    memcpy(buffer + length, chars, count);
+    length += count;
+  }
+
+  buffer[length] = '\0';
+  return length;
+}
+
+/**
+    @brief Round a positive integer below EXACT_INTEGER_LIMIT to
+    PRINT_DIGITS digits, ties to even as the library does, and lay it
+    out.
+
+    @param buffer
+    @param value
+    @return int The number of characters written.
+**/
+static int formatInteger(char* buffer, uint64_t value) {
+  char chars[20];
+  int count = writeDigits(chars, value);
+  if (count <= PRINT_DIGITS) {
+    memcpy(buffer, chars, count);
+    buffer[count] = '\0';
+    return count;
+  }
+
+  uint64_t divisor = 1;
+  for (int i = PRINT_DIGITS; i < count; i++) divisor *= 10;
+  uint64_t digits = value / divisor;
+  uint64_t remainder = value % divisor;
+  if (remainder > divisor / 2 ||
+      (remainder == divisor / 2 && (digits & 1) != 0)) {
+    digits++;
+  }
+
+  int exponent = count - 1;
+  if (digits == DIGITS_LIMIT) {
+    digits = DIGITS_MIN;
+    exponent++;
+  }
+  return layOutDigits(buffer, (uint32_t)digits, exponent);
+}
+
+/**
+    @brief Scale a positive number so that its integer part holds its
+    first PRINT_DIGITS digits, rounded to nearest.
+
+    @param value
+    @param exponent Set to the power of ten of the first digit.
+    @return int64_t The digits, or -1 if they cannot be found exactly
+            this way.
+**/
+static int64_t scaleToDigits(double value, int* exponent) {
+  int estimate = (int)floor(log10(value));
+  for (int attempt = 0; attempt < 3; attempt++) {
+    int scale = PRINT_DIGITS - 1 - estimate;
+    if (scale < -POWERS_MAX || scale > POWERS_MAX) return -1;
+
+    double scaled = scale >= 0 ? value * powersOfTen[scale]
+                               : value / powersOfTen[-scale];
+    if (scaled < DIGITS_MIN) {
+      estimate--;
+      continue;
+    }
+    if (scaled >= DIGITS_LIMIT) {
+      estimate++;
+      continue;
+    }
+
+    double whole = floor(scaled);
+    double fraction = scaled - whole;
+    if (fabs(fraction - 0.5) < ROUNDING_MARGIN) return -1;
+
+    int64_t digits = (int64_t)whole + (fraction > 0.5 ? 1 : 0);
+    *exponent = estimate;
+    if (digits == DIGITS_LIMIT) {
+      digits = DIGITS_MIN;
+      (*exponent)++;
+    }
+    return digits;
+  }
+  return -1;
+}
+
+/**
+    @brief Format a number exactly as printf("%g") does.
+
+    @param number
+    @param buffer At least NUMBER_BUFFER_SIZE characters.
+    @return int The length written, not counting the terminator.
+**/
+int formatNumber(double number, char* buffer) {
+  if (number == 0) {
+    if (signbit(number)) return (int)strlen(strcpy(buffer, "-0"));
+    return (int)strlen(strcpy(buffer, "0"));
+  }
+  if (!isfinite(number)) {
+    return snprintf(buffer, NUMBER_BUFFER_SIZE, "%g", number);
+  }
+
+  int sign = 0;
+  if (number < 0) {
+    buffer[sign++] = '-';
+    number = -number;
+  }
+
+  if (number < EXACT_INTEGER_LIMIT && number == floor(number)) {
+    return sign + formatInteger(buffer + sign, (uint64_t)number);
+  }
+
+  int exponent;
+  int64_t digits = scaleToDigits(number, &exponent);
+  if (digits < 0) {
+    return snprintf(buffer, NUMBER_BUFFER_SIZE, "%g",
+                    sign ? -number : number);
+  }
+  return sign + layOutDigits(buffer + sign, (uint32_t)digits, exponent);
+}
@@ -0,0 +1,18 @@
+/**
+    @file number.h
+
+    @brief Header for converting numbers to and from text.
+
+**/
+#ifndef clox_number_h
+#define clox_number_h
+
+#include "common.h"
+
+// Room for any number formatNumber() writes, with its terminator.
+#define NUMBER_BUFFER_SIZE 32
+
+double parseNumber(const char* start, int length);
+int formatNumber(double number, char* buffer);
+
+#endif
@@ -4,11 +4,12 @@
     @brief
 
 **/
-#include <stdio.h>
+#include <limits.h>
 #include <string.h>
 
 #include "memory.h"
 #include "object.h"
+#include "output.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
@@ -27,12 +28,15 @@ static Obj* allocateObject(size_t size, ObjType type) {
   Obj* object = (Obj*)reallocate(NULL, 0, size);
   object->type = type;
   object->isMarked = false;
+  object->inBlock = false;
+  object->inFrame = false;
+  object->inImage = false;
 
   object->next = vm.objects;
   vm.objects = object;
 
 #ifdef DEBUG_LOG_GC
-  printf("%p allocate %ld for %d\n", (void*)object, size, type);
+  formatOutput("%p allocate %ld for %d\n", (void*)object, size, type);
 #endif
 
   return object;
@@ -85,6 +89,68 @@ ObjClosure* newClosure(ObjFunction* function) {
   return closure;
 }
 
+/**
+    @brief Bytes a frame closure takes in the arena: the closure, its
+           upvalue array, and an upvalue object for each slot it may
+           capture.
+
+    @param upvalueCount
+    @return size_t
+**/
+size_t frameClosureSize(int upvalueCount) {
+  return sizeof(ObjClosure) +
+         upvalueCount * (sizeof(ObjUpvalue*) + sizeof(ObjUpvalue));
+}
+
+/**
+    @brief The upvalue objects stored after a frame closure's array.
+           Those with a NULL location are unused.
+
+    @param closure
+    @return ObjUpvalue*
+**/
+ObjUpvalue* frameClosureUpvalues(ObjClosure* closure) {
+  return (ObjUpvalue*)(closure->upvalues + closure->upvalueCount);
+}
+
+/**
+    @brief Carve a closure that cannot outlive the current frame out of
+           the frame arena. Nothing is allocated from the heap, so this
+           never triggers a collection.
+
+    @param function
+    @return ObjClosure* NULL if the arena is full.
+**/
+ObjClosure* newFrameClosure(ObjFunction* function) {
+  int upvalueCount = function->upvalueCount;
+  size_t size = frameClosureSize(upvalueCount);
+  if (vm.frameArenaUsed + size > FRAME_ARENA_SIZE) return NULL;
+
+  ObjClosure* closure = (ObjClosure*)(vm.frameArena + vm.frameArenaUsed);
+  vm.frameArenaUsed += size;
+
+  closure->obj.type = OBJ_CLOSURE;
+  closure->obj.isMarked = false;
+  closure->obj.inBlock = false;
+  closure->obj.inFrame = true;
+  closure->obj.inImage = false;
+  closure->obj.next = NULL;
+  closure->function = function;
+  closure->upvalues = (ObjUpvalue**)(closure + 1);
+  closure->upvalueCount = upvalueCount;
+
+  ObjUpvalue* upvalues = frameClosureUpvalues(closure);
+  for (int i = 0; i < upvalueCount; i++) {
+    closure->upvalues[i] = NULL;
+    upvalues[i].obj = closure->obj;
+    upvalues[i].obj.type = OBJ_UPVALUE;
+    upvalues[i].location = NULL;
+    upvalues[i].closed = NIL_VAL;
+    upvalues[i].next = NULL;
+  }
+  return closure;
+}
+
 /**
     @brief
 
@@ -96,6 +162,10 @@ ObjFunction* newFunction() {
   function->arity = 0;
   function->upvalueCount = 0;
   function->name = NULL;
+  function->maxSlots = 0;
+  function->inlineKind = INLINE_NONE;
+  function->inlineSlot = 0;
+  function->inlineValue = NIL_VAL;
   initChunk(&function->chunk);
   return function;
 }
@@ -126,18 +196,74 @@ ObjNative* newNative(NativeFn function) {
 }
 
 /**
-    @brief
+    @brief Get the number of characters in a string, rope or slice.
 
-    @param chars
-    @param length
+    @param object
+    @return int
+**/
+int stringLength(Obj* object) {
+  switch (object->type) {
+    case OBJ_ROPE:  return ((ObjRope*)object)->length;
+    case OBJ_SLICE: return ((ObjSlice*)object)->length;
+    default:        return ((ObjString*)object)->length;
+  }
+}
+
+/**
+    @brief Get the characters of a string or slice. Slices are not
+    terminated, so use stringLength() as well.
+
+    @param object
+    @return const char*
+**/
+const char* stringChars(Obj* object) {
+  if (object->type == OBJ_SLICE) {
+    ObjSlice* slice = (ObjSlice*)object;
+    return slice->parent->chars + slice->start;
+  }
+
+  return ((ObjString*)object)->chars;
+}
+
+/**
+    @brief Get the depth of a rope. Flat strings have a depth of zero.
+
+    @param object
+    @return int
+**/
+int ropeDepth(Obj* object) {
+  if (object->type == OBJ_ROPE) return ((ObjRope*)object)->depth;
+  return 0;
+}
+
+/**
+    @brief Create a rope node that concatenates left and right. Both
+    must be reachable by the GC when this is called, and their combined
+    length must fit in an int.
+
+    @param left
+    @param right
+    @return ObjRope*
+**/
+ObjRope* newRope(Obj* left, Obj* right) {
+  ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+  rope->length = stringLength(left) + stringLength(right);
+  rope->depth = 1 + (ropeDepth(left) > ropeDepth(right) ?
+                     ropeDepth(left) : ropeDepth(right));
+  rope->left = left;
+  rope->right = right;
+  rope->flat = NULL;
+  return rope;
+}
+
+/**
+    @brief Add a string to the intern table.
+
+    @param string
     @param hash
     @return ObjString*
 **/
-static ObjString* allocateString(char* chars, int length,
-                                 uint32_t hash) {
-  ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-  string->length = length;
-  string->chars = chars;
+static ObjString* registerString(ObjString* string, uint32_t hash) {
   string->hash = hash;
 
   push(OBJ_VAL(string));
@@ -165,8 +291,198 @@ static uint32_t hashString(const char* key, int length) {
   return hash;
 }
 
+// Size of a string carved from a StringBlock, rounded up so that the
+// next one stays aligned.
+#define BLOCK_STRING_SIZE(length) \
+    ((sizeof(ObjString) + (length) + 1 + 7) & ~(size_t)7)
+
 /**
-    @brief
+    @brief Prepare to intern a batch of strings, such as the identifiers
+    and literals of a compilation unit. The intern table is grown once
+    for count new strings and a single block is allocated for them.
+    Both are estimates; strings that do not fit are allocated normally.
+
+    @param count
+    @param chars
+**/
+void beginStringBatch(int count, size_t chars) {
+  if (count == 0) return;
+
+  tableReserve(&vm.strings, vm.strings.count + count);
+
+  size_t capacity = BLOCK_STRING_SIZE(0) * count + chars;
+  StringBlock* block = (StringBlock*)reallocate(NULL, 0,
+      sizeof(StringBlock) + capacity);
+  block->used = 0;
+  block->capacity = capacity;
+  block->live = 0;
+  block->next = vm.stringBlocks;
+  vm.stringBlocks = block;
+  vm.batchingStrings = true;
+}
+
+/**
+    @brief Unlink a string block and release it.
+
+    @param block
+**/
+static void releaseStringBlock(StringBlock* block) {
+  StringBlock** link = &vm.stringBlocks;
+  while (*link != block) link = &(*link)->next;
+  *link = block->next;
+  reallocate(block, sizeof(StringBlock) + block->capacity, 0);
+}
+
+/**
+    @brief Stop carving new strings out of the current block, releasing
+    it if nothing was carved out of it.
+
+**/
+void endStringBatch() {
+  if (!vm.batchingStrings) return;
+  vm.batchingStrings = false;
+  if (vm.stringBlocks->used == 0) releaseStringBlock(vm.stringBlocks);
+}
+
+/**
+    @brief Count the strings in each block that the collection under way
+    has marked. Runs before the sweep clears the marks.
+
+**/
+void markStringBlocks() {
+  for (StringBlock* block = vm.stringBlocks; block != NULL;
+       block = block->next) {
+    block->live = 0;
+    size_t offset = 0;
+    while (offset < block->used) {
+      ObjString* string = (ObjString*)(block->data + offset);
+      if (string->obj.isMarked) block->live++;
+      offset += BLOCK_STRING_SIZE(string->length);
+    }
+  }
+}
+
+/**
+    @brief Release the blocks markStringBlocks() found no live strings
+    in, once the sweep has unlinked those strings. The block being
+    carved from is kept until its batch ends.
+
+**/
+void sweepStringBlocks() {
+  StringBlock** link = &vm.stringBlocks;
+  while (*link != NULL) {
+    StringBlock* block = *link;
+    if (block->live == 0 &&
+        !(vm.batchingStrings && block == vm.stringBlocks)) {
+      *link = block->next;
+      reallocate(block, sizeof(StringBlock) + block->capacity, 0);
+    } else {
+      link = &block->next;
+    }
+  }
+}
+
+/**
+    @brief Release every string block left. Only safe once no object in
+    them is referenced, which is when the VM is freed.
+
+**/
+void freeStringBlocks() {
+  StringBlock* block = vm.stringBlocks;
+  while (block != NULL) {
+    StringBlock* next = block->next;
+    reallocate(block, sizeof(StringBlock) + block->capacity, 0);
+    block = next;
+  }
+
+  vm.stringBlocks = NULL;
+}
+
+/**
+    @brief Carve a string out of the current block, or allocate it
+    normally if the block is full.
+
+    @param length
+    @return ObjString*
+**/
+static ObjString* newBlockString(int length) {
+  StringBlock* block = vm.stringBlocks;
+  size_t size = BLOCK_STRING_SIZE(length);
+  if (block->capacity - block->used < size) return newString(length);
+
+  ObjString* string = (ObjString*)(block->data + block->used);
+  block->used += size;
+
+  string->obj.type = OBJ_STRING;
+  string->obj.isMarked = false;
+  string->obj.inBlock = true;
+  string->obj.inFrame = false;
+  string->obj.inImage = false;
+  string->obj.next = vm.objects;
+  vm.objects = (Obj*)string;
+
+  string->length = length;
+  string->hash = 0;
+  string->chars = string->storage;
+  string->chars[length] = '\0';
+  return string;
+}
+
+/**
+    @brief Allocate a string whose characters are stored inline, in the
+    same allocation as the object. The caller fills in chars and then
+    passes the string to internString().
+
+    @param length
+    @return ObjString*
+**/
+ObjString* newString(int length) {
+  ObjString* string = (ObjString*)allocateObject(
+      sizeof(ObjString) + length + 1, OBJ_STRING);
+  string->length = length;
+  string->hash = 0;
+  string->chars = string->storage;
+  string->chars[length] = '\0';
+  return string;
+}
+
+/**
+    @brief Intern a string made by newString(). If an equal string is
+    already interned, that one is returned and the new one is left for
+    the GC.
+
+    @param string
+    @return ObjString*
+**/
+ObjString* internString(ObjString* string) {
+  uint32_t hash = hashString(string->chars, string->length);
+  ObjString* interned = tableFindString(&vm.strings, string->chars,
+                                        string->length, hash);
+  if (interned != NULL) return interned;
+
+  return registerString(string, hash);
+}
+
+/**
+    @brief Intern a string that was interned by another thread's VM,
+    whose hash is already known. If an equal string is interned here,
+    that one is returned instead.
+
+    @param string
+    @return ObjString*
+**/
+ObjString* adoptString(ObjString* string) {
+  ObjString* interned = tableFindString(&vm.strings, string->chars,
+                                        string->length, string->hash);
+  if (interned != NULL) return interned;
+
+  return registerString(string, string->hash);
+}
+
+/**
+    @brief Intern a heap buffer, taking ownership of it. Short buffers
+    are copied into the object and freed; longer ones are adopted as-is
+    so that the characters are not copied.
 
     @param chars
     @param length
@@ -181,7 +497,18 @@ ObjString* takeString(char* chars, int length) {
     return interned;
   }
 
-  return allocateString(chars, length, hash);
+  ObjString* string;
+  if (length <= STRING_INLINE_MAX) {
+    string = newString(length);
+    memcpy(string->chars, chars, length);
+    FREE_ARRAY(char, chars, length + 1);
+  } else {
+    string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    string->length = length;
+    string->chars = chars;
+  }
+
+  return registerString(string, hash);
 }
 
 /**
@@ -197,11 +524,254 @@ ObjString* copyString(const char* chars, int length) {
                                         hash);
   if (interned != NULL) return interned;
 
-  char* heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
+  ObjString* string = vm.batchingStrings ? newBlockString(length)
+                                         : newString(length);
+  memcpy(string->chars, chars, length);
 
-  return allocateString(heapChars, length, hash);
+  return registerString(string, hash);
+}
+
+/**
+    @brief Intern characters that live in a mapped cache image without
+    copying them. The characters must be followed by a terminator and
+    stay mapped for as long as the VM runs.
+
+    @param chars
+    @param length
+    @return ObjString*
+**/
+ObjString* imageString(const char* chars, int length) {
+  uint32_t hash = hashString(chars, length);
+  ObjString* interned = tableFindString(&vm.strings, chars, length,
+                                        hash);
+  if (interned != NULL) return interned;
+
+  ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+  string->obj.inImage = true;
+  string->length = length;
+  string->chars = (char*)chars;
+
+  return registerString(string, hash);
+}
+
+typedef void (*RopeVisitor)(const char* chars, int length,
+                            void* context);
+
+/**
+    @brief Visit each flat piece of a rope from left to right. Strings
+    and slices are a single piece. Uses an
+    explicit stack bounded by ROPE_MAX_DEPTH rather than recursion.
+
+    @param object
+    @param visit
+    @param context
+**/
+static void walkRope(Obj* object, RopeVisitor visit, void* context) {
+  Obj* pending[ROPE_MAX_DEPTH];
+  int pendingCount = 0;
+
+  for (;;) {
+    while (object->type == OBJ_ROPE) {
+      ObjRope* rope = (ObjRope*)object;
+      if (rope->flat != NULL) {
+        object = (Obj*)rope->flat;
+        break;
+      }
+
+      pending[pendingCount++] = rope->right;
+      object = rope->left;
+    }
+
+    visit(stringChars(object), stringLength(object), context);
+    if (pendingCount == 0) return;
+    object = pending[--pendingCount];
+  }
+}
+
+/**
+    @brief Append one piece of a rope to the buffer being flattened.
+
+    @param chars
+    @param length
+    @param context
+**/
+static void copyPiece(const char* chars, int length, void* context) {
+  char** dest = (char**)context;
+  memcpy(*dest, chars, length);
+  *dest += length;
+}
+
+/**
+    @brief Flatten a rope into a single interned string. The rope must be
+    reachable by the GC when this is called.
+
+    @param rope
+    @return ObjString*
+**/
+ObjString* flattenRope(ObjRope* rope) {
+  if (rope->flat != NULL) return rope->flat;
+
+  ObjString* string = newString(rope->length);
+  char* dest = string->chars;
+  walkRope((Obj*)rope, copyPiece, &dest);
+
+  rope->flat = internString(string);
+  rope->left = NULL;
+  rope->right = NULL;
+  return rope->flat;
+}
+
+/**
+    @brief Make a substring of a string or slice without copying it.
+    Short results are copied into an interned string instead, so that a
+    few characters do not keep a large parent alive. The source must be
+    reachable by the GC when this is called.
+
+    @param string
+    @param start
+    @param length
+    @return Obj*
+**/
+Obj* newSlice(Obj* string, int start, int length) {
+  if (length <= STRING_INLINE_MAX) {
+    return (Obj*)copyString(stringChars(string) + start, length);
+  }
+
+  if (string->type == OBJ_SLICE) {
+    start += ((ObjSlice*)string)->start;
+    string = (Obj*)((ObjSlice*)string)->parent;
+  }
+
+  ObjSlice* slice = ALLOCATE_OBJ(ObjSlice, OBJ_SLICE);
+  slice->start = start;
+  slice->length = length;
+  slice->parent = (ObjString*)string;
+  return (Obj*)slice;
+}
+
+/**
+    @brief
+
+    @return ObjStringBuilder*
+**/
+ObjStringBuilder* newStringBuilder() {
+  ObjStringBuilder* builder = ALLOCATE_OBJ(ObjStringBuilder,
+                                           OBJ_STRING_BUILDER);
+  builder->length = 0;
+  builder->capacity = 0;
+  builder->chars = NULL;
+  builder->string = NULL;
+  return builder;
+}
+
+/**
+    @brief Make room for at least extra more characters plus the
+    terminator, growing the buffer geometrically. If the contents were
+    handed to a string by builderToString(), they are copied back into
+    the buffer first.
+
+    @param builder
+    @param extra
+    @return bool False, leaving the builder as it was, if the contents
+            would grow too long for a string.
+**/
+static bool reserveBuilder(ObjStringBuilder* builder, int extra) {
+  int64_t needed = (int64_t)builder->length + extra + 1;
+  if (needed > INT_MAX) return false;
+
+  if (builder->capacity < needed) {
+    int oldCapacity = builder->capacity;
+    // Grown in size_t so that doubling a large buffer cannot overflow.
+    size_t capacity = GROW_CAPACITY((size_t)oldCapacity);
+    while (capacity < (size_t)needed) capacity *= 2;
+    if (capacity > INT_MAX) capacity = INT_MAX;
+
+    builder->chars = GROW_ARRAY(builder->chars, char,
+                                oldCapacity, capacity);
+    builder->capacity = (int)capacity;
+  }
+
+  if (builder->string != NULL) {
+    memcpy(builder->chars, builder->string->chars, builder->length);
+    builder->string = NULL;
+  }
+  return true;
+}
+
+/**
+    @brief
+
+    @param builder
+    @param chars
+    @param length
+    @return bool False if the result would be too long for a string.
+**/
+bool appendToBuilder(ObjStringBuilder* builder, const char* chars,
+                     int length) {
+  if (!reserveBuilder(builder, length)) return false;
+  memcpy(builder->chars + builder->length, chars, length);
+  builder->length += length;
+  return true;
+}
+
+/**
+    @brief Append one piece of a rope to a builder.
+
+    @param chars
+    @param length
+    @param context
+**/
+static void appendPiece(const char* chars, int length, void* context) {
+  ObjStringBuilder* builder = (ObjStringBuilder*)context;
+  memcpy(builder->chars + builder->length, chars, length);
+  builder->length += length;
+}
+
+/**
+    @brief Append a string, rope or slice to a builder. Ropes are copied
+    piece by piece without being flattened.
+
+    @param builder
+    @param string
+    @return bool False if the result would be too long for a string.
+**/
+bool appendStringToBuilder(ObjStringBuilder* builder, Obj* string) {
+  if (!reserveBuilder(builder, stringLength(string))) return false;
+  walkRope(string, appendPiece, builder);
+  return true;
+}
+
+/**
+    @brief Empty the builder but keep its buffer for reuse.
+
+    @param builder
+**/
+void clearBuilder(ObjStringBuilder* builder) {
+  builder->length = 0;
+  builder->string = NULL;
+}
+
+/**
+    @brief Get the contents of a builder as an interned string. The
+    buffer is shrunk to fit and handed to takeString(), which adopts it
+    unless it is short enough to store inline.
+
+    @param builder
+    @return ObjString*
+**/
+ObjString* builderToString(ObjStringBuilder* builder) {
+  if (builder->string != NULL) return builder->string;
+
+  // Cannot fail: the buffer already holds the contents and a terminator.
+  reserveBuilder(builder, 0);
+  char* chars = GROW_ARRAY(builder->chars, char,
+                           builder->capacity, builder->length + 1);
+  chars[builder->length] = '\0';
+  builder->chars = NULL;
+  builder->capacity = 0;
+
+  builder->string = takeString(chars, builder->length);
+  return builder->string;
 }
 
 /**
@@ -225,10 +795,24 @@ ObjUpvalue* newUpvalue(Value* slot) {
 **/
 static void printFunction(ObjFunction* function) {
   if (function->name == NULL) {
-    printf("<script>");
+    writeOutputString("<script>");
     return;
   }
-  printf("<fn %s>", function->name->chars);
+  writeOutputString("<fn ");
+  writeOutput(function->name->chars, function->name->length);
+  writeOutputString(">");
+}
+
+/**
+    @brief Print one piece of a rope.
+
+    @param chars
+    @param length
+    @param context
+**/
+static void printPiece(const char* chars, int length, void* context) {
+  (void)context;
+  writeOutput(chars, length);
 }
 
 /**
@@ -239,7 +823,8 @@ static void printFunction(ObjFunction* function) {
 void printObject(Value value) {
   switch (OBJ_TYPE(value)) {
     case OBJ_CLASS:
-      printf("%s", AS_CLASS(value)->name->chars);
+      writeOutput(AS_CLASS(value)->name->chars,
+                  AS_CLASS(value)->name->length);
       break;
     case OBJ_BOUND_METHOD:
       printFunction(AS_BOUND_METHOD(value)->method->function);
@@ -250,17 +835,35 @@ void printObject(Value value) {
     case OBJ_FUNCTION:
       printFunction(AS_FUNCTION(value));
       break;
-    case OBJ_INSTANCE:
-      printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+    case OBJ_INSTANCE: {
+      ObjString* name = AS_INSTANCE(value)->klass->name;
+      writeOutput(name->chars, name->length);
+      writeOutputString(" instance");
       break;
+    }
     case OBJ_NATIVE:
-      printf("<native fn>");
+      writeOutputString("<native fn>");
+      break;
+    case OBJ_ROPE:
+      walkRope(AS_OBJ(value), printPiece, NULL);
+      break;
+    case OBJ_SLICE:
+      writeOutput(stringChars(AS_OBJ(value)), AS_SLICE(value)->length);
       break;
     case OBJ_STRING:
-      printf("%s", AS_CSTRING(value));
+      writeOutput(AS_CSTRING(value), AS_STRING(value)->length);
+      break;
+    case OBJ_STRING_BUILDER: {
+      ObjStringBuilder* builder = AS_STRING_BUILDER(value);
+      if (builder->string != NULL) {
+        writeOutput(builder->string->chars, builder->string->length);
+      } else {
+        writeOutput(builder->chars, builder->length);
+      }
       break;
+    }
     case OBJ_UPVALUE:
-      printf("upvalue");
+      writeOutputString("upvalue");
       break;
   }
 }
@@ -20,7 +20,10 @@
 #define IS_FUNCTION(value)      isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)      isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value)        isObjType(value, OBJ_NATIVE)
+#define IS_ROPE(value)          isObjType(value, OBJ_ROPE)
+#define IS_SLICE(value)         isObjType(value, OBJ_SLICE)
 #define IS_STRING(value)        isObjType(value, OBJ_STRING)
+#define IS_STRING_BUILDER(value) isObjType(value, OBJ_STRING_BUILDER)
 
 #define AS_BOUND_METHOD(value)  ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CLASS(value)         ((ObjClass*)AS_OBJ(value))
@@ -28,8 +31,22 @@
 #define AS_FUNCTION(value)      ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value)      ((ObjInstance*)AS_OBJ(value))
 #define AS_NATIVE(value)        (((ObjNative*)AS_OBJ(value))->function)
+#define AS_ROPE(value)          ((ObjRope*)AS_OBJ(value))
+#define AS_SLICE(value)         ((ObjSlice*)AS_OBJ(value))
 #define AS_STRING(value)        ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)       (((ObjString*)AS_OBJ(value))->chars)
+#define AS_STRING_BUILDER(value) ((ObjStringBuilder*)AS_OBJ(value))
+
+// Buffers this short given to takeString() are copied into the string
+// object rather than adopted.
+#define STRING_INLINE_MAX 23
+
+// Concatenations shorter than this are copied eagerly instead of
+// building a rope node.
+#define ROPE_MIN_LENGTH 64
+// Ropes deeper than this are flattened before being extended. This
+// bounds the work stack used to walk a rope.
+#define ROPE_MAX_DEPTH 1024
 
 typedef enum {
   OBJ_BOUND_METHOD,
@@ -38,37 +55,139 @@ typedef enum {
   OBJ_FUNCTION,
   OBJ_INSTANCE,
   OBJ_NATIVE,
+  OBJ_ROPE,
+  OBJ_SLICE,
   OBJ_STRING,
+  OBJ_STRING_BUILDER,
   OBJ_UPVALUE
 } ObjType;
 
 struct sObj {
   ObjType type;
   bool isMarked;
+  // Set for objects carved out of a StringBlock. Their memory is
+  // released with the block, once the last of them is freed.
+  bool inBlock;
+  // Set for closures and upvalues carved out of the frame arena. They
+  // are not on the object list and are released with their frame.
+  bool inFrame;
+  // Set for strings and functions loaded from a mapped cache image. The
+  // string's characters, or the function's code and line table, are
+  // read from the image in place and are not freed with the object.
+  bool inImage;
   struct sObj* next;
 };
 
+/**
+    @brief Bulk storage for the strings interned while compiling.
+
+    Strings are carved out of the block one after another instead of
+    being allocated one at a time. A block is released by the first
+    collection that finds none of its strings reachable.
+**/
+typedef struct sStringBlock {
+  struct sStringBlock* next;
+  size_t used;
+  size_t capacity;
+  // Strings carved out of the block that the current collection has
+  // found reachable.
+  size_t live;
+  char data[];
+} StringBlock;
+
+/**
+    @brief Body shapes simple enough to evaluate in the caller.
+**/
+typedef enum {
+  INLINE_NONE,
+  INLINE_CONSTANT, // return <constant>;
+  INLINE_SLOT,     // return <parameter or this>;
+  INLINE_FIELD     // return this.<field>;
+} InlineKind;
+
 typedef struct {
   Obj obj;
   int arity;
   int upvalueCount;
   Chunk chunk;
   ObjString* name;
+  // Stack slots a call uses at most: the callee, its parameters and
+  // locals, and the temporaries of its deepest expression.
+  int maxSlots;
+  InlineKind inlineKind;
+  uint8_t inlineSlot;
+  Value inlineValue;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+// A native stores its result in args[-1], which holds the callee or the
+// receiver, and returns false after reporting a runtime error.
+typedef bool (*NativeFn)(int argCount, Value* args);
 
 typedef struct {
   Obj obj;
   NativeFn function;
 } ObjNative;
 
+/**
+    @brief Interned string.
+
+    chars normally points at storage, so the object and its characters
+    share one allocation. Long buffers handed over by takeString() are
+    adopted instead, and chars points at the separate buffer.
+**/
 struct sObjString {
   Obj obj;
   int length;
-  char* chars;
   uint32_t hash;
+  char* chars;
+  char storage[];
 };
+
+/**
+    @brief Lazy concatenation of two strings.
+
+    Each side can be any string-like object: an ObjString, an ObjSlice
+    or another ObjRope. The node is flattened into an interned ObjString
+    the first time its contents are needed for comparison; after that,
+    flat points to the result and the children are released.
+**/
+typedef struct {
+  Obj obj;
+  int length;
+  int depth;
+  Obj* left;
+  Obj* right;
+  ObjString* flat;
+} ObjRope;
+/**
+    @brief Substring that shares the characters of its parent.
+
+    The parent is kept alive by the GC for as long as the slice is. A
+    slice is not interned, so comparisons look at its characters.
+**/
+typedef struct {
+  Obj obj;
+  int start;
+  int length;
+  ObjString* parent;
+} ObjSlice;
+
+/**
+    @brief Mutable character buffer for building strings in place.
+
+    After toString() the buffer is handed to takeString(), so long
+    contents become an interned ObjString without being copied. The
+    builder keeps that string until it is changed again, at which point
+    the characters are copied back into a new buffer.
+**/
+typedef struct {
+  Obj obj;
+  int length;
+  int capacity;
+  char* chars;
+  ObjString* string;
+} ObjStringBuilder;
+
 typedef struct sUpvalue {
   Obj obj;
   Value* location;
@@ -103,11 +222,35 @@ typedef struct {
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 ObjClass* newClass(ObjString* name);
 ObjClosure* newClosure(ObjFunction* function);
+ObjClosure* newFrameClosure(ObjFunction* function);
+size_t frameClosureSize(int upvalueCount);
+ObjUpvalue* frameClosureUpvalues(ObjClosure* closure);
 ObjFunction* newFunction();
 ObjInstance* newInstance(ObjClass* klass);
 ObjNative* newNative(NativeFn function);
+ObjRope* newRope(Obj* left, Obj* right);
+ObjString* flattenRope(ObjRope* rope);
+Obj* newSlice(Obj* string, int start, int length);
+int stringLength(Obj* object);
+const char* stringChars(Obj* object);
+int ropeDepth(Obj* object);
+void beginStringBatch(int count, size_t chars);
+void endStringBatch();
+void markStringBlocks();
+void sweepStringBlocks();
+void freeStringBlocks();
+ObjString* newString(int length);
+ObjString* internString(ObjString* string);
+ObjString* adoptString(ObjString* string);
 ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char* chars, int length);
+ObjString* imageString(const char* chars, int length);
+ObjStringBuilder* newStringBuilder();
+bool appendToBuilder(ObjStringBuilder* builder, const char* chars,
+                     int length);
+bool appendStringToBuilder(ObjStringBuilder* builder, Obj* string);
+void clearBuilder(ObjStringBuilder* builder);
+ObjString* builderToString(ObjStringBuilder* builder);
 ObjUpvalue* newUpvalue(Value* slot);
 void printObject(Value value);
 
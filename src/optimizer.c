@@ -0,0 +1,1728 @@
+/**
+    @file optimizer.c
+
+    @brief Optimization pipeline run over each finished function.
+
+    The function's chunk is lifted into an instruction list: one entry per
+    instruction with its operands, source line, and jump target held as an
+    instruction index. Passes rewrite or delete entries in that list, and
+    the survivors are encoded back into the chunk once the pipeline
+    settles, recomputing jump offsets and the line table.
+
+    A flow analysis over the list finds unreachable instructions and the
+    stack depth before every reachable one. With the depth known, a push
+    at depth n is known to write local slot n, which lets the value
+    tracking passes follow locals through declarations as well as stores.
+
+**/
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "optimizer.h"
+
+#define MAX_JUMP_HOPS 16
+#define MAX_PIPELINE_ROUNDS 8
+// Largest instruction count times stack depth the numeric analysis
+// keeps state for.
+#define MAX_NUMERIC_STATE (1 << 20)
+
+/**
+    @brief One decoded instruction.
+**/
+typedef struct {
+  uint8_t op;
+  int operand;
+  uint8_t argCount;
+  bool wide;
+  int length;
+  int line;
+  int offset;
+  int target;
+  // OP_FOR_LOOP's counter slot and step constant.
+  uint8_t counter;
+  uint8_t step;
+  int depth;
+  bool isTarget;
+  bool removed;
+} Instruction;
+
+/**
+    @brief Working state for one function.
+**/
+typedef struct {
+  Chunk* chunk;
+  uint8_t* source;
+  int sourceCount;
+  Instruction* code;
+  int count;
+  int arity;
+  int maxDepth;
+  bool depthsKnown;
+  // Stack slots added by hoisting, beyond the function's locals.
+  int extraSlots;
+} Optimizer;
+
+typedef bool (*PassFn)(Optimizer* opt);
+
+/**
+    @brief A pass and the lowest optimization level that runs it.
+**/
+typedef struct {
+  const char* name;
+  PassFn run;
+  int level;
+} Pass;
+
+/**
+    @brief What a value tracking pass knows about a stack slot.
+**/
+typedef enum {
+  SLOT_UNKNOWN,
+  SLOT_CONSTANT,
+  SLOT_COPY
+} SlotKind;
+
+/**
+    @brief Known slot contents: a constant load, or a copy of another slot.
+**/
+typedef struct {
+  SlotKind kind;
+  uint8_t op;
+  int operand;
+} SlotValue;
+
+/**
+    @brief Whether an opcode jumps.
+
+    @param op
+    @return bool
+**/
+static bool isJump(uint8_t op) {
+  return op == OP_JUMP || op == OP_JUMP_IF_FALSE ||
+         op == OP_JUMP_IF_TRUE || op == OP_LOOP ||
+         op == OP_LOOP_IF_TRUE || op == OP_FOR_LOOP;
+}
+
+/**
+    @brief Whether an opcode's jump is encoded as a distance backwards.
+
+    @param op
+    @return bool
+**/
+static bool isBackward(uint8_t op) {
+  return op == OP_LOOP || op == OP_LOOP_IF_TRUE || op == OP_FOR_LOOP;
+}
+
+/**
+    @brief Whether an opcode jumps only on some condition.
+
+    @param op
+    @return bool
+**/
+static bool isConditional(uint8_t op) {
+  return op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE;
+}
+
+/**
+    @brief Whether execution never falls through an opcode.
+
+    @param op
+    @return bool
+**/
+static bool isTerminal(uint8_t op) {
+  return op == OP_JUMP || op == OP_LOOP || op == OP_RETURN;
+}
+
+/**
+    @brief Whether an opcode loads a constant.
+
+    @param op
+    @return bool
+**/
+static bool isConstantLoad(uint8_t op) {
+  return op == OP_CONSTANT || op == OP_NIL ||
+         op == OP_TRUE || op == OP_FALSE;
+}
+
+/**
+    @brief Whether an opcode pushes one value with no other effect.
+
+    @param op
+    @return bool
+**/
+static bool isPurePush(uint8_t op) {
+  return isConstantLoad(op) || op == OP_GET_LOCAL ||
+         op == OP_GET_UPVALUE || op == OP_DUP;
+}
+
+/**
+    @brief Whether an opcode may run user code, which can write any
+           captured local through an upvalue.
+
+    @param op
+    @return bool
+**/
+static bool isCall(uint8_t op) {
+  return op == OP_CALL || op == OP_TAIL_CALL || op == OP_INVOKE ||
+         op == OP_SUPER_INVOKE;
+}
+
+/**
+    @brief Whether an opcode makes a closure. Its upvalue operands are
+           copied through untouched.
+
+    @param op
+    @return bool
+**/
+static bool isClosure(uint8_t op) {
+  return op == OP_CLOSURE || op == OP_FRAME_CLOSURE;
+}
+
+/**
+    @brief The plain opcode an arithmetic or comparison opcode stands
+           for, checked or not.
+
+    @param op
+    @return uint8_t
+**/
+static uint8_t checkedOp(uint8_t op) {
+  switch (op) {
+    case OP_GREATER_NUMBER:  return OP_GREATER;
+    case OP_LESS_NUMBER:     return OP_LESS;
+    case OP_ADD_NUMBER:      return OP_ADD;
+    case OP_SUBTRACT_NUMBER: return OP_SUBTRACT;
+    case OP_MULTIPLY_NUMBER: return OP_MULTIPLY;
+    case OP_DIVIDE_NUMBER:   return OP_DIVIDE;
+    default:                 return op;
+  }
+}
+
+/**
+    @brief Values an instruction pops and pushes.
+
+    Instructions that only peek at the stack count as neither.
+
+    @param instruction
+    @param pops
+    @param pushes
+**/
+static void stackEffect(Instruction* instruction, int* pops, int* pushes) {
+  *pops = 0;
+  *pushes = 0;
+  switch (instruction->op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_DUP:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_CLOSURE:
+    case OP_FRAME_CLOSURE:
+    case OP_CLASS:
+      *pushes = 1;
+      break;
+    case OP_POP:
+    case OP_LOOP_IF_TRUE:
+    case OP_FOR_LOOP:
+    case OP_DEFINE_GLOBAL:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_POP_FRAME_CLOSURE:
+    case OP_RETURN:
+    case OP_INHERIT:
+    case OP_METHOD:
+      *pops = 1;
+      break;
+    case OP_SET_LOCAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_GET_PROPERTY:
+    case OP_NOT:
+    case OP_NEGATE:
+      *pops = 1;
+      *pushes = 1;
+      break;
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_GREATER_NUMBER:
+    case OP_LESS_NUMBER:
+    case OP_ADD_NUMBER:
+    case OP_SUBTRACT_NUMBER:
+    case OP_MULTIPLY_NUMBER:
+    case OP_DIVIDE_NUMBER:
+      *pops = 2;
+      *pushes = 1;
+      break;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      *pops = instruction->operand + 1;
+      *pushes = 1;
+      break;
+    case OP_INVOKE:
+      *pops = instruction->argCount + 1;
+      *pushes = 1;
+      break;
+    case OP_SUPER_INVOKE:
+      *pops = instruction->argCount + 2;
+      *pushes = 1;
+      break;
+  }
+}
+
+/**
+    @brief Replace an instruction with one taking at most an index.
+
+    @param instruction
+    @param op
+    @param operand
+**/
+static void rewrite(Instruction* instruction, uint8_t op, int operand) {
+  instruction->op = op;
+  instruction->operand = operand;
+}
+
+/**
+    @brief Index of the first live instruction at or after index.
+
+    @param opt
+    @param index
+    @return int Instruction count if none is left.
+**/
+static int nextLive(Optimizer* opt, int index) {
+  while (index < opt->count && opt->code[index].removed) index++;
+  return index;
+}
+
+/**
+    @brief Index of the live instruction following index.
+
+    @param opt
+    @param index
+    @return int
+**/
+static int following(Optimizer* opt, int index) {
+  return nextLive(opt, index + 1);
+}
+
+/**
+    @brief Whether index names a live instruction of the given opcode.
+
+    @param opt
+    @param index
+    @param op
+    @return bool
+**/
+static bool isOp(Optimizer* opt, int index, uint8_t op) {
+  return index < opt->count && opt->code[index].op == op;
+}
+
+/**
+    @brief Lift a chunk into an instruction list.
+
+    The original bytes are kept aside for closures, which are copied
+    through untouched along with its upvalue operands. Jumps listed in
+    farJumps take their target from there rather than their operand.
+
+    @param opt
+    @param function
+    @param farJumps
+    @param farJumpCount
+**/
+static void decodeFunction(Optimizer* opt, ObjFunction* function,
+                           FarJump* farJumps, int farJumpCount) {
+  Chunk* chunk = &function->chunk;
+  opt->chunk = chunk;
+  opt->arity = function->arity;
+  opt->depthsKnown = false;
+  opt->maxDepth = 0;
+  opt->extraSlots = 0;
+  opt->count = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    opt->count++;
+  }
+
+  opt->sourceCount = chunk->count;
+  opt->source = ALLOCATE(uint8_t, chunk->count);
+  memcpy(opt->source, chunk->code, chunk->count);
+
+  opt->code = ALLOCATE(Instruction, opt->count);
+  int* indexOf = ALLOCATE(int, chunk->count + 1);
+
+  int offset = 0;
+  for (int i = 0; i < opt->count; i++) {
+    Instruction* instruction = &opt->code[i];
+    instruction->wide = chunk->code[offset] == OP_WIDE;
+    instruction->op = chunk->code[offset + (instruction->wide ? 1 : 0)];
+    instruction->length = instructionLength(chunk, offset);
+    instruction->operand = instruction->length > 1
+        ? readOperand(chunk, offset) : 0;
+    instruction->argCount = chunk->code[offset + instruction->length - 1];
+    instruction->line = getLine(chunk, offset);
+    instruction->offset = offset;
+    instruction->target = -1;
+    instruction->counter = 0;
+    instruction->step = 0;
+    if (instruction->op == OP_FOR_LOOP) {
+      instruction->counter = chunk->code[offset + instruction->length - 2];
+      instruction->step = chunk->code[offset + instruction->length - 1];
+    }
+    instruction->depth = -1;
+    instruction->isTarget = false;
+    instruction->removed = false;
+    indexOf[offset] = i;
+    offset += instruction->length;
+  }
+  indexOf[chunk->count] = opt->count;
+
+  for (int i = 0; i < opt->count; i++) {
+    Instruction* instruction = &opt->code[i];
+    if (!isJump(instruction->op)) continue;
+
+    int next = instruction->offset + instruction->length;
+    int target = isBackward(instruction->op) ? next - instruction->operand
+                                             : next + instruction->operand;
+    for (int j = 0; j < farJumpCount; j++) {
+      if (farJumps[j].offset == instruction->offset) {
+        target = farJumps[j].target;
+      }
+    }
+    instruction->target = indexOf[target];
+  }
+
+  FREE_ARRAY(int, indexOf, chunk->count + 1);
+}
+
+/**
+    @brief Recompute which instructions are landed on by a jump.
+
+    @param opt
+**/
+static void markTargets(Optimizer* opt) {
+  for (int i = 0; i < opt->count; i++) opt->code[i].isTarget = false;
+
+  for (int i = 0; i < opt->count; i++) {
+    if (opt->code[i].removed || opt->code[i].target == -1) continue;
+    int target = nextLive(opt, opt->code[i].target);
+    if (target < opt->count) opt->code[target].isTarget = true;
+  }
+}
+
+/**
+    @brief Record the stack depth on entry to an instruction.
+
+    @param opt
+    @param worklist
+    @param pending
+    @param index
+    @param depth
+    @return bool False if the instruction was reached at another depth.
+**/
+static bool reach(Optimizer* opt, int* worklist, int* pending,
+                  int index, int depth) {
+  if (index >= opt->count) return true;
+  Instruction* instruction = &opt->code[index];
+  if (instruction->depth != -1) return instruction->depth == depth;
+
+  instruction->depth = depth;
+  if (depth > opt->maxDepth) opt->maxDepth = depth;
+  worklist[(*pending)++] = index;
+  return true;
+}
+
+/**
+    @brief Find reachable instructions and the stack depth before each.
+
+    Sets depth to -1 on unreachable instructions. If two paths disagree
+    on the depth at some instruction, depths are left marked unknown so
+    the passes that rely on them stand down.
+
+    @param opt
+**/
+static void analyzeFlow(Optimizer* opt) {
+  markTargets(opt);
+  for (int i = 0; i < opt->count; i++) opt->code[i].depth = -1;
+  opt->maxDepth = 0;
+
+  int* worklist = ALLOCATE(int, opt->count);
+  int pending = 0;
+  bool consistent = reach(opt, worklist, &pending,
+                          nextLive(opt, 0), opt->arity + 1);
+
+  while (consistent && pending > 0) {
+    int index = worklist[--pending];
+    Instruction* instruction = &opt->code[index];
+
+    int pops, pushes;
+    stackEffect(instruction, &pops, &pushes);
+    int depth = instruction->depth - pops + pushes;
+    if (depth < 0) consistent = false;
+
+    if (instruction->target != -1) {
+      consistent = consistent &&
+          reach(opt, worklist, &pending,
+                nextLive(opt, instruction->target), depth);
+    }
+    if (!isTerminal(instruction->op)) {
+      consistent = consistent &&
+          reach(opt, worklist, &pending, following(opt, index), depth);
+    }
+  }
+
+  FREE_ARRAY(int, worklist, opt->count);
+  opt->depthsKnown = consistent;
+}
+
+/**
+    @brief Record a larger stack depth on entry to an instruction, and
+    queue it to pass the new depth on.
+
+    @param opt
+    @param worklist
+    @param pending
+    @param queued
+    @param index
+    @param depth
+**/
+static void reachDeeper(Optimizer* opt, int* worklist, int* pending,
+                        bool* queued, int index, int depth) {
+  if (index >= opt->count) return;
+  // Well-formed code reaches each instruction at a single depth, which
+  // no path of distinct instructions can take past this. The cap keeps
+  // anything else from looping forever.
+  int limit = opt->arity + 1 + opt->count;
+  if (depth > limit) depth = limit;
+
+  Instruction* instruction = &opt->code[index];
+  if (depth <= instruction->depth) return;
+  instruction->depth = depth;
+  if (depth > opt->maxDepth) opt->maxDepth = depth;
+  if (!queued[index]) {
+    queued[index] = true;
+    worklist[(*pending)++] = index;
+  }
+}
+
+/**
+    @brief Raise a finished function's maxSlots to the deepest the stack
+    gets in it, temporaries included.
+
+    Unlike analyzeFlow(), paths that disagree on a depth do not stop the
+    analysis; the deepest is kept, so the result is always a bound.
+
+    @param function
+**/
+void measureStack(ObjFunction* function) {
+  Optimizer opt;
+  decodeFunction(&opt, function, NULL, 0);
+
+  int* worklist = ALLOCATE(int, opt.count);
+  bool* queued = ALLOCATE(bool, opt.count);
+  for (int i = 0; i < opt.count; i++) queued[i] = false;
+  int pending = 0;
+  reachDeeper(&opt, worklist, &pending, queued, 0, opt.arity + 1);
+
+  while (pending > 0) {
+    int index = worklist[--pending];
+    queued[index] = false;
+    Instruction* instruction = &opt.code[index];
+
+    int pops, pushes;
+    stackEffect(instruction, &pops, &pushes);
+    int depth = instruction->depth - pops + pushes;
+    if (depth < 0) depth = 0;
+    if (instruction->target != -1) {
+      reachDeeper(&opt, worklist, &pending, queued,
+                  instruction->target, depth);
+    }
+    if (!isTerminal(instruction->op)) {
+      reachDeeper(&opt, worklist, &pending, queued, index + 1, depth);
+    }
+  }
+
+  if (opt.maxDepth > function->maxSlots) function->maxSlots = opt.maxDepth;
+  FREE_ARRAY(bool, queued, opt.count);
+  FREE_ARRAY(int, worklist, opt.count);
+  FREE_ARRAY(Instruction, opt.code, opt.count);
+  FREE_ARRAY(uint8_t, opt.source, opt.sourceCount);
+}
+
+/**
+    @brief Check that a function's code keeps its frame in order: every
+    instruction is reached at one stack depth, nothing but a return pops
+    the callee's slot, and only locals already pushed are read, written
+    or captured. maxSlots is raised to the deepest the stack gets, as in
+    measureStack().
+
+    For code from outside the compiler. It must already be known to
+    decode into whole instructions, with every jump landing on one.
+
+    @param function
+    @return bool
+**/
+bool checkStack(ObjFunction* function) {
+  Optimizer opt;
+  decodeFunction(&opt, function, NULL, 0);
+  analyzeFlow(&opt);
+
+  bool valid = opt.depthsKnown;
+  for (int i = 0; valid && i < opt.count; i++) {
+    Instruction* instruction = &opt.code[i];
+    if (instruction->depth == -1) continue;
+
+    // A return pops its result and then the whole frame.
+    int pops, pushes;
+    stackEffect(instruction, &pops, &pushes);
+    valid = instruction->depth - pops >= 1;
+    if (!valid) break;
+
+    switch (instruction->op) {
+      case OP_GET_LOCAL:
+      case OP_SET_LOCAL:
+        valid = instruction->operand < instruction->depth;
+        break;
+      case OP_FOR_LOOP:
+        // The counter lies below the limit the loop pops.
+        valid = instruction->counter < instruction->depth - 1;
+        break;
+      case OP_CLOSURE:
+      case OP_FRAME_CLOSURE: {
+        uint8_t* code = &opt.source[instruction->offset];
+        int upvalueCount = AS_FUNCTION(
+            opt.chunk->constants.values[instruction->operand])->upvalueCount;
+        int offset = instruction->wide ? 5 : 2;
+        for (int j = 0; valid && j < upvalueCount; j++) {
+          bool isLocal = code[offset] != 0;
+          int index = code[offset + 1];
+          if (instruction->wide) {
+            index = (index << 16) | (code[offset + 2] << 8) |
+                    code[offset + 3];
+          }
+          offset += instruction->wide ? 4 : 2;
+          // The closure is pushed first, so it can capture itself.
+          if (isLocal) valid = index <= instruction->depth;
+        }
+        break;
+      }
+    }
+  }
+
+  if (valid && opt.maxDepth > function->maxSlots) {
+    function->maxSlots = opt.maxDepth;
+  }
+  FREE_ARRAY(Instruction, opt.code, opt.count);
+  FREE_ARRAY(uint8_t, opt.source, opt.sourceCount);
+  return valid;
+}
+
+/**
+    @brief Remove instructions no path from the entry reaches, such as
+           code after a return.
+
+    @param opt
+    @return bool Whether anything changed.
+**/
+static bool eliminateDeadCode(Optimizer* opt) {
+  if (!opt->depthsKnown) return false;
+
+  bool changed = false;
+  for (int i = 0; i < opt->count; i++) {
+    Instruction* instruction = &opt->code[i];
+    if (!instruction->removed && instruction->depth == -1) {
+      instruction->removed = true;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+/**
+    @brief Forget a slot and every slot recorded as a copy of it.
+
+    @param slots
+    @param count
+    @param slot
+**/
+static void forgetSlot(SlotValue* slots, int count, int slot) {
+  slots[slot].kind = SLOT_UNKNOWN;
+  for (int i = 0; i < count; i++) {
+    if (slots[i].kind == SLOT_COPY && slots[i].operand == slot) {
+      slots[i].kind = SLOT_UNKNOWN;
+    }
+  }
+}
+
+/**
+    @brief Forget every slot.
+
+    @param slots
+    @param count
+**/
+static void forgetAll(SlotValue* slots, int count) {
+  for (int i = 0; i < count; i++) slots[i].kind = SLOT_UNKNOWN;
+}
+
+/**
+    @brief What a push of slot's value would be known to hold.
+
+    @param slots
+    @param slot
+    @return SlotValue
+**/
+static SlotValue loadSlot(SlotValue* slots, int slot) {
+  if (slots[slot].kind != SLOT_UNKNOWN) return slots[slot];
+  SlotValue copy = { SLOT_COPY, OP_GET_LOCAL, slot };
+  return copy;
+}
+
+/**
+    @brief Update slot knowledge across one instruction.
+
+    @param slots
+    @param count
+    @param instruction
+**/
+static void trackSlots(SlotValue* slots, int count,
+                       Instruction* instruction) {
+  int depth = instruction->depth;
+
+  if (instruction->op == OP_SET_LOCAL) {
+    int slot = instruction->operand;
+    SlotValue value = slots[depth - 1];
+    forgetSlot(slots, count, slot);
+    if (!(value.kind == SLOT_COPY && value.operand == slot)) {
+      slots[slot] = value;
+    }
+    return;
+  }
+
+  if (isCall(instruction->op)) forgetAll(slots, count);
+  if (instruction->op == OP_FOR_LOOP) {
+    forgetSlot(slots, count, instruction->counter);
+  }
+
+  int pops, pushes;
+  stackEffect(instruction, &pops, &pushes);
+
+  SlotValue pushed = { SLOT_UNKNOWN, 0, 0 };
+  if (isConstantLoad(instruction->op)) {
+    pushed.kind = SLOT_CONSTANT;
+    pushed.op = instruction->op;
+    pushed.operand = instruction->operand;
+  } else if (instruction->op == OP_GET_LOCAL) {
+    pushed = loadSlot(slots, instruction->operand);
+  } else if (instruction->op == OP_DUP) {
+    pushed = loadSlot(slots, depth - 1);
+  }
+
+  int end = depth > depth - pops + pushes ? depth : depth - pops + pushes;
+  for (int slot = depth - pops; slot < end; slot++) {
+    forgetSlot(slots, count, slot);
+  }
+  if (pushes == 1 && pops == 0) slots[depth] = pushed;
+}
+
+/**
+    @brief Rewrite local loads using what is known about the slots.
+
+    Within a block, a load of a slot known to hold a constant becomes
+    that constant load, and with copies enabled a load of a slot known to
+    copy another becomes a load of the original. Knowledge is dropped at
+    jump targets and across calls, since a closure may write a captured
+    local.
+
+    @param opt
+    @param copies
+    @return bool Whether anything changed.
+**/
+static bool propagateSlots(Optimizer* opt, bool copies) {
+  if (!opt->depthsKnown) return false;
+
+  int count = opt->maxDepth + 2;
+  SlotValue* slots = ALLOCATE(SlotValue, count);
+  forgetAll(slots, count);
+
+  bool changed = false;
+  for (int i = nextLive(opt, 0); i < opt->count; i = following(opt, i)) {
+    Instruction* instruction = &opt->code[i];
+    if (instruction->isTarget) forgetAll(slots, count);
+
+    if (instruction->op == OP_GET_LOCAL) {
+      SlotValue known = slots[instruction->operand];
+      if (!copies && known.kind == SLOT_CONSTANT) {
+        rewrite(instruction, known.op, known.operand);
+        changed = true;
+      } else if (copies && known.kind == SLOT_COPY) {
+        rewrite(instruction, OP_GET_LOCAL, known.operand);
+        changed = true;
+      }
+    }
+
+    trackSlots(slots, count, instruction);
+  }
+
+  FREE_ARRAY(SlotValue, slots, count);
+  return changed;
+}
+
+/**
+    @brief Replace loads of locals known to hold constants.
+
+    @param opt
+    @return bool Whether anything changed.
+**/
+static bool propagateConstants(Optimizer* opt) {
+  return propagateSlots(opt, false);
+}
+
+/**
+    @brief Replace loads of locals known to copy other locals.
+
+    @param opt
+    @return bool Whether anything changed.
+**/
+static bool propagateCopies(Optimizer* opt) {
+  return propagateSlots(opt, true);
+}
+
+/**
+    @brief Turn a repeated load of the same variable into OP_DUP.
+
+    Nothing runs between two adjacent loads, so the second always sees
+    the value the first pushed, globals included.
+
+    @param opt
+    @return bool Whether anything changed.
+**/
+static bool eliminateCommonLoads(Optimizer* opt) {
+  bool changed = false;
+  for (int i = nextLive(opt, 0); i < opt->count; i = following(opt, i)) {
+    Instruction* instruction = &opt->code[i];
+    uint8_t op = instruction->op;
+    if (op != OP_GET_LOCAL && op != OP_GET_UPVALUE && op != OP_GET_GLOBAL) {
+      continue;
+    }
+
+    int next = following(opt, i);
+    if (!isOp(opt, next, op) || opt->code[next].isTarget) continue;
+
+    // Each mention of a global gets its own name constant.
+    int a = instruction->operand;
+    int b = opt->code[next].operand;
+    bool same = op == OP_GET_GLOBAL
+        ? valuesEqual(opt->chunk->constants.values[a],
+                      opt->chunk->constants.values[b])
+        : a == b;
+    if (same) {
+      rewrite(&opt->code[next], OP_DUP, 0);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+/**
+    @brief Follow a jump through the jumps it lands on.
+
+    An unconditional jump landing on another jump takes that jump's
+    destination. A conditional jump landing on a jump with the same
+    condition does too, and one landing on the opposite condition skips
+    past it, since the tested value is still on the stack unchanged.
+    Conditional jumps are only retargeted forwards, the loop jumps that
+    pop or count only backwards, and no jump is retargeted out of the
+    range of a wide operand.
+
+    @param opt
+    @param jump
+    @return int Final target index.
+**/
+static int threadJump(Optimizer* opt, int jump) {
+  uint8_t op = opt->code[jump].op;
+  int target = nextLive(opt, opt->code[jump].target);
+
+  for (int hops = 0; hops < MAX_JUMP_HOPS && target < opt->count; hops++) {
+    uint8_t landing = opt->code[target].op;
+    int next;
+    if (landing == OP_JUMP || landing == OP_LOOP) {
+      next = opt->code[target].target;
+    } else if (isConditional(op) && landing == op) {
+      next = opt->code[target].target;
+    } else if (isConditional(op) && isConditional(landing)) {
+      next = target + 1;
+    } else {
+      break;
+    }
+
+    next = nextLive(opt, next);
+    if (next >= opt->count || next == target) break;
+    if (isConditional(op) && next <= jump) break;
+    if ((op == OP_LOOP_IF_TRUE || op == OP_FOR_LOOP) && next >= jump) break;
+
+    int from = opt->code[jump].offset + opt->code[jump].length;
+    int distance = abs(opt->code[next].offset - from);
+    if (distance > UINT24_MAX) break;
+
+    target = next;
+  }
+
+  return target;
+}
+
+/**
+    @brief Run the local rewrites once over the instruction list.
+
+    @param opt
+    @return bool Whether anything changed.
+**/
+static bool peephole(Optimizer* opt) {
+  bool changed = false;
+
+  for (int i = nextLive(opt, 0); i < opt->count; i = following(opt, i)) {
+    Instruction* instruction = &opt->code[i];
+    uint8_t op = instruction->op;
+    int next = following(opt, i);
+
+    // Only the first instruction of a rewritten sequence may be landed
+    // on; a jump into the middle would skip part of what was merged.
+    bool nextFree = next < opt->count && !opt->code[next].isTarget;
+
+    if (isJump(op)) {
+      int target = threadJump(opt, i);
+      if (target != nextLive(opt, instruction->target)) {
+        instruction->target = target;
+        opt->code[target].isTarget = true;
+        changed = true;
+      }
+
+      // A forward jump to the very next instruction does nothing.
+      if ((op == OP_JUMP || isConditional(op)) && target == next) {
+        instruction->removed = true;
+        changed = true;
+      }
+      continue;
+    }
+
+    if (!nextFree) continue;
+    uint8_t nextOp = opt->code[next].op;
+
+    // A value pushed only to be popped.
+    if (isPurePush(op) && nextOp == OP_POP) {
+      instruction->removed = true;
+      opt->code[next].removed = true;
+      changed = true;
+      continue;
+    }
+
+    // Negating a condition that is then discarded on both paths.
+    if (op == OP_NOT && isConditional(nextOp)) {
+      int fallthrough = following(opt, next);
+      int target = nextLive(opt, opt->code[next].target);
+      if (isOp(opt, fallthrough, OP_POP) && isOp(opt, target, OP_POP)) {
+        opt->code[next].op =
+            nextOp == OP_JUMP_IF_FALSE ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE;
+        instruction->removed = true;
+        changed = true;
+      }
+      continue;
+    }
+
+    // Storing a local back into the slot it was just read from.
+    if (op == OP_GET_LOCAL && nextOp == OP_SET_LOCAL &&
+        instruction->operand == opt->code[next].operand) {
+      opt->code[next].removed = true;
+      changed = true;
+      continue;
+    }
+
+    // Reloading a local that was just stored and popped.
+    if (op == OP_SET_LOCAL && nextOp == OP_POP) {
+      int reload = following(opt, next);
+      if (isOp(opt, reload, OP_GET_LOCAL) && !opt->code[reload].isTarget &&
+          instruction->operand == opt->code[reload].operand) {
+        opt->code[next].removed = true;
+        opt->code[reload].removed = true;
+        changed = true;
+      }
+    }
+  }
+
+  return changed;
+}
+
+/**
+    @brief Index of the last live instruction before index.
+
+    @param opt
+    @param index
+    @return int -1 if there is none.
+**/
+static int previousLive(Optimizer* opt, int index) {
+  index--;
+  while (index >= 0 && opt->code[index].removed) index--;
+  return index;
+}
+
+/**
+    @brief Open a gap of count new instructions before index.
+
+    Jumps to index land on the first new instruction if landBefore is
+    set, and follow the old instruction past the gap otherwise. The new
+    entries are left for the caller to fill in.
+
+    @param opt
+    @param index
+    @param count
+    @param landBefore
+**/
+static void insertInstructions(Optimizer* opt, int index, int count,
+                               bool landBefore) {
+  opt->code = GROW_ARRAY(opt->code, Instruction,
+                         opt->count, opt->count + count);
+  memmove(&opt->code[index + count], &opt->code[index],
+          (opt->count - index) * sizeof(Instruction));
+  opt->count += count;
+
+  for (int i = 0; i < opt->count; i++) {
+    if (i >= index && i < index + count) continue;
+    int* target = &opt->code[i].target;
+    if (*target > index || (*target == index && !landBefore)) {
+      *target += count;
+    }
+  }
+
+  Instruction* next = &opt->code[index + count];
+  for (int i = index; i < index + count; i++) {
+    Instruction* instruction = &opt->code[i];
+    instruction->op = OP_POP;
+    instruction->operand = 0;
+    instruction->argCount = 0;
+    instruction->wide = false;
+    instruction->length = 1;
+    instruction->line = next->line;
+    instruction->offset = next->offset;
+    instruction->target = -1;
+    instruction->counter = 0;
+    instruction->step = 0;
+    instruction->depth = -1;
+    instruction->isTarget = false;
+    instruction->removed = false;
+  }
+}
+
+/**
+    @brief Whether two OP_GET_GLOBAL or OP_SET_GLOBAL operands name the
+           same variable.
+
+    @param opt
+    @param a
+    @param b
+    @return bool
+**/
+static bool sameGlobal(Optimizer* opt, int a, int b) {
+  return valuesEqual(opt->chunk->constants.values[a],
+                     opt->chunk->constants.values[b]);
+}
+
+/**
+    @brief Hoist the loop ending at the OP_LOOP_IF_TRUE at index, if it
+           has globals worth hoisting.
+
+    The loop must have the shape the compiler gives it: a jump over the
+    body to the condition, which is followed by the loop back. Only
+    globals read at the start of the condition, before anything that can
+    fail or have an effect, are hoisted. The condition runs first, so
+    such a global is known to be defined by the time the loop would have
+    read it, and reading it earlier changes nothing. The loop must make
+    no calls, since any function could assign the global, and must not
+    create closures, whose captured slots are encoded out of reach of the
+    renumbering below.
+
+    @param opt
+    @param end
+    @return int Slots added.
+**/
+static int hoistLoop(Optimizer* opt, int end) {
+  int top = nextLive(opt, opt->code[end].target);
+  int entry = previousLive(opt, top);
+  if (entry == -1 || opt->code[entry].op != OP_JUMP) return 0;
+
+  int test = nextLive(opt, opt->code[entry].target);
+  int depth = opt->code[entry].depth;
+  if (test <= top || test > end || depth == -1) return 0;
+
+  for (int i = 0; i < opt->count; i++) {
+    Instruction* instruction = &opt->code[i];
+    if (instruction->removed || instruction->target == -1) continue;
+
+    int target = nextLive(opt, instruction->target);
+    bool inside = i >= top && i <= end;
+    bool intoLoop = target >= top && target <= end;
+    if (inside && !intoLoop) return 0;
+    if (!inside && intoLoop && !(i == entry && target == test)) return 0;
+  }
+
+  int hoisted[UINT8_COUNT];
+  int count = 0;
+  for (int i = test; i < end && count < UINT8_COUNT; i = following(opt, i)) {
+    Instruction* instruction = &opt->code[i];
+    if (instruction->op != OP_GET_GLOBAL) {
+      if (isPurePush(instruction->op)) continue;
+      break;
+    }
+
+    bool seen = false;
+    for (int j = 0; j < count; j++) {
+      if (sameGlobal(opt, opt->code[hoisted[j]].operand,
+                     instruction->operand)) {
+        seen = true;
+      }
+    }
+    if (!seen) hoisted[count++] = i;
+  }
+
+  for (int i = top; i <= end; i = following(opt, i)) {
+    Instruction* instruction = &opt->code[i];
+    if (isCall(instruction->op) || isClosure(instruction->op)) return 0;
+    if (instruction->op == OP_FOR_LOOP &&
+        instruction->counter >= depth &&
+        instruction->counter + count > UINT8_MAX) {
+      return 0;
+    }
+    if (instruction->op != OP_SET_GLOBAL) continue;
+
+    for (int j = 0; j < count; j++) {
+      if (sameGlobal(opt, opt->code[hoisted[j]].operand,
+                     instruction->operand)) {
+        hoisted[j] = hoisted[--count];
+        break;
+      }
+    }
+  }
+  if (count == 0) return 0;
+
+  Instruction loads[UINT8_COUNT];
+  for (int j = 0; j < count; j++) loads[j] = opt->code[hoisted[j]];
+
+  // Make room for the hoisted values below the loop's own locals.
+  for (int i = top; i <= end; i = following(opt, i)) {
+    Instruction* instruction = &opt->code[i];
+    switch (instruction->op) {
+      case OP_GET_LOCAL:
+      case OP_SET_LOCAL:
+        if (instruction->operand >= depth) instruction->operand += count;
+        break;
+      case OP_FOR_LOOP:
+        if (instruction->counter >= depth) instruction->counter += count;
+        break;
+      case OP_GET_GLOBAL:
+        for (int j = 0; j < count; j++) {
+          if (sameGlobal(opt, loads[j].operand, instruction->operand)) {
+            rewrite(instruction, OP_GET_LOCAL, depth + j);
+            break;
+          }
+        }
+        break;
+    }
+  }
+
+  // The loads go in front of the entry jump, the pops after the exit.
+  insertInstructions(opt, end + 1, count, false);
+  insertInstructions(opt, entry, count, true);
+  for (int j = 0; j < count; j++) {
+    Instruction* load = &opt->code[entry + j];
+    rewrite(load, OP_GET_GLOBAL, loads[j].operand);
+    load->line = loads[j].line;
+  }
+
+  return count;
+}
+
+/**
+    @brief Load globals that a loop reads but never changes once before
+           the loop, keeping them in stack slots for its duration.
+
+    @param opt
+    @return bool Whether anything changed.
+**/
+static bool hoistLoopInvariants(Optimizer* opt) {
+  if (!opt->depthsKnown) return false;
+
+  bool changed = false;
+  for (int i = nextLive(opt, 0); i < opt->count; i = following(opt, i)) {
+    if (opt->code[i].op != OP_LOOP_IF_TRUE) continue;
+
+    int added = hoistLoop(opt, i);
+    if (added == 0) continue;
+
+    opt->extraSlots += added;
+    changed = true;
+    analyzeFlow(opt);
+    if (!opt->depthsKnown) break;
+    i += 2 * added;
+  }
+  return changed;
+}
+
+/**
+    @brief Fuse the increment and test of a counted loop into OP_FOR_LOOP.
+
+    Matches a body ending in i = i + step, with a numeric constant step,
+    followed by a condition of the form i < limit, where the limit is a
+    local, global or constant. The increment becomes a load of the limit
+    and OP_FOR_LOOP. The condition stays behind it for the entry jump to
+    land on; after the last iteration it runs once more and fails again.
+
+    @param opt
+    @return bool Whether anything changed.
+**/
+static bool fuseCountedLoops(Optimizer* opt) {
+  static const uint8_t shape[] = {
+    OP_GET_LOCAL, OP_CONSTANT, OP_ADD, OP_SET_LOCAL, OP_POP,
+    OP_GET_LOCAL, 0, OP_LESS, OP_LOOP_IF_TRUE
+  };
+  enum { SHAPE_LENGTH = sizeof(shape) / sizeof(shape[0]), LIMIT = 6 };
+
+  bool changed = false;
+  for (int i = nextLive(opt, 0); i < opt->count; i = following(opt, i)) {
+    Instruction* at[SHAPE_LENGTH];
+    int index = i;
+    int matched = 0;
+    for (; matched < SHAPE_LENGTH && index < opt->count; matched++) {
+      at[matched] = &opt->code[index];
+      if (shape[matched] != 0 &&
+          checkedOp(at[matched]->op) != shape[matched]) {
+        break;
+      }
+      // The condition is landed on by the entry jump; nothing else is.
+      if (matched > 0 && matched != 5 && at[matched]->isTarget) break;
+      index = following(opt, index);
+    }
+    if (matched < SHAPE_LENGTH) continue;
+
+    int slot = at[0]->operand;
+    Value step = opt->chunk->constants.values[at[1]->operand];
+    uint8_t limitOp = at[LIMIT]->op;
+    bool limitFits = limitOp == OP_GET_GLOBAL || limitOp == OP_CONSTANT ||
+                     (limitOp == OP_GET_LOCAL && at[LIMIT]->operand != slot);
+    if (slot > UINT8_MAX || at[1]->operand > UINT8_MAX || !IS_NUMBER(step) ||
+        at[3]->operand != slot || at[5]->operand != slot || !limitFits ||
+        nextLive(opt, at[8]->target) >= i) {
+      continue;
+    }
+
+    int line = at[2]->line;
+    uint8_t stepIndex = (uint8_t)at[1]->operand;
+    rewrite(at[0], limitOp, at[LIMIT]->operand);
+    at[0]->line = at[LIMIT]->line;
+    rewrite(at[1], OP_FOR_LOOP, 0);
+    at[1]->line = line;
+    at[1]->target = at[8]->target;
+    at[1]->counter = (uint8_t)slot;
+    at[1]->step = stepIndex;
+    at[2]->removed = true;
+    at[3]->removed = true;
+    at[4]->removed = true;
+    changed = true;
+  }
+  return changed;
+}
+
+/**
+    @brief What the numeric type pass knows about a stack slot: whether
+           it holds a number, and which local it was loaded from, or -1.
+**/
+typedef struct {
+  bool number;
+  int origin;
+} NumericSlot;
+
+/**
+    @brief The unchecked form of an arithmetic or comparison opcode.
+
+    @param op
+    @return uint8_t OP_RETURN if there is none.
+**/
+static uint8_t numberOp(uint8_t op) {
+  switch (op) {
+    case OP_GREATER:  return OP_GREATER_NUMBER;
+    case OP_LESS:     return OP_LESS_NUMBER;
+    case OP_ADD:      return OP_ADD_NUMBER;
+    case OP_SUBTRACT: return OP_SUBTRACT_NUMBER;
+    case OP_MULTIPLY: return OP_MULTIPLY_NUMBER;
+    case OP_DIVIDE:   return OP_DIVIDE_NUMBER;
+    default:          return OP_RETURN;
+  }
+}
+
+/**
+    @brief Mark the local slots some closure in the function captures.
+
+    A captured local can be assigned by any call, so nothing is ever
+    assumed about its type.
+
+    @param opt
+    @param captured
+**/
+static void findCaptured(Optimizer* opt, bool* captured) {
+  for (int i = nextLive(opt, 0); i < opt->count; i = following(opt, i)) {
+    Instruction* instruction = &opt->code[i];
+    if (!isClosure(instruction->op)) continue;
+
+    ObjFunction* function = AS_FUNCTION(
+        opt->chunk->constants.values[instruction->operand]);
+    uint8_t* operands = &opt->source[instruction->offset +
+                                     (instruction->wide ? 5 : 2)];
+    for (int j = 0; j < function->upvalueCount; j++) {
+      bool isLocal = *operands++;
+      int index = *operands++;
+      if (instruction->wide) {
+        index = (index << 16) | (operands[0] << 8) | operands[1];
+        operands += 2;
+      }
+      if (isLocal && index <= opt->maxDepth) captured[index] = true;
+    }
+  }
+}
+
+/**
+    @brief Forget that any slot was loaded from slot.
+
+    @param slots
+    @param count
+    @param slot
+**/
+static void forgetOrigin(NumericSlot* slots, int count, int slot) {
+  for (int i = 0; i < count; i++) {
+    if (slots[i].origin == slot) slots[i].origin = -1;
+  }
+}
+
+/**
+    @brief Record that an operand a checked instruction accepted was a
+           number, along with the local it was loaded from.
+
+    @param slots
+    @param count
+    @param operand
+**/
+static void proveNumber(NumericSlot* slots, int count, int operand) {
+  slots[operand].number = true;
+  int origin = slots[operand].origin;
+  if (origin == -1) return;
+
+  for (int i = 0; i < count; i++) {
+    if (i == origin || slots[i].origin == origin) slots[i].number = true;
+  }
+}
+
+/**
+    @brief Update numeric knowledge across one instruction.
+
+    Besides tracking what each instruction pushes, a checked operation
+    that execution gets past proves its operands were numbers, and so
+    proves the same of the locals they were loaded from.
+
+    @param opt
+    @param slots
+    @param count
+    @param captured
+    @param instruction
+**/
+static void trackNumbers(Optimizer* opt, NumericSlot* slots, int count,
+                         bool* captured, Instruction* instruction) {
+  int depth = instruction->depth;
+  uint8_t op = checkedOp(instruction->op);
+
+  if (op == OP_SET_LOCAL) {
+    int slot = instruction->operand;
+    forgetOrigin(slots, count, slot);
+    slots[slot].number = slots[depth - 1].number;
+    slots[slot].origin = -1;
+    return;
+  }
+
+  NumericSlot pushed = { false, -1 };
+  switch (op) {
+    case OP_CONSTANT:
+      pushed.number = IS_NUMBER(
+          opt->chunk->constants.values[instruction->operand]);
+      break;
+    case OP_GET_LOCAL:
+      if (!captured[instruction->operand]) {
+        pushed.number = slots[instruction->operand].number;
+        pushed.origin = instruction->operand;
+      }
+      break;
+    case OP_DUP:
+      if (!captured[depth - 1]) pushed = slots[depth - 1];
+      break;
+    case OP_ADD:
+      pushed.number = instruction->op == OP_ADD_NUMBER ||
+          (slots[depth - 1].number && slots[depth - 2].number);
+      break;
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      pushed.number = true;
+      // Fallthrough.
+    case OP_GREATER:
+    case OP_LESS:
+      proveNumber(slots, count, depth - 1);
+      proveNumber(slots, count, depth - 2);
+      break;
+    case OP_NEGATE:
+      proveNumber(slots, count, depth - 1);
+      pushed.number = true;
+      break;
+    case OP_FOR_LOOP:
+      proveNumber(slots, count, depth - 1);
+      forgetOrigin(slots, count, instruction->counter);
+      slots[instruction->counter].number = true;
+      break;
+  }
+
+  int pops, pushes;
+  stackEffect(instruction, &pops, &pushes);
+  int end = depth > depth - pops + pushes ? depth : depth - pops + pushes;
+  for (int slot = depth - pops; slot < end; slot++) {
+    forgetOrigin(slots, count, slot);
+    slots[slot].number = false;
+    slots[slot].origin = -1;
+  }
+  if (pushes == 1) slots[depth - pops] = pushed;
+}
+
+/**
+    @brief Merge what one path knows into an instruction's entry state.
+
+    @param entry
+    @param slots
+    @param width
+    @param depth
+    @param reached Whether entry already holds another path's state.
+    @return bool Whether the entry state changed.
+**/
+static bool mergeNumbers(NumericSlot* entry, NumericSlot* slots, int width,
+                         int depth, bool reached) {
+  if (!reached) {
+    memcpy(entry, slots, width * sizeof(NumericSlot));
+    return true;
+  }
+
+  bool changed = false;
+  for (int i = 0; i < depth; i++) {
+    if (entry[i].number && !slots[i].number) {
+      entry[i].number = false;
+      changed = true;
+    }
+    if (entry[i].origin != -1 && entry[i].origin != slots[i].origin) {
+      entry[i].origin = -1;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+/**
+    @brief Switch arithmetic and comparisons whose operands are always
+           numbers to the forms that skip the type checks.
+
+    A forward analysis finds, for every instruction, which stack slots
+    hold a number on every path that reaches it. Numbers come from
+    numeric constants and from the arithmetic that only ever yields one,
+    and locals holding them stay known until they are assigned something
+    else. Knowledge is kept across calls and jump targets alike, since
+    locals no closure captures can only change through this function's
+    own stores.
+
+    @param opt
+    @return bool Whether anything changed.
+**/
+static bool inferNumbers(Optimizer* opt) {
+  if (!opt->depthsKnown) return false;
+
+  int width = opt->maxDepth + 2;
+  if ((size_t)opt->count * width > MAX_NUMERIC_STATE) return false;
+
+  bool* captured = ALLOCATE(bool, width);
+  memset(captured, 0, width * sizeof(bool));
+  findCaptured(opt, captured);
+
+  NumericSlot* entries = ALLOCATE(NumericSlot, opt->count * width);
+  bool* reached = ALLOCATE(bool, opt->count);
+  bool* queued = ALLOCATE(bool, opt->count);
+  int* worklist = ALLOCATE(int, opt->count);
+  NumericSlot* slots = ALLOCATE(NumericSlot, width);
+  for (int i = 0; i < opt->count; i++) {
+    reached[i] = false;
+    queued[i] = false;
+  }
+  for (int i = 0; i < opt->count * width; i++) {
+    entries[i].number = false;
+    entries[i].origin = -1;
+  }
+
+  // Nothing is known about the arguments.
+  int pending = 0;
+  int first = nextLive(opt, 0);
+  if (first < opt->count) {
+    reached[first] = true;
+    queued[first] = true;
+    worklist[pending++] = first;
+  }
+
+  while (pending > 0) {
+    int index = worklist[--pending];
+    queued[index] = false;
+    Instruction* instruction = &opt->code[index];
+    memcpy(slots, &entries[index * width], width * sizeof(NumericSlot));
+    trackNumbers(opt, slots, width, captured, instruction);
+
+    int successors[2];
+    int successorCount = 0;
+    if (instruction->target != -1) {
+      successors[successorCount++] = nextLive(opt, instruction->target);
+    }
+    if (!isTerminal(instruction->op)) {
+      successors[successorCount++] = following(opt, index);
+    }
+
+    for (int j = 0; j < successorCount; j++) {
+      int next = successors[j];
+      if (next >= opt->count || opt->code[next].depth == -1) continue;
+      if (mergeNumbers(&entries[next * width], slots, width,
+                       opt->code[next].depth, reached[next]) &&
+          !queued[next]) {
+        queued[next] = true;
+        worklist[pending++] = next;
+      }
+      reached[next] = true;
+    }
+  }
+
+  bool changed = false;
+  for (int i = nextLive(opt, 0); i < opt->count; i = following(opt, i)) {
+    Instruction* instruction = &opt->code[i];
+    uint8_t op = numberOp(instruction->op);
+    if (op == OP_RETURN || !reached[i]) continue;
+
+    NumericSlot* entry = &entries[i * width];
+    int depth = instruction->depth;
+    if (entry[depth - 1].number && entry[depth - 2].number) {
+      instruction->op = op;
+      changed = true;
+    }
+  }
+
+  FREE_ARRAY(NumericSlot, slots, width);
+  FREE_ARRAY(int, worklist, opt->count);
+  FREE_ARRAY(bool, queued, opt->count);
+  FREE_ARRAY(bool, reached, opt->count);
+  FREE_ARRAY(NumericSlot, entries, opt->count * width);
+  FREE_ARRAY(bool, captured, width);
+  return changed;
+}
+
+/**
+    @brief Encoded size of an instruction given its current width.
+
+    @param instruction
+    @return int
+**/
+static int encodedLength(Instruction* instruction) {
+  int prefix = instruction->wide ? 1 : 0;
+  int index = instruction->wide ? 3 : 1;
+  switch (instruction->op) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_CLASS:
+    case OP_METHOD:
+      return prefix + 1 + index;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_LOOP:
+    case OP_LOOP_IF_TRUE:
+      return prefix + 1 + (instruction->wide ? 3 : 2);
+    case OP_FOR_LOOP:
+      return prefix + 1 + (instruction->wide ? 3 : 2) + 2;
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+      return prefix + 2 + index;
+    case OP_CLOSURE:
+    case OP_FRAME_CLOSURE:
+      return instruction->length;
+    default:
+      return 1;
+  }
+}
+
+/**
+    @brief Lay out the live instructions, widening jumps until every
+           distance fits its operand.
+
+    Widening a jump only ever moves code further apart, so the loop
+    settles once no more jumps need it.
+
+    @param opt
+    @param newOffset Receives each instruction's new offset.
+    @return int The new code size.
+**/
+static int layoutFunction(Optimizer* opt, int* newOffset) {
+  for (int i = 0; i < opt->count; i++) {
+    Instruction* instruction = &opt->code[i];
+    if (isJump(instruction->op)) {
+      instruction->wide = false;
+    } else if (!isClosure(instruction->op)) {
+      instruction->wide = instruction->operand > UINT8_MAX;
+    }
+  }
+
+  for (;;) {
+    int offset = 0;
+    for (int i = 0; i < opt->count; i++) {
+      newOffset[i] = offset;
+      if (!opt->code[i].removed) offset += encodedLength(&opt->code[i]);
+    }
+    newOffset[opt->count] = offset;
+
+    bool widened = false;
+    for (int i = 0; i < opt->count; i++) {
+      Instruction* instruction = &opt->code[i];
+      if (instruction->removed || !isJump(instruction->op)) continue;
+
+      int from = newOffset[i] + encodedLength(instruction);
+      int distance = abs(newOffset[instruction->target] - from);
+      if (!instruction->wide && distance > UINT16_MAX) {
+        instruction->wide = true;
+        widened = true;
+      }
+    }
+
+    if (!widened) return offset;
+  }
+}
+
+/**
+    @brief Write the live instructions back into the chunk.
+
+    @param opt
+**/
+static void encodeFunction(Optimizer* opt) {
+  Chunk* chunk = opt->chunk;
+  int* newOffset = ALLOCATE(int, opt->count + 1);
+  layoutFunction(opt, newOffset);
+
+  truncateChunk(chunk, 0);
+  for (int i = 0; i < opt->count; i++) {
+    Instruction* instruction = &opt->code[i];
+    if (instruction->removed) continue;
+    int line = instruction->line;
+
+    if (isClosure(instruction->op)) {
+      for (int j = 0; j < instruction->length; j++) {
+        writeChunk(chunk, opt->source[instruction->offset + j], line);
+      }
+      continue;
+    }
+
+    int length = encodedLength(instruction);
+    if (isJump(instruction->op)) {
+      int jump = newOffset[instruction->target] - (newOffset[i] + length);
+      uint8_t op = instruction->op;
+      if (op == OP_JUMP || op == OP_LOOP) op = jump >= 0 ? OP_JUMP : OP_LOOP;
+      instruction->op = op;
+      instruction->operand = jump < 0 ? -jump : jump;
+    }
+
+    if (instruction->wide) writeChunk(chunk, OP_WIDE, line);
+    writeChunk(chunk, instruction->op, line);
+    if (length == 1) continue;
+
+    int width = length - (instruction->wide ? 2 : 1);
+    if (instruction->op == OP_INVOKE || instruction->op == OP_SUPER_INVOKE) {
+      width--;
+    } else if (instruction->op == OP_FOR_LOOP) {
+      width -= 2;
+    }
+    for (int shift = (width - 1) * 8; shift >= 0; shift -= 8) {
+      writeChunk(chunk, (instruction->operand >> shift) & 0xff, line);
+    }
+    if (instruction->op == OP_INVOKE || instruction->op == OP_SUPER_INVOKE) {
+      writeChunk(chunk, instruction->argCount, line);
+    } else if (instruction->op == OP_FOR_LOOP) {
+      writeChunk(chunk, instruction->counter, line);
+      writeChunk(chunk, instruction->step, line);
+    }
+  }
+
+  FREE_ARRAY(int, newOffset, opt->count + 1);
+}
+
+static Pass passes[] = {
+  {"dead-code",              eliminateDeadCode,    2},
+  {"constant-propagation",   propagateConstants,   2},
+  {"copy-propagation",       propagateCopies,      2},
+  {"common-loads",           eliminateCommonLoads, 2},
+  {"peephole",               peephole,             1},
+  {"loop-invariants",        hoistLoopInvariants,  2},
+  {"counted-loops",          fuseCountedLoops,     2},
+  {"numeric-types",          inferNumbers,         2},
+};
+
+/**
+    @brief Run the passes enabled at level over a finished function.
+
+    Passes repeat until a whole round changes nothing, since each can
+    expose work for the others. The chunk is re-encoded if anything
+    changed or if the compiler left jumps that need widening.
+
+    @param function
+    @param level
+    @param farJumps
+    @param farJumpCount
+**/
+void optimizeFunction(ObjFunction* function, int level,
+                      FarJump* farJumps, int farJumpCount) {
+  Optimizer opt;
+  decodeFunction(&opt, function, farJumps, farJumpCount);
+
+  bool changed = farJumpCount > 0;
+  for (int round = 0; round < MAX_PIPELINE_ROUNDS; round++) {
+    bool progress = false;
+    for (size_t i = 0; i < sizeof(passes) / sizeof(passes[0]); i++) {
+      if (passes[i].level > level) continue;
+      analyzeFlow(&opt);
+      if (passes[i].run(&opt)) progress = true;
+    }
+    if (!progress) break;
+    changed = true;
+  }
+
+  if (changed) encodeFunction(&opt);
+  function->maxSlots += opt.extraSlots;
+  FREE_ARRAY(Instruction, opt.code, opt.count);
+  FREE_ARRAY(uint8_t, opt.source, opt.sourceCount);
+}
@@ -0,0 +1,25 @@
+/**
+    @file optimizer.h
+
+    @brief Header for the bytecode optimizer.
+
+**/
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "object.h"
+
+/**
+    @brief A jump the compiler could not encode in its 16-bit operand.
+**/
+typedef struct {
+  int offset;
+  int target;
+} FarJump;
+
+void optimizeFunction(ObjFunction* function, int level,
+                      FarJump* farJumps, int farJumpCount);
+void measureStack(ObjFunction* function);
+bool checkStack(ObjFunction* function);
+
+#endif
@@ -0,0 +1,168 @@
+/**
+    @file output.c
+
+    @brief Buffered program output.
+
+    Everything a script prints, and every debugging listing, goes to
+    stdout through here rather than through stdio. Bytes are copied
+    into a buffer and written with a single write() once it fills, or
+    at the end of each line in line buffered mode, with no format
+    strings or stream locks on the way. The buffer is flushed before a
+    runtime error is reported and when the process exits.
+
+    Each thread has a buffer of its own, so compile workers printing
+    code listings do not interleave mid-line. The size and mode are set
+    once, before any thread starts.
+
+**/
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "output.h"
+
+static size_t bufferSize = OUTPUT_BUFFER_SIZE;
+static OutputMode outputMode = OUTPUT_BLOCK_BUFFERED;
+static bool flushesAtExit = false;
+
+// This thread's buffer, allocated on first use.
+static THREAD_LOCAL char* buffer = NULL;
+static THREAD_LOCAL size_t bufferUsed = 0;
+
+/**
+    @brief Write bytes straight to stdout. Output that cannot be written,
+    say to a closed pipe, is dropped, as stdio would.
+
+    @param chars
+    @param length
+**/
+static void writeAll(const char* chars, size_t length) {
+  while (length > 0) {
+    ssize_t written = write(STDOUT_FILENO, chars, length);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    chars += written;
+    length -= (size_t)written;
+  }
+}
+
+/**
+    @brief Write out whatever this thread's buffer holds.
+
+**/
+void flushOutput() {
+  if (bufferUsed == 0) return;
+  writeAll(buffer, bufferUsed);
+  bufferUsed = 0;
+}
+
+/**
+    @brief Choose how output is buffered. Call before any thread other
+    than the main one starts.
+
+    @param size Bytes to buffer before writing; at least 1.
+    @param mode
+**/
+void initOutput(size_t size, OutputMode mode) {
+  flushOutput();
+  free(buffer);
+  buffer = NULL;
+
+  bufferSize = size;
+  outputMode = mode;
+  if (!flushesAtExit) {
+    atexit(flushOutput);
+    flushesAtExit = true;
+  }
+}
+
+/**
+    @brief Flush this thread's buffer and release it.
+
+**/
+void freeOutput() {
+  flushOutput();
+  free(buffer);
+  buffer = NULL;
+}
+
+/**
+    @brief
+
+    @param chars
+    @param length
+**/
+void writeOutput(const char* chars, size_t length) {
+  if (buffer == NULL) {
+    buffer = (char*)malloc(bufferSize);
+    if (buffer == NULL) {
+      writeAll(chars, length);
+      return;
+    }
+  }
+
+  if (length > bufferSize - bufferUsed) {
+    flushOutput();
+    // Too big to be worth copying.
+    if (length >= bufferSize) {
+      writeAll(chars, length);
+      return;
+    }
+  }
+
+  memcpy(buffer + bufferUsed, chars, length);
+  bufferUsed += length;
+  if (outputMode == OUTPUT_LINE_BUFFERED &&
+      memchr(chars, '\n', length) != NULL) {
+    flushOutput();
+  }
+}
+
+/**
+    @brief
+
+    @param string
+**/
+void writeOutputString(const char* string) {
+  writeOutput(string, strlen(string));
+}
+
+/**
+    @brief Write printf-style formatted output. Meant for debugging
+    listings; what scripts print is written directly.
+
+    @param format
+    @param ...
+**/
+void formatOutput(const char* format, ...) {
+  char small[256];
+  va_list args;
+  va_start(args, format);
+  va_list retry;
+  va_copy(retry, args);
+  int length = vsnprintf(small, sizeof(small), format, args);
+  va_end(args);
+
+  if (length < 0) {
+    va_end(retry);
+    return;
+  }
+  if ((size_t)length < sizeof(small)) {
+    writeOutput(small, (size_t)length);
+  } else {
+    char* large = (char*)malloc((size_t)length + 1);
+    if (large != NULL) {
+      vsnprintf(large, (size_t)length + 1, format, retry);
+      writeOutput(large, (size_t)length);
+      free(large);
+    }
+  }
+  va_end(retry);
+}
@@ -0,0 +1,31 @@
+/**
+    @file output.h
+
+    @brief Header for buffered program output.
+
+**/
+#ifndef clox_output_h
+#define clox_output_h
+
+#include "common.h"
+
+// Default size of the buffer output collects in before it is written.
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+/**
+    @brief When buffered output is written: once the buffer fills, or
+    also at the end of every line, for a person watching.
+**/
+typedef enum {
+  OUTPUT_BLOCK_BUFFERED,
+  OUTPUT_LINE_BUFFERED
+} OutputMode;
+
+void initOutput(size_t size, OutputMode mode);
+void freeOutput();
+void writeOutput(const char* chars, size_t length);
+void writeOutputString(const char* string);
+void formatOutput(const char* format, ...);
+void flushOutput();
+
+#endif
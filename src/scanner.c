@@ -4,29 +4,226 @@
     @brief
 
 **/
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "scanner.h"
 
-typedef struct {
-  const char* start;
-  const char* current;
-  int line;
-} Scanner;
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-Scanner scanner;
+// The least a streamed source is read into at a time.
+#define SOURCE_BLOCK_SIZE (64 * 1024)
+
+/**
+    @brief A block of a streamed source. Tokens point into the blocks, so
+    they are kept until the whole source has been compiled.
+**/
+typedef struct sSourceBlock {
+  struct sSourceBlock* next;
+  char chars[];
+} SourceBlock;
 
 /**
     @brief
 
+    @param scanner
     @param source
 **/
-void initScanner(const char* source) {
-  scanner.start = source;
-  scanner.current = source;
-  scanner.line = 1;
+void initScanner(Scanner* scanner, const char* source) {
+  scanner->start = source;
+  scanner->current = source;
+  scanner->line = 1;
+  scanner->fd = -1;
+  scanner->end = source == NULL ? NULL : (char*)source + strlen(source);
+  scanner->limit = NULL;
+  scanner->blocks = NULL;
+}
+
+/**
+    @brief Scan a source read from fd a block at a time as the scanner
+    reaches it, rather than all before the first token. fd is not closed.
+
+    @param scanner
+    @param fd
+**/
+void initStreamScanner(Scanner* scanner, int fd) {
+  static char empty[1] = "";
+  initScanner(scanner, empty);
+  scanner->fd = fd;
+  scanner->end = empty;
+  scanner->limit = empty;
+}
+
+/**
+    @brief Free the blocks a streamed source was read into. Tokens from
+    the stream are invalid afterwards.
+
+    @param scanner
+**/
+void freeScanner(Scanner* scanner) {
+  SourceBlock* block = scanner->blocks;
+  while (block != NULL) {
+    SourceBlock* next = block->next;
+    free(block);
+    block = next;
+  }
+
+  initScanner(scanner, NULL);
+}
+
+/**
+    @brief Read more of a streamed source, until the character offset
+    past current has been read or the stream ends.
+
+    When the current block fills, the token being scanned is copied to
+    the start of a new one, so a token's characters are always together.
+    Blocks at least double the token they start with, so a very long
+    token is copied only a few times.
+
+    @param scanner
+    @param offset
+**/
+static void refill(Scanner* scanner, int offset) {
+  while (scanner->fd != -1 && scanner->current + offset >= scanner->end) {
+    if (scanner->end == scanner->limit) {
+      size_t kept = (size_t)(scanner->end - scanner->start);
+      size_t capacity = kept * 2 + SOURCE_BLOCK_SIZE;
+      SourceBlock* block = (SourceBlock*)malloc(sizeof(SourceBlock) +
+                                                capacity + 1);
+      if (block == NULL) {
+        fprintf(stderr, "Not enough memory to read source.\n");
+        exit(74);
+      }
+      block->next = scanner->blocks;
+      scanner->blocks = block;
+
+      memcpy(block->chars, scanner->start, kept);
+      scanner->current = block->chars + (scanner->current - scanner->start);
+      scanner->start = block->chars;
+      scanner->end = block->chars + kept;
+      scanner->limit = block->chars + capacity;
+    }
+
+    ssize_t count = read(scanner->fd, scanner->end,
+                         (size_t)(scanner->limit - scanner->end));
+    if (count < 0 && errno == EINTR) continue;
+    if (count < 0) {
+      fprintf(stderr, "Could not read source.\n");
+      exit(74);
+    }
+
+    if (count == 0) {
+      scanner->fd = -1;
+    } else {
+      scanner->end += count;
+    }
+    *scanner->end = '\0';
+  }
+}
+
+/**
+    @brief The character offset past current, reading it in first if the
+    source is streamed.
+
+    @param scanner
+    @param offset
+    @return char '\0' at the end of the source.
+**/
+static inline char charAt(Scanner* scanner, int offset) {
+  char c = scanner->current[offset];
+  if (c == '\0' && scanner->fd != -1) {
+    refill(scanner, offset);
+    c = scanner->current[offset];
+  }
+  return c;
+}
+
+/**
+    @brief Kinds of run the scanner can skip sixteen bytes at a time.
+**/
+typedef enum {
+  RUN_COMMENT,
+  RUN_STRING,
+  RUN_IDENTIFIER
+} RunKind;
+
+#ifdef __SSE2__
+/**
+    @brief Mark the bytes of chunk that end a run of the given kind.
+
+    @param kind
+    @param chunk
+    @return __m128i 0xff in each byte that ends the run, 0 elsewhere.
+**/
+static inline __m128i runStops(RunKind kind, __m128i chunk) {
+  __m128i nul = _mm_cmpeq_epi8(chunk, _mm_setzero_si128());
+  switch (kind) {
+    case RUN_COMMENT:
+      return _mm_or_si128(nul, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')));
+
+    case RUN_STRING:
+      return _mm_or_si128(nul, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('"')));
+
+    case RUN_IDENTIFIER: {
+      // Setting bit 5 folds upper case onto lower case. Bytes past ASCII
+      // compare as negative, so fall outside both ranges.
+      __m128i lower = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+      __m128i alpha = _mm_and_si128(
+          _mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+          _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+      __m128i digit = _mm_and_si128(
+          _mm_cmpgt_epi8(chunk, _mm_set1_epi8('0' - 1)),
+          _mm_cmplt_epi8(chunk, _mm_set1_epi8('9' + 1)));
+      __m128i word = _mm_or_si128(
+          _mm_or_si128(alpha, digit),
+          _mm_cmpeq_epi8(chunk, _mm_set1_epi8('_')));
+      return _mm_xor_si128(word, _mm_set1_epi8(-1));
+    }
+  }
+
+  return nul;
+}
+#endif
+
+/**
+    @brief Skip the bulk of a run of the given kind sixteen bytes at a
+    time, counting the newlines in strings.
+
+    This only looks at whole blocks of sixteen that have already been
+    read, and stops at the first byte that ends the run. The scanner's
+    usual character-at-a-time loops finish the run from there, which is
+    all they do where SSE2 is not available.
+
+    @param scanner
+    @param kind
+**/
+static inline void skipRun(Scanner* scanner, RunKind kind) {
+#ifdef __SSE2__
+  const char* current = scanner->current;
+  while (scanner->end - current >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)current);
+    unsigned stops = (unsigned)_mm_movemask_epi8(runStops(kind, chunk));
+    int length = stops == 0 ? 16 : __builtin_ctz(stops);
+    if (kind == RUN_STRING) {
+      unsigned newlines = (unsigned)_mm_movemask_epi8(
+          _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')));
+      newlines &= (1u << length) - 1;
+      scanner->line += __builtin_popcount(newlines);
+    }
+
+    current += length;
+    if (stops != 0) break;
+  }
+  scanner->current = current;
+#else
+  (void)kind;
+#endif
 }
 
 /**
@@ -56,69 +253,75 @@ static bool isDigit(char c) {
 /**
     @brief
 
+    @param scanner
     @return true
     @return false
 **/
-static bool isAtEnd() {
-  return *scanner.current == '\0';
+static bool isAtEnd(Scanner* scanner) {
+  return charAt(scanner, 0) == '\0';
 }
 
 /**
     @brief
 
+    @param scanner
     @return char
 **/
-static char advance() {
-  scanner.current++;
-  return scanner.current[-1];
+static char advance(Scanner* scanner) {
+  scanner->current++;
+  return scanner->current[-1];
 }
 
 /**
     @brief
 
+    @param scanner
     @return char
 **/
-static char peek() {
-  return *scanner.current;
+static char peek(Scanner* scanner) {
+  return charAt(scanner, 0);
 }
 
 /**
     @brief
 
+    @param scanner
     @return char
 **/
-static char peekNext() {
-  if (isAtEnd()) return '\0';
-  return scanner.current[1];
+static char peekNext(Scanner* scanner) {
+  if (isAtEnd(scanner)) return '\0';
+  return charAt(scanner, 1);
 }
 
 /**
     @brief
 
+    @param scanner
     @param expected
     @return true
     @return false
 **/
-static bool match(char expected) {
-  if (isAtEnd()) return false;
-  if (*scanner.current != expected) return false;
+static bool match(Scanner* scanner, char expected) {
+  if (isAtEnd(scanner)) return false;
+  if (peek(scanner) != expected) return false;
 
-  scanner.current++;
+  scanner->current++;
   return true;
 }
 
 /**
     @brief
 
+    @param scanner
     @param type
     @return Token
 **/
-static Token makeToken(TokenType type) {
+static Token makeToken(Scanner* scanner, TokenType type) {
   Token token;
   token.type = type;
-  token.start = scanner.start;
-  token.length = (int)(scanner.current - scanner.start);
-  token.line = scanner.line;
+  token.start = scanner->start;
+  token.length = (int)(scanner->current - scanner->start);
+  token.line = scanner->line;
 
   return token;
 }
@@ -126,15 +329,16 @@ static Token makeToken(TokenType type) {
 /**
     @brief
 
+    @param scanner
     @param message
     @return Token
 **/
-static Token errorToken(const char* message) {
+static Token errorToken(Scanner* scanner, const char* message) {
   Token token;
   token.type = TOKEN_ERROR;
   token.start = message;
   token.length = (int)strlen(message);
-  token.line = scanner.line;
+  token.line = scanner->line;
 
   return token;
 }
@@ -142,26 +346,34 @@ static Token errorToken(const char* message) {
 /**
     @brief
 
+    @param scanner
 **/
-static void skipWhitespace() {
+static void skipWhitespace(Scanner* scanner) {
   for (;;) {
-    char c = peek();
+    // Nothing skipped needs keeping if a streamed block fills.
+    scanner->start = scanner->current;
+    char c = peek(scanner);
     switch (c) {
       case ' ':
       case '\r':
       case '\t':
-        advance();
+        advance(scanner);
         break;
 
       case '\n':
-        scanner.line++;
-        advance();
+        scanner->line++;
+        advance(scanner);
         break;
 
       case '/':
-        if (peekNext() == '/') {
+        if (peekNext(scanner) == '/') {
           // A comment goes until the end of the line.
-          while (peek() != '\n' && !isAtEnd()) advance();
+          skipRun(scanner, RUN_COMMENT);
+          scanner->start = scanner->current;
+          while (peek(scanner) != '\n' && !isAtEnd(scanner)) {
+            advance(scanner);
+            scanner->start = scanner->current;
+          }
         } else {
           return;
         }
@@ -174,60 +386,53 @@ static void skipWhitespace() {
 }
 
 /**
-    @brief
-
-    @param start
-    @param length
-    @param rest
-    @param type
-    @return TokenType
+    @brief A reserved word and the token it scans as.
 **/
-static TokenType checkKeyword(int start, int length,
-    const char* rest, TokenType type) {
-  if (scanner.current - scanner.start == start + length &&
-      memcmp(scanner.start + start, rest, length) == 0) {
-    return type;
-  }
-
-  return TOKEN_IDENTIFIER;
-}
+typedef struct {
+  const char* name;
+  int length;
+  TokenType type;
+} Keyword;
+
+// Maps an identifier of two to six characters, the lengths keywords
+// come in, to a slot in keywords[]. No two keywords share a slot, so one
+// comparison tells whether an identifier is a keyword.
+#define KEYWORD_HASH(start, length) \
+  (((uint8_t)(start)[1] * 6 + (length)) & 31)
+
+static const Keyword keywords[32] = {
+  [1]  = { "fun",    3, TOKEN_FUN },
+  [3]  = { "super",  5, TOKEN_SUPER },
+  [4]  = { "return", 6, TOKEN_RETURN },
+  [6]  = { "if",     2, TOKEN_IF },
+  [9]  = { "var",    3, TOKEN_VAR },
+  [11] = { "false",  5, TOKEN_FALSE },
+  [12] = { "else",   4, TOKEN_ELSE },
+  [13] = { "class",  5, TOKEN_CLASS },
+  [14] = { "or",     2, TOKEN_OR },
+  [16] = { "true",   4, TOKEN_TRUE },
+  [17] = { "print",  5, TOKEN_PRINT },
+  [20] = { "this",   4, TOKEN_THIS },
+  [21] = { "while",  5, TOKEN_WHILE },
+  [23] = { "and",    3, TOKEN_AND },
+  [25] = { "nil",    3, TOKEN_NIL },
+  [29] = { "for",    3, TOKEN_FOR },
+};
 
 /**
     @brief
 
+    @param scanner
     @return TokenType
 **/
-static TokenType identifierType()
-{
-  switch (scanner.start[0]) {
-    case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-    case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-    case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-    case 'f':
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-          case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-          case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-        }
-      }
-      break;
-    case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-    case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-    case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-    case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-    case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-    case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-    case 't':
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-          case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-        }
-      }
-      break;
-    case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-    case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+static TokenType identifierType(Scanner* scanner) {
+  int length = (int)(scanner->current - scanner->start);
+  if (length < 2 || length > 6) return TOKEN_IDENTIFIER;
+
+  const Keyword* keyword = &keywords[KEYWORD_HASH(scanner->start, length)];
+  if (keyword->length == length &&
+      memcmp(scanner->start, keyword->name, length) == 0) {
+    return keyword->type;
   }
 
   return TOKEN_IDENTIFIER;
@@ -236,92 +441,103 @@ static TokenType identifierType()
 /**
     @brief
 
+    @param scanner
     @return Token
 **/
-static Token identifier() {
-  while (isAlpha(peek()) || isDigit(peek())) advance();
+static Token identifier(Scanner* scanner) {
+  skipRun(scanner, RUN_IDENTIFIER);
+  while (isAlpha(peek(scanner)) || isDigit(peek(scanner))) {
+    advance(scanner);
+  }
 
-  return makeToken(identifierType());
+  return makeToken(scanner, identifierType(scanner));
 }
 
 /**
     @brief
 
+    @param scanner
     @return Token
 **/
-static Token number() {
-  while (isDigit(peek())) advance();
+static Token number(Scanner* scanner) {
+  while (isDigit(peek(scanner))) advance(scanner);
 
   // Look for a fractional part.
-  if (peek() == '.' && isDigit(peekNext())) {
+  if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
     // Consume the ".".
-    advance();
+    advance(scanner);
 
-    while (isDigit(peek())) advance();
+    while (isDigit(peek(scanner))) advance(scanner);
   }
 
-  return makeToken(TOKEN_NUMBER);
+  return makeToken(scanner, TOKEN_NUMBER);
 }
 
 /**
     @brief
 
+    @param scanner
     @return Token
 **/
-static Token string() {
-  while (peek() != '"' && !isAtEnd()) {
-    if (peek() == '\n') scanner.line++;
-    advance();
+static Token string(Scanner* scanner) {
+  skipRun(scanner, RUN_STRING);
+  while (peek(scanner) != '"' && !isAtEnd(scanner)) {
+    if (peek(scanner) == '\n') scanner->line++;
+    advance(scanner);
   }
 
-  if (isAtEnd()) return errorToken("Unterminated string.");
+  if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string.");
 
   // The closing quote.
-  advance();
-  return makeToken(TOKEN_STRING);
+  advance(scanner);
+  return makeToken(scanner, TOKEN_STRING);
 }
 
 /**
     @brief
 
+    @param scanner
     @return Token
 **/
-Token scanToken() {
-  skipWhitespace();
+Token scanToken(Scanner* scanner) {
+  skipWhitespace(scanner);
 
-  scanner.start = scanner.current;
+  scanner->start = scanner->current;
 
-  if (isAtEnd()) return makeToken(TOKEN_EOF);
+  if (isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
 
-  char c = advance();
+  char c = advance(scanner);
 
-  if (isAlpha(c)) return identifier();
-  if (isDigit(c)) return number();
+  if (isAlpha(c)) return identifier(scanner);
+  if (isDigit(c)) return number(scanner);
 
   switch (c) {
-    case '(': return makeToken(TOKEN_LEFT_PAREN);
-    case ')': return makeToken(TOKEN_RIGHT_PAREN);
-    case '{': return makeToken(TOKEN_LEFT_BRACE);
-    case '}': return makeToken(TOKEN_RIGHT_BRACE);
-    case ';': return makeToken(TOKEN_SEMICOLON);
-    case ',': return makeToken(TOKEN_COMMA);
-    case '.': return makeToken(TOKEN_DOT);
-    case '-': return makeToken(TOKEN_MINUS);
-    case '+': return makeToken(TOKEN_PLUS);
-    case '/': return makeToken(TOKEN_SLASH);
-    case '*': return makeToken(TOKEN_STAR);
+    case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
+    case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN);
+    case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
+    case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+    case ';': return makeToken(scanner, TOKEN_SEMICOLON);
+    case ',': return makeToken(scanner, TOKEN_COMMA);
+    case '.': return makeToken(scanner, TOKEN_DOT);
+    case '-': return makeToken(scanner, TOKEN_MINUS);
+    case '+': return makeToken(scanner, TOKEN_PLUS);
+    case '/': return makeToken(scanner, TOKEN_SLASH);
+    case '*': return makeToken(scanner, TOKEN_STAR);
     case '!':
-      return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+      return makeToken(scanner,
+                       match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
     case '=':
-      return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+      return makeToken(scanner,
+                       match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
     case '<':
-      return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+      return makeToken(scanner,
+                       match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
     case '>':
-      return makeToken(match('=') ?
+      return makeToken(scanner, match(scanner, '=') ?
                        TOKEN_GREATER_EQUAL : TOKEN_GREATER);
 
-    case '"': return string();
+    case '"': return string(scanner);
   }
 
-  return errorToken("Unexpected character.");
+  return errorToken(scanner, "Unexpected character.");
 }
@@ -40,7 +40,28 @@ typedef struct {
   int line;
 } Token;
 
-void initScanner(const char* source);
-Token scanToken();
+/**
+    @brief The state of one scan through a source. Each compilation has
+    its own, so scans do not interfere with each other.
+**/
+typedef struct {
+  const char* start;
+  const char* current;
+  int line;
+
+  // The stream still being read, or -1 once it is exhausted or when the
+  // whole source was given up front.
+  int fd;
+  // Where the characters read so far end, and for a stream, where the
+  // current block ends. Only a stream's blocks are written through them.
+  char* end;
+  char* limit;
+  struct sSourceBlock* blocks;
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source);
+void initStreamScanner(Scanner* scanner, int fd);
+void freeScanner(Scanner* scanner);
+Token scanToken(Scanner* scanner);
 
 #endif
@@ -0,0 +1,807 @@
+/**
+    @file snapshot.c
+
+    @brief Heap snapshots.
+
+    A snapshot holds the global variables a script has defined and every
+    object reachable from them: classes and their methods, instances,
+    closures with their upvalues and functions, and the strings they all
+    refer to. A process that restores one starts out with those globals
+    already defined, without running the code that built them.
+
+    Objects are numbered in the order they are found and stored one
+    record after another, with references to other objects stored as
+    those numbers. Restoring reads the records twice. The first pass
+    makes an object for each record, filling in everything but its
+    references; the second fixes up the references now that every
+    number has an object. Strings, functions and natives are numbered
+    ahead of everything else, so a closure's function already exists by
+    the time the closure is made.
+
+    Ropes and slices are stored as the plain strings they spell, and
+    natives by their position in the VM's list of natives.
+
+**/
+#include <string.h>
+
+#include "cache.h"
+#include "image.h"
+#include "memory.h"
+#include "snapshot.h"
+#include "vm.h"
+
+#define SNAPSHOT_MAGIC "CLXS"
+
+/**
+    @brief Tags for the values a snapshot stores.
+**/
+typedef enum {
+  SNAPPED_NIL,
+  SNAPPED_TRUE,
+  SNAPPED_FALSE,
+  SNAPPED_NUMBER,
+  SNAPPED_OBJECT
+} SnappedTag;
+
+/**
+    @brief The objects being written, in the order they are numbered,
+    and an open addressed index from their addresses to their numbers.
+**/
+typedef struct {
+  Obj** objects;
+  int count;
+  int capacity;
+  Obj** keys;
+  int* numbers;
+  int keyCapacity;
+} SnapshotObjects;
+
+// The objects made so far by a restore in progress, by number.
+static Obj** restoring = NULL;
+static int restoringCount = 0;
+
+/**
+    @brief Slot for an object's address in the index.
+
+    @param objects
+    @param object
+    @return int
+**/
+static int findSlot(SnapshotObjects* objects, Obj* object) {
+  uint32_t slot = (uint32_t)(((uintptr_t)object >> 3) * 2654435761u) &
+                  (objects->keyCapacity - 1);
+  while (objects->keys[slot] != NULL && objects->keys[slot] != object) {
+    slot = (slot + 1) & (objects->keyCapacity - 1);
+  }
+  return (int)slot;
+}
+
+/**
+    @brief Number an object the first time it is found.
+
+    @param objects
+    @param object
+**/
+static void addObject(SnapshotObjects* objects, Obj* object) {
+  if (object == NULL) return;
+  if (object->type == OBJ_ROPE) {
+    object = (Obj*)flattenRope((ObjRope*)object);
+  }
+
+  if ((objects->count + 1) * 2 > objects->keyCapacity) {
+    int oldCapacity = objects->keyCapacity;
+    Obj** oldKeys = objects->keys;
+    objects->keyCapacity = GROW_CAPACITY(oldCapacity) * 2;
+    objects->keys = ALLOCATE(Obj*, objects->keyCapacity);
+    objects->numbers = GROW_ARRAY(objects->numbers, int,
+                                  oldCapacity, objects->keyCapacity);
+    for (int i = 0; i < objects->keyCapacity; i++) objects->keys[i] = NULL;
+    for (int i = 0; i < objects->count; i++) {
+      int slot = findSlot(objects, objects->objects[i]);
+      objects->keys[slot] = objects->objects[i];
+      objects->numbers[slot] = i;
+    }
+    FREE_ARRAY(Obj*, oldKeys, oldCapacity);
+  }
+
+  int slot = findSlot(objects, object);
+  if (objects->keys[slot] != NULL) return;
+
+  if (objects->capacity < objects->count + 1) {
+    int oldCapacity = objects->capacity;
+    objects->capacity = GROW_CAPACITY(oldCapacity);
+    objects->objects = GROW_ARRAY(objects->objects, Obj*,
+                                  oldCapacity, objects->capacity);
+  }
+
+  objects->keys[slot] = object;
+  objects->numbers[slot] = objects->count;
+  objects->objects[objects->count++] = object;
+}
+
+/**
+    @brief
+
+    @param objects
+    @param value
+**/
+static void addValue(SnapshotObjects* objects, Value value) {
+  if (IS_OBJ(value)) addObject(objects, AS_OBJ(value));
+}
+
+/**
+    @brief
+
+    @param objects
+    @param table
+**/
+static void addTable(SnapshotObjects* objects, Table* table) {
+  for (int i = 0; i <= table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    if (entry->key == NULL) continue;
+    addObject(objects, (Obj*)entry->key);
+    addValue(objects, entry->value);
+  }
+}
+
+/**
+    @brief Number every object an object refers to.
+
+    @param objects
+    @param object
+**/
+static void addReferences(SnapshotObjects* objects, Obj* object) {
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*)object;
+      addValue(objects, bound->receiver);
+      addObject(objects, (Obj*)bound->method);
+      break;
+    }
+
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)object;
+      addObject(objects, (Obj*)klass->name);
+      addTable(objects, &klass->methods);
+      break;
+    }
+
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      addObject(objects, (Obj*)closure->function);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        addObject(objects, (Obj*)closure->upvalues[i]);
+      }
+      break;
+    }
+
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      addObject(objects, (Obj*)function->name);
+      addValue(objects, function->inlineValue);
+      for (int i = 0; i < function->chunk.constants.count; i++) {
+        addValue(objects, function->chunk.constants.values[i]);
+      }
+      break;
+    }
+
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      addObject(objects, (Obj*)instance->klass);
+      addTable(objects, &instance->fields);
+      break;
+    }
+
+    case OBJ_UPVALUE:
+      addValue(objects, ((ObjUpvalue*)object)->closed);
+      break;
+
+    case OBJ_NATIVE:
+    case OBJ_ROPE:
+    case OBJ_SLICE:
+    case OBJ_STRING:
+    case OBJ_STRING_BUILDER:
+      break;
+  }
+}
+
+/**
+    @brief Whether an object is stored ahead of the rest: it refers to
+    nothing that needs fixing up before it can be made.
+
+    @param object
+    @return bool
+**/
+static bool storedFirst(Obj* object) {
+  return object->type == OBJ_STRING || object->type == OBJ_SLICE ||
+         object->type == OBJ_FUNCTION || object->type == OBJ_NATIVE;
+}
+
+/**
+    @brief Number the globals and everything reachable from them.
+
+    @param objects
+**/
+static void findObjects(SnapshotObjects* objects) {
+  addTable(objects, &vm.globals);
+  for (int i = 0; i < objects->count; i++) {
+    addReferences(objects, objects->objects[i]);
+  }
+
+  // Renumber so that strings, functions and natives come first.
+  Obj** ordered = ALLOCATE(Obj*, objects->capacity);
+  int next = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < objects->count; i++) {
+      Obj* object = objects->objects[i];
+      if (storedFirst(object) != (pass == 0)) continue;
+      objects->numbers[findSlot(objects, object)] = next;
+      ordered[next++] = object;
+    }
+  }
+
+  FREE_ARRAY(Obj*, objects->objects, objects->capacity);
+  objects->objects = ordered;
+}
+
+/**
+    @brief
+
+    @param objects
+    @param object
+    @return int
+**/
+static int objectNumber(SnapshotObjects* objects, Obj* object) {
+  if (object->type == OBJ_ROPE) object = (Obj*)((ObjRope*)object)->flat;
+  return objects->numbers[findSlot(objects, object)];
+}
+
+/**
+    @brief
+
+    @param writer
+    @param objects
+    @param value
+**/
+static void writeValue(ImageWriter* writer, SnapshotObjects* objects,
+                       Value value) {
+  if (IS_NIL(value)) {
+    writeInt(writer, SNAPPED_NIL, 1);
+  } else if (IS_BOOL(value)) {
+    writeInt(writer, AS_BOOL(value) ? SNAPPED_TRUE : SNAPPED_FALSE, 1);
+  } else if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    writeInt(writer, SNAPPED_NUMBER, 1);
+    writeInt(writer, bits, 8);
+  } else {
+    writeInt(writer, SNAPPED_OBJECT, 1);
+    writeInt(writer, objectNumber(objects, AS_OBJ(value)), 4);
+  }
+}
+
+/**
+    @brief Write a reference that may be NULL.
+
+    @param writer
+    @param objects
+    @param object
+**/
+static void writeObject(ImageWriter* writer, SnapshotObjects* objects,
+                        Obj* object) {
+  writeValue(writer, objects, object == NULL ? NIL_VAL : OBJ_VAL(object));
+}
+
+/**
+    @brief
+
+    @param writer
+    @param objects
+    @param table
+**/
+static void writeTable(ImageWriter* writer, SnapshotObjects* objects,
+                       Table* table) {
+  int count = 0;
+  for (int i = 0; i <= table->capacity; i++) {
+    if (table->entries[i].key != NULL) count++;
+  }
+
+  writeInt(writer, count, 4);
+  for (int i = 0; i <= table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    if (entry->key == NULL) continue;
+    writeObject(writer, objects, (Obj*)entry->key);
+    writeValue(writer, objects, entry->value);
+  }
+}
+
+/**
+    @brief Write one object's record.
+
+    @param writer
+    @param objects
+    @param object
+**/
+static void writeRecord(ImageWriter* writer, SnapshotObjects* objects,
+                        Obj* object) {
+  // Closures in the frame arena and open upvalues live on the stack,
+  // which is empty by the time a snapshot is taken.
+  if (object->inFrame) writer->failed = true;
+
+  writeInt(writer, object->type, 1);
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*)object;
+      writeValue(writer, objects, bound->receiver);
+      writeObject(writer, objects, (Obj*)bound->method);
+      break;
+    }
+
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)object;
+      writeObject(writer, objects, (Obj*)klass->name);
+      writeTable(writer, objects, &klass->methods);
+      break;
+    }
+
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      // Never nil, and needed while the objects are still being made.
+      writeInt(writer, objectNumber(objects, (Obj*)closure->function), 4);
+      writeInt(writer, closure->upvalueCount, 4);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        writeObject(writer, objects, (Obj*)closure->upvalues[i]);
+      }
+      break;
+    }
+
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      Chunk* chunk = &function->chunk;
+      writeInt(writer, function->arity, 4);
+      writeInt(writer, function->upvalueCount, 4);
+      writeInt(writer, function->maxSlots, 4);
+      writeInt(writer, function->inlineKind, 1);
+      writeInt(writer, function->inlineSlot, 1);
+      writeValue(writer, objects, function->inlineValue);
+      writeObject(writer, objects, (Obj*)function->name);
+
+      writeInt(writer, chunk->count, 4);
+      writeBytes(writer, chunk->code, chunk->count);
+      writeInt(writer, chunk->lineCount, 4);
+      for (int i = 0; i < chunk->lineCount; i++) {
+        writeInt(writer, chunk->lines[i].offset, 4);
+        writeInt(writer, chunk->lines[i].line, 4);
+      }
+
+      writeInt(writer, chunk->constants.count, 4);
+      for (int i = 0; i < chunk->constants.count; i++) {
+        writeValue(writer, objects, chunk->constants.values[i]);
+      }
+      break;
+    }
+
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      writeObject(writer, objects, (Obj*)instance->klass);
+      writeTable(writer, objects, &instance->fields);
+      break;
+    }
+
+    case OBJ_NATIVE: {
+      int index = nativeIndex(((ObjNative*)object)->function);
+      if (index == -1) writer->failed = true;
+      writeInt(writer, (uint32_t)index, 4);
+      break;
+    }
+
+    case OBJ_ROPE:
+    case OBJ_SLICE:
+    case OBJ_STRING:
+      writeInt(writer, stringLength(object), 4);
+      writeBytes(writer, stringChars(object), stringLength(object));
+      break;
+
+    case OBJ_STRING_BUILDER: {
+      ObjStringBuilder* builder = (ObjStringBuilder*)object;
+      const char* chars = builder->string != NULL ? builder->string->chars
+                                                  : builder->chars;
+      writeInt(writer, builder->length, 4);
+      writeBytes(writer, chars, builder->length);
+      break;
+    }
+
+    case OBJ_UPVALUE: {
+      ObjUpvalue* upvalue = (ObjUpvalue*)object;
+      if (upvalue->location != &upvalue->closed) writer->failed = true;
+      writeValue(writer, objects, upvalue->closed);
+      break;
+    }
+  }
+}
+
+/**
+    @brief Write the globals and every object reachable from them.
+
+    Meant to be called once a script has finished, when nothing is left
+    on the stack.
+
+    @param path
+    @return bool Whether the snapshot was written.
+**/
+bool saveSnapshot(const char* path) {
+  SnapshotObjects objects = { NULL, 0, 0, NULL, NULL, 0 };
+  findObjects(&objects);
+
+  ImageWriter writer;
+  bool saved = openImage(&writer, path);
+  if (saved) {
+    writeBytes(&writer, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC));
+    writeInt(&writer, SNAPSHOT_VERSION, 4);
+    writeInt(&writer, CACHE_VERSION, 4);
+    writeInt(&writer, objects.count, 4);
+    for (int i = 0; i < objects.count; i++) {
+      writeRecord(&writer, &objects, objects.objects[i]);
+    }
+    writeTable(&writer, &objects, &vm.globals);
+    saved = closeImage(&writer);
+  }
+
+  FREE_ARRAY(Obj*, objects.objects, objects.capacity);
+  FREE_ARRAY(Obj*, objects.keys, objects.keyCapacity);
+  FREE_ARRAY(int, objects.numbers, objects.keyCapacity);
+  return saved;
+}
+
+/**
+    @brief Read a value. References resolve only once link is set, when
+    every object has been made.
+
+    @param reader
+    @param link
+    @return Value nil for an unresolved reference.
+**/
+static Value readValue(ImageReader* reader, bool link) {
+  switch (readInt(reader, 1)) {
+    case SNAPPED_NIL:   return NIL_VAL;
+    case SNAPPED_TRUE:  return BOOL_VAL(true);
+    case SNAPPED_FALSE: return BOOL_VAL(false);
+    case SNAPPED_NUMBER: {
+      uint64_t bits = readInt(reader, 8);
+      double number;
+      memcpy(&number, &bits, sizeof(number));
+      return NUMBER_VAL(number);
+    }
+    case SNAPPED_OBJECT: {
+      uint64_t number = readInt(reader, 4);
+      if (number >= (uint64_t)restoringCount) {
+        reader->failed = true;
+        return NIL_VAL;
+      }
+      return link ? OBJ_VAL(restoring[number]) : NIL_VAL;
+    }
+    default:
+      reader->failed = true;
+      return NIL_VAL;
+  }
+}
+
+/**
+    @brief Read a reference to an object of the given type, or nil.
+
+    @param reader
+    @param link
+    @param type
+    @return Obj* NULL for nil, an unresolved reference or the wrong type.
+**/
+static Obj* readObject(ImageReader* reader, bool link, ObjType type) {
+  Value value = readValue(reader, link);
+  if (!link || IS_NIL(value)) return NULL;
+  if (!IS_OBJ(value) || AS_OBJ(value)->type != type) {
+    reader->failed = true;
+    return NULL;
+  }
+  return AS_OBJ(value);
+}
+
+/**
+    @brief Read a table, filling it in once link is set.
+
+    @param reader
+    @param link
+    @param table
+**/
+static void readTable(ImageReader* reader, bool link, Table* table) {
+  int count = readCount(reader);
+  for (int i = 0; i < count && !reader->failed; i++) {
+    ObjString* key = (ObjString*)readObject(reader, link, OBJ_STRING);
+    Value value = readValue(reader, link);
+    if (link && key == NULL) reader->failed = true;
+    if (link && !reader->failed) tableSet(table, key, value);
+  }
+}
+
+/**
+    @brief Make the object for a record, leaving out its references.
+
+    @param reader
+    @param number
+**/
+static void makeObject(ImageReader* reader, int number) {
+  Obj* object = NULL;
+  switch (readInt(reader, 1)) {
+    case OBJ_BOUND_METHOD:
+      object = (Obj*)newBoundMethod(NIL_VAL, NULL);
+      readValue(reader, false);
+      readValue(reader, false);
+      break;
+
+    case OBJ_CLASS:
+      object = (Obj*)newClass(NULL);
+      readValue(reader, false);
+      readTable(reader, false, NULL);
+      break;
+
+    case OBJ_CLOSURE: {
+      int function = readCount(reader);
+      if (reader->failed || function >= number ||
+          restoring[function]->type != OBJ_FUNCTION) {
+        reader->failed = true;
+        return;
+      }
+
+      ObjClosure* closure = newClosure((ObjFunction*)restoring[function]);
+      object = (Obj*)closure;
+      if ((int)readInt(reader, 4) != closure->upvalueCount) {
+        reader->failed = true;
+      }
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        readValue(reader, false);
+      }
+      break;
+    }
+
+    case OBJ_FUNCTION: {
+      ObjFunction* function = newFunction();
+      restoring[number] = (Obj*)function;
+      function->arity = readCount(reader);
+      function->upvalueCount = readCount(reader);
+      function->maxSlots = readCount(reader);
+      function->inlineKind = (InlineKind)readInt(reader, 1);
+      function->inlineSlot = (uint8_t)readInt(reader, 1);
+      readValue(reader, false);
+      readValue(reader, false);
+
+      int count = readCount(reader);
+      const uint8_t* code = readBytes(reader, count);
+      int lineCount = readCount(reader);
+      if ((count == 0) != (lineCount == 0)) reader->failed = true;
+
+      // Each run's code is written once the next run's start is known.
+      int offset = 0;
+      int line = 0;
+      for (int i = 0; i < lineCount && !reader->failed; i++) {
+        int start = readCount(reader);
+        if (start >= count || (i == 0 ? start != 0 : start <= offset)) {
+          reader->failed = true;
+          break;
+        }
+        for (; offset < start; offset++) {
+          writeChunk(&function->chunk, code[offset], line);
+        }
+        line = (int)readInt(reader, 4);
+      }
+      for (; offset < count && !reader->failed; offset++) {
+        writeChunk(&function->chunk, code[offset], line);
+      }
+
+      int constantCount = readCount(reader);
+      for (int i = 0; i < constantCount && !reader->failed; i++) {
+        readValue(reader, false);
+      }
+      object = (Obj*)function;
+      break;
+    }
+
+    case OBJ_INSTANCE:
+      object = (Obj*)newInstance(NULL);
+      readValue(reader, false);
+      readTable(reader, false, NULL);
+      break;
+
+    case OBJ_NATIVE: {
+      NativeFn function = nativeAt((int)readInt(reader, 4));
+      if (function == NULL) reader->failed = true;
+      object = (Obj*)newNative(function);
+      break;
+    }
+
+    case OBJ_ROPE:
+    case OBJ_SLICE:
+    case OBJ_STRING: {
+      int length = readCount(reader);
+      const uint8_t* chars = readBytes(reader, length);
+      if (chars != NULL) {
+        object = (Obj*)copyString((const char*)chars, length);
+      }
+      break;
+    }
+
+    case OBJ_STRING_BUILDER: {
+      int length = readCount(reader);
+      const uint8_t* chars = readBytes(reader, length);
+      ObjStringBuilder* builder = newStringBuilder();
+      restoring[number] = (Obj*)builder;
+      if (chars != NULL &&
+          !appendToBuilder(builder, (const char*)chars, length)) {
+        reader->failed = true;
+      }
+      object = (Obj*)builder;
+      break;
+    }
+
+    case OBJ_UPVALUE: {
+      ObjUpvalue* upvalue = newUpvalue(NULL);
+      upvalue->location = &upvalue->closed;
+      readValue(reader, false);
+      object = (Obj*)upvalue;
+      break;
+    }
+
+    default:
+      reader->failed = true;
+      return;
+  }
+
+  if (object == NULL) reader->failed = true;
+  restoring[number] = object;
+}
+
+/**
+    @brief Fill in the references of an object made by makeObject().
+
+    @param reader
+    @param object
+**/
+static void linkObject(ImageReader* reader, Obj* object) {
+  readInt(reader, 1);
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*)object;
+      bound->receiver = readValue(reader, true);
+      bound->method = (ObjClosure*)readObject(reader, true, OBJ_CLOSURE);
+      if (bound->method == NULL) reader->failed = true;
+      break;
+    }
+
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)object;
+      klass->name = (ObjString*)readObject(reader, true, OBJ_STRING);
+      readTable(reader, true, &klass->methods);
+      break;
+    }
+
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      readInt(reader, 4);
+      readInt(reader, 4);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        closure->upvalues[i] =
+            (ObjUpvalue*)readObject(reader, true, OBJ_UPVALUE);
+      }
+      break;
+    }
+
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      readCount(reader);
+      readCount(reader);
+      readCount(reader);
+      readInt(reader, 1);
+      readInt(reader, 1);
+      function->inlineValue = readValue(reader, true);
+      function->name = (ObjString*)readObject(reader, true, OBJ_STRING);
+
+      readBytes(reader, readCount(reader));
+      readBytes(reader, (size_t)readCount(reader) * 8);
+
+      int constantCount = readCount(reader);
+      for (int i = 0; i < constantCount && !reader->failed; i++) {
+        addConstant(&function->chunk, readValue(reader, true));
+      }
+      break;
+    }
+
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      instance->klass = (ObjClass*)readObject(reader, true, OBJ_CLASS);
+      if (instance->klass == NULL) reader->failed = true;
+      readTable(reader, true, &instance->fields);
+      break;
+    }
+
+    case OBJ_NATIVE:
+      readInt(reader, 4);
+      break;
+
+    case OBJ_STRING:
+    case OBJ_STRING_BUILDER:
+      readBytes(reader, readCount(reader));
+      break;
+
+    case OBJ_UPVALUE:
+      ((ObjUpvalue*)object)->closed = readValue(reader, true);
+      break;
+
+    case OBJ_ROPE:
+    case OBJ_SLICE:
+      break;
+  }
+}
+
+/**
+    @brief Define the globals saved in a snapshot, along with everything
+    they refer to.
+
+    Meant to be called on a fresh VM, before any script runs. Globals of
+    the same name are replaced.
+
+    @param path
+    @return bool False if the snapshot cannot be read or is malformed,
+            or was written by an incompatible build.
+**/
+bool restoreSnapshot(const char* path) {
+  size_t size;
+  uint8_t* data = mapImage(path, &size);
+  if (data == NULL) return false;
+
+  ImageReader reader = { data, size, 0, false };
+  const uint8_t* magic = readBytes(&reader, strlen(SNAPSHOT_MAGIC));
+  bool current = magic != NULL &&
+      memcmp(magic, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC)) == 0 &&
+      readInt(&reader, 4) == SNAPSHOT_VERSION &&
+      readInt(&reader, 4) == CACHE_VERSION;
+  int count = readCount(&reader);
+  if (!current || reader.failed || (size_t)count > size) {
+    unmapImage(data, size);
+    return false;
+  }
+
+  restoring = ALLOCATE(Obj*, count);
+  for (int i = 0; i < count; i++) restoring[i] = NULL;
+  restoringCount = count;
+
+  size_t records = reader.position;
+  for (int i = 0; i < count && !reader.failed; i++) {
+    makeObject(&reader, i);
+  }
+
+  reader.position = records;
+  for (int i = 0; i < count && !reader.failed; i++) {
+    linkObject(&reader, restoring[i]);
+  }
+
+  Table globals;
+  initTable(&globals);
+  readTable(&reader, true, &globals);
+  bool restored = !reader.failed && reader.position == reader.length;
+  if (restored) tableAddAll(&globals, &vm.globals);
+  freeTable(&globals);
+
+  FREE_ARRAY(Obj*, restoring, count);
+  restoring = NULL;
+  restoringCount = 0;
+  unmapImage(data, size);
+  return restored;
+}
+
+/**
+    @brief Mark the objects a restore in progress has made so far.
+
+**/
+void markSnapshotRoots() {
+  for (int i = 0; i < restoringCount; i++) {
+    markObject(restoring[i]);
+  }
+}
@@ -0,0 +1,20 @@
+/**
+    @file snapshot.h
+
+    @brief Header for heap snapshots.
+
+**/
+#ifndef clox_snapshot_h
+#define clox_snapshot_h
+
+#include "common.h"
+
+// Bumped whenever the snapshot layout changes. Snapshots also record
+// CACHE_VERSION, since the functions in them hold bytecode.
+#define SNAPSHOT_VERSION 2
+
+bool saveSnapshot(const char* path);
+bool restoreSnapshot(const char* path);
+void markSnapshotRoots();
+
+#endif
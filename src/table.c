@@ -165,6 +165,22 @@ bool tableDelete(Table* table, ObjString* key) {
   return true;
 }
 
+/**
+    @brief Grow the table so that it can hold count entries without
+    resizing again.
+
+    @param table
+    @param count
+**/
+void tableReserve(Table* table, int count) {
+  int size = table->capacity + 1;
+  if (count <= size * TABLE_MAX_LOAD) return;
+
+  size = GROW_CAPACITY(size);
+  while (count > size * TABLE_MAX_LOAD) size *= 2;
+  adjustCapacity(table, size - 1);
+}
+
 /**
     @brief
 
@@ -4,11 +4,12 @@
     @brief
 
 **/
-#include <stdio.h>
 #include <string.h>
 
 #include "object.h"
 #include "memory.h"
+#include "number.h"
+#include "output.h"
 #include "value.h"
 
 /**
@@ -50,6 +51,17 @@ void freeValueArray(ValueArray* array) {
   initValueArray(array);
 }
 
+/**
+    @brief Print a number the way printf("%g") would.
+
+    @param number
+**/
+static void printNumber(double number) {
+  char buffer[NUMBER_BUFFER_SIZE];
+  int length = formatNumber(number, buffer);
+  writeOutput(buffer, length);
+}
+
 /**
     @brief
 
@@ -58,19 +70,21 @@ void freeValueArray(ValueArray* array) {
 void printValue(Value value) {
 #ifdef NAN_BOXING
   if (IS_BOOL(value)) {
-    printf(AS_BOOL(value) ? "true" : "false");
+    writeOutputString(AS_BOOL(value) ? "true" : "false");
   } else if (IS_NIL(value)) {
-    printf("nil");
+    writeOutputString("nil");
   } else if (IS_NUMBER(value)) {
-    printf("%g", AS_NUMBER(value));
+    printNumber(AS_NUMBER(value));
   } else if (IS_OBJ(value)) {
     printObject(value);
   }
 #else
   switch (value.type) {
-    case VAL_BOOL:   printf(AS_BOOL(value) ? "true" : "false"); break;
-    case VAL_NIL:    printf("nil"); break;
-    case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
+    case VAL_BOOL:
+      writeOutputString(AS_BOOL(value) ? "true" : "false");
+      break;
+    case VAL_NIL:    writeOutputString("nil"); break;
+    case VAL_NUMBER: printNumber(AS_NUMBER(value)); break;
     case VAL_OBJ:    printObject(value); break;
   }
 #endif
@@ -4,8 +4,10 @@
     @brief
 
 **/
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
@@ -14,9 +16,11 @@
 #include "debug.h"
 #include "object.h"
 #include "memory.h"
+#include "number.h"
+#include "output.h"
 #include "vm.h"
 
-VM vm; // [one]
+THREAD_LOCAL VM vm; // [one]
 
 /**
     @brief
@@ -25,10 +29,10 @@ VM vm; // [one]
     @param args
     @return Value
 **/
-static Value clockNative(int argCount, Value* args) {
+static bool clockNative(int argCount, Value* args) {
   (void)argCount;
-  (void)args;
-  return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+  args[-1] = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+  return true;
 }
 
 /**
@@ -39,6 +43,73 @@ static void resetStack() {
   vm.stackTop = vm.stack;
   vm.frameCount = 0;
   vm.openUpvalues = NULL;
+  vm.frameArenaUsed = 0;
+}
+
+/**
+    @brief Double the call frame array, up to the frame limit.
+
+    Frames are only ever referred to by index or re-fetched after a call,
+    so nothing points into the old array.
+
+**/
+static void growFrames() {
+  int capacity = vm.frameCapacity * 2;
+  if (capacity > vm.frameLimit) capacity = vm.frameLimit;
+
+  CallFrame* frames = realloc(vm.frames, sizeof(CallFrame) * capacity);
+  if (frames == NULL) {
+    fprintf(stderr, "Out of memory growing the call stack.\n");
+    exit(1);
+  }
+
+  vm.frames = frames;
+  vm.frameCapacity = capacity;
+}
+
+/**
+    @brief Make sure at least count free slots are above stackTop.
+
+    Growing may move the stack, so every pointer into it is rebased: the
+    stack top, each frame's slots, each open upvalue's location and the
+    locations captured by frame closures.
+
+    @param count
+**/
+static void reserveStack(int count) {
+  int used = (int)(vm.stackTop - vm.stack);
+  if (used + count <= vm.stackCapacity) return;
+
+  int capacity = vm.stackCapacity;
+  while (capacity < used + count) capacity *= 2;
+
+  Value* stack = realloc(vm.stack, sizeof(Value) * capacity);
+  if (stack == NULL) {
+    fprintf(stderr, "Out of memory growing the value stack.\n");
+    exit(1);
+  }
+
+  if (stack != vm.stack) {
+    for (int i = 0; i < vm.frameCount; i++) {
+      vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL;
+         upvalue = upvalue->next) {
+      upvalue->location = stack + (upvalue->location - vm.stack);
+    }
+    for (size_t offset = 0; offset < vm.frameArenaUsed;) {
+      ObjClosure* closure = (ObjClosure*)(vm.frameArena + offset);
+      ObjUpvalue* upvalues = frameClosureUpvalues(closure);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        if (upvalues[i].location == NULL) continue;
+        upvalues[i].location = stack + (upvalues[i].location - vm.stack);
+      }
+      offset += frameClosureSize(closure->upvalueCount);
+    }
+    vm.stackTop = stack + used;
+    vm.stack = stack;
+  }
+  vm.stackCapacity = capacity;
 }
 
 /**
@@ -48,6 +119,9 @@ static void resetStack() {
     @param ...
 **/
 static void runtimeError(const char* format, ...) {
+  // What the script printed before the error comes first.
+  flushOutput();
+
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
@@ -55,13 +129,22 @@ static void runtimeError(const char* format, ...) {
   fputs("\n", stderr);
 
   for (int i = vm.frameCount - 1; i >= 0; i--) {
+    // Deep traces keep only the innermost and outermost frames.
+    if (vm.frameCount > TRACE_FRAMES_MAX &&
+        i == vm.frameCount - 1 - TRACE_FRAMES_MAX / 2) {
+      fprintf(stderr, "[%d more frames]\n",
+              vm.frameCount - TRACE_FRAMES_MAX);
+      i = TRACE_FRAMES_MAX / 2;
+      continue;
+    }
+
     CallFrame* frame = &vm.frames[i];
     ObjFunction* function = frame->closure->function;
     // -1 because the IP is sitting on the next instruction to be
     // executed.
     size_t instruction = frame->ip - function->chunk.code - 1;
     fprintf(stderr, "[line %d] in ",
-            function->chunk.lines[instruction]);
+            getLine(&function->chunk, (int)instruction));
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
     } else {
@@ -72,16 +155,238 @@ static void runtimeError(const char* format, ...) {
   resetStack();
 }
 
+/**
+    @brief Check for any kind of string value.
+
+    @param value
+    @return true
+    @return false
+**/
+static bool isStringValue(Value value) {
+  return IS_STRING(value) || IS_ROPE(value) || IS_SLICE(value);
+}
+
+/**
+    @brief Check that a native was passed the expected number of
+    arguments.
+
+    @param name
+    @param expected
+    @param argCount
+    @return true
+    @return false
+**/
+static bool checkArity(const char* name, int expected, int argCount) {
+  if (argCount != expected) {
+    runtimeError("%s() expects %d arguments but got %d.",
+                 name, expected, argCount);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+    @brief Create a new, empty StringBuilder.
+
+    @param argCount
+    @param args
+    @return true
+    @return false
+**/
+static bool stringBuilderNative(int argCount, Value* args) {
+  if (!checkArity("StringBuilder", 0, argCount)) return false;
+  args[-1] = OBJ_VAL(newStringBuilder());
+  return true;
+}
+
+/**
+    @brief Append a string or number to the receiver and return the
+    receiver so that calls can be chained.
+
+    @param argCount
+    @param args
+    @return true
+    @return false
+**/
+static bool builderAppendNative(int argCount, Value* args) {
+  if (!checkArity("append", 1, argCount)) return false;
+  ObjStringBuilder* builder = AS_STRING_BUILDER(args[-1]);
+
+  bool appended;
+  if (isStringValue(args[0])) {
+    appended = appendStringToBuilder(builder, AS_OBJ(args[0]));
+  } else if (IS_NUMBER(args[0])) {
+    char buffer[NUMBER_BUFFER_SIZE];
+    int length = formatNumber(AS_NUMBER(args[0]), buffer);
+    appended = appendToBuilder(builder, buffer, length);
+  } else {
+    runtimeError("Can only append strings and numbers.");
+    return false;
+  }
+
+  if (!appended) {
+    runtimeError("String is too long.");
+    return false;
+  }
+  return true;
+}
+
+/**
+    @brief Get the number of characters in the receiver.
+
+    @param argCount
+    @param args
+    @return true
+    @return false
+**/
+static bool builderLengthNative(int argCount, Value* args) {
+  if (!checkArity("length", 0, argCount)) return false;
+  args[-1] = NUMBER_VAL(AS_STRING_BUILDER(args[-1])->length);
+  return true;
+}
+
+/**
+    @brief Empty the receiver.
+
+    @param argCount
+    @param args
+    @return true
+    @return false
+**/
+static bool builderClearNative(int argCount, Value* args) {
+  if (!checkArity("clear", 0, argCount)) return false;
+  clearBuilder(AS_STRING_BUILDER(args[-1]));
+  args[-1] = NIL_VAL;
+  return true;
+}
+
+/**
+    @brief Get the contents of the receiver as a string.
+
+    @param argCount
+    @param args
+    @return true
+    @return false
+**/
+static bool builderToStringNative(int argCount, Value* args) {
+  if (!checkArity("toString", 0, argCount)) return false;
+  args[-1] = OBJ_VAL(builderToString(AS_STRING_BUILDER(args[-1])));
+  return true;
+}
+
+/**
+    @brief Check that a native argument is a whole number that fits in
+    an int. The range is checked first, since casting a double outside
+    it is undefined.
+
+    @param value
+    @return true
+    @return false
+**/
+static bool isInteger(Value value) {
+  if (!IS_NUMBER(value)) return false;
+  double number = AS_NUMBER(value);
+  return number >= INT_MIN && number <= INT_MAX && number == (int)number;
+}
+
+/**
+    @brief Take length characters of a string starting at start. The
+    result shares the characters of the original string.
+
+    @param argCount
+    @param args
+    @return true
+    @return false
+**/
+static bool substringNative(int argCount, Value* args) {
+  if (!checkArity("substring", 3, argCount)) return false;
+
+  if (!isStringValue(args[0])) {
+    runtimeError("substring() expects a string.");
+    return false;
+  }
+
+  if (!isInteger(args[1]) || !isInteger(args[2])) {
+    runtimeError("substring() start and length must be integers.");
+    return false;
+  }
+
+  Obj* string = AS_OBJ(args[0]);
+  int start = (int)AS_NUMBER(args[1]);
+  int length = (int)AS_NUMBER(args[2]);
+  if (start < 0 || length < 0 || start > stringLength(string) ||
+      length > stringLength(string) - start) {
+    runtimeError("substring() range is out of bounds.");
+    return false;
+  }
+
+  if (IS_ROPE(args[0])) string = (Obj*)flattenRope(AS_ROPE(args[0]));
+  args[-1] = OBJ_VAL(newSlice(string, start, length));
+  return true;
+}
+
+/**
+    @brief A native function, and whether initVM() defines it as a global
+    or as a StringBuilder method. The VM is per thread, so the table is
+    picked when it is set up rather than named here.
+**/
+typedef struct {
+  bool method;
+  const char* name;
+  NativeFn function;
+} NativeDef;
+
+static const NativeDef natives[] = {
+  {false, "clock",         clockNative},
+  {false, "StringBuilder", stringBuilderNative},
+  {false, "substring",     substringNative},
+  {true,  "append",        builderAppendNative},
+  {true,  "length",        builderLengthNative},
+  {true,  "clear",         builderClearNative},
+  {true,  "toString",      builderToStringNative},
+};
+
+/**
+    @brief Position of a native function among the natives, which is the
+    same in every process running this build. Snapshots refer to natives
+    this way, since their addresses are not.
+
+    @param function
+    @return int -1 if function is not a native.
+**/
+int nativeIndex(NativeFn function) {
+  for (size_t i = 0; i < sizeof(natives) / sizeof(natives[0]); i++) {
+    if (natives[i].function == function) return (int)i;
+  }
+  return -1;
+}
+
+/**
+    @brief The native function at a position given by nativeIndex().
+
+    @param index
+    @return NativeFn NULL if there is no such native.
+**/
+NativeFn nativeAt(int index) {
+  if (index < 0 || (size_t)index >= sizeof(natives) / sizeof(natives[0])) {
+    return NULL;
+  }
+  return natives[index].function;
+}
+
 /**
     @brief
 
+    @param table
     @param name
     @param function
 **/
-static void defineNative(const char* name, NativeFn function) {
+static void defineNative(Table* table, const char* name,
+                         NativeFn function) {
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
   push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  tableSet(table, AS_STRING(vm.stack[0]), vm.stack[1]);
   pop();
   pop();
 }
@@ -91,8 +396,20 @@ static void defineNative(const char* name, NativeFn function) {
 
 **/
 void initVM() {
+  vm.frameCapacity = FRAMES_INITIAL;
+  vm.frameLimit = FRAMES_MAX;
+  vm.frames = malloc(sizeof(CallFrame) * vm.frameCapacity);
+  vm.stackCapacity = STACK_INITIAL;
+  vm.stack = malloc(sizeof(Value) * vm.stackCapacity);
+  vm.frameArena = malloc(FRAME_ARENA_SIZE);
   resetStack();
   vm.objects = NULL;
+  vm.stringBlocks = NULL;
+  vm.cacheImages = NULL;
+  initValueArray(&vm.scripts);
+  vm.compiling = NULL;
+  vm.batchingStrings = false;
+  vm.optimizeLevel = 2;
   vm.bytesAllocated = 0;
   vm.nextGC = 1024 * 1024;
 
@@ -102,11 +419,16 @@ void initVM() {
 
   initTable(&vm.globals);
   initTable(&vm.strings);
+  initTable(&vm.stringBuilderMethods);
 
   vm.initString = NULL;
   vm.initString = copyString("init", 4);
 
-  defineNative("clock", clockNative);
+  for (size_t i = 0; i < sizeof(natives) / sizeof(natives[0]); i++) {
+    Table* table = natives[i].method ? &vm.stringBuilderMethods
+                                     : &vm.globals;
+    defineNative(table, natives[i].name, natives[i].function);
+  }
 }
 
 /**
@@ -116,8 +438,96 @@ void initVM() {
 void freeVM() {
   freeTable(&vm.globals);
   freeTable(&vm.strings);
+  freeTable(&vm.stringBuilderMethods);
+  freeValueArray(&vm.scripts);
   vm.initString = NULL;
   freeObjects();
+  free(vm.frames);
+  free(vm.stack);
+  free(vm.frameArena);
+}
+
+/**
+    @brief Free this thread's VM but for its objects, which are handed
+    back for another VM to adopt.
+
+    Nothing is collected on the way out, so the objects are all there,
+    reachable or not. The other VM's next collection sorts them out.
+
+    @return Heap
+**/
+Heap detachHeap() {
+  freeTable(&vm.globals);
+  freeTable(&vm.strings);
+  freeTable(&vm.stringBuilderMethods);
+  freeValueArray(&vm.scripts);
+  vm.initString = NULL;
+  free(vm.grayStack);
+  free(vm.frames);
+  free(vm.stack);
+  free(vm.frameArena);
+
+  Heap heap = { vm.objects, vm.stringBlocks, vm.cacheImages,
+                vm.bytesAllocated };
+  return heap;
+}
+
+/**
+    @brief Take over the objects of a VM freed by detachHeap(). Its
+    strings are not interned here yet; see adoptFunction().
+
+    @param heap
+**/
+void adoptHeap(Heap* heap) {
+  if (heap->objects != NULL) {
+    Obj* last = heap->objects;
+    while (last->next != NULL) last = last->next;
+    last->next = vm.objects;
+    vm.objects = heap->objects;
+  }
+
+  if (heap->stringBlocks != NULL) {
+    StringBlock* last = heap->stringBlocks;
+    while (last->next != NULL) last = last->next;
+    last->next = vm.stringBlocks;
+    vm.stringBlocks = heap->stringBlocks;
+  }
+
+  if (heap->cacheImages != NULL) {
+    CacheImage* last = heap->cacheImages;
+    while (last->next != NULL) last = last->next;
+    last->next = vm.cacheImages;
+    vm.cacheImages = heap->cacheImages;
+  }
+
+  vm.bytesAllocated += heap->bytesAllocated;
+}
+
+/**
+    @brief Intern the strings an adopted function refers to, in the
+    order they appear, swapping each for the equal string this VM
+    already has if there is one. Nested functions are adopted with it.
+
+    The function must be reachable while this runs.
+
+    @param function
+**/
+void adoptFunction(ObjFunction* function) {
+  if (function->name != NULL) function->name = adoptString(function->name);
+  if (IS_STRING(function->inlineValue)) {
+    function->inlineValue =
+        OBJ_VAL(adoptString(AS_STRING(function->inlineValue)));
+  }
+
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    Value constant = constants->values[i];
+    if (IS_STRING(constant)) {
+      constants->values[i] = OBJ_VAL(adoptString(AS_STRING(constant)));
+    } else if (IS_FUNCTION(constant)) {
+      adoptFunction(AS_FUNCTION(constant));
+    }
+  }
 }
 
 /**
@@ -150,6 +560,46 @@ static Value peek(int distance) {
   return vm.stackTop[-1 - distance];
 }
 
+/**
+    @brief Evaluate a call to a trivial function in the caller's frame.
+
+    The function being called is the guard: this runs only once the call
+    has resolved to a function whose body was classified as inlinable.
+    A field getter whose receiver is not an instance holding that field
+    returns false so the call goes through a normal frame instead, which
+    reports errors and finds methods exactly as before.
+
+    @param function
+    @param argCount
+    @return true if the result replaced the callee and arguments.
+**/
+static bool callInline(ObjFunction* function, int argCount) {
+  Value* slots = vm.stackTop - argCount - 1;
+  Value result;
+
+  switch (function->inlineKind) {
+    case INLINE_CONSTANT:
+      result = function->inlineValue;
+      break;
+    case INLINE_SLOT:
+      result = slots[function->inlineSlot];
+      break;
+    case INLINE_FIELD:
+      if (!IS_INSTANCE(slots[0]) ||
+          !tableGet(&AS_INSTANCE(slots[0])->fields,
+                    AS_STRING(function->inlineValue), &result)) {
+        return false;
+      }
+      break;
+    default:
+      return false;
+  }
+
+  slots[0] = result;
+  vm.stackTop = slots + 1;
+  return true;
+}
+
 /**
     @brief
 
@@ -165,16 +615,25 @@ static bool call(ObjClosure* closure, int argCount) {
     return false;
   }
 
-  if (vm.frameCount == FRAMES_MAX) {
+  if (closure->function->inlineKind != INLINE_NONE &&
+      callInline(closure->function, argCount)) {
+    return true;
+  }
+
+  if (vm.frameCount == vm.frameLimit) {
     runtimeError("Stack overflow.");
     return false;
   }
 
+  if (vm.frameCount == vm.frameCapacity) growFrames();
+  reserveStack(closure->function->maxSlots + FRAME_STACK_RESERVE);
+
   CallFrame* frame = &vm.frames[vm.frameCount++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
 
   frame->slots = vm.stackTop - argCount - 1;
+  frame->arenaMark = vm.frameArenaUsed;
   return true;
 }
 
@@ -213,9 +672,8 @@ static bool callValue(Value callee, int argCount) {
 
       case OBJ_NATIVE: {
         NativeFn native = AS_NATIVE(callee);
-        Value result = native(argCount, vm.stackTop - argCount);
-        vm.stackTop -= argCount + 1;
-        push(result);
+        if (!native(argCount, vm.stackTop - argCount)) return false;
+        vm.stackTop -= argCount;
         return true;
       }
 
@@ -260,6 +718,16 @@ static bool invokeFromClass(ObjClass* klass, ObjString* name,
 static bool invoke(ObjString* name, int argCount) {
   Value receiver = peek(argCount);
 
+  if (IS_STRING_BUILDER(receiver)) {
+    Value method;
+    if (!tableGet(&vm.stringBuilderMethods, name, &method)) {
+      runtimeError("Undefined property '%s'.", name->chars);
+      return false;
+    }
+
+    return callValue(method, argCount);
+  }
+
   if (!IS_INSTANCE(receiver)) {
     runtimeError("Only instances have methods.");
     return false;
@@ -341,6 +809,59 @@ static void closeUpvalues(Value* last) {
   }
 }
 
+/**
+    @brief Call a value in tail position, reusing the current frame.
+
+    Closures and bound methods take over the caller's frame and stack
+    window once its upvalues are closed. Anything else is called as
+    usual and the OP_RETURN that follows returns its result. So is a
+    frame closure, whose upvalues read the caller's slots in place.
+
+    @param callee
+    @param argCount
+    @return true
+    @return false
+**/
+static bool tailCall(Value callee, int argCount) {
+  ObjClosure* closure;
+  if (IS_BOUND_METHOD(callee)) {
+    ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+    vm.stackTop[-argCount - 1] = bound->receiver;
+    closure = bound->method;
+  } else if (IS_CLOSURE(callee) && !AS_OBJ(callee)->inFrame) {
+    closure = AS_CLOSURE(callee);
+  } else {
+    return callValue(callee, argCount);
+  }
+
+  if (argCount != closure->function->arity) {
+    runtimeError("Expected %d arguments but got %d.",
+        closure->function->arity, argCount);
+    return false;
+  }
+
+  if (closure->function->inlineKind != INLINE_NONE &&
+      callInline(closure->function, argCount)) {
+    return true;
+  }
+
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  closeUpvalues(frame->slots);
+  // The frame closures of the call being replaced die with it. Neither
+  // the callee nor its arguments can be one of them, as a frame closure
+  // never escapes its frame.
+  vm.frameArenaUsed = frame->arenaMark;
+
+  memmove(frame->slots, vm.stackTop - argCount - 1,
+          sizeof(Value) * (argCount + 1));
+  vm.stackTop = frame->slots + argCount + 1;
+  reserveStack(closure->function->maxSlots + FRAME_STACK_RESERVE);
+
+  frame->closure = closure;
+  frame->ip = closure->function->chunk.code;
+  return true;
+}
+
 /**
     @brief
 
@@ -365,23 +886,78 @@ static bool isFalsey(Value value) {
 }
 
 /**
-    @brief
+    @brief Replace a rope on the stack with its flattened string. The
+    rope stays on the stack while it is flattened so the GC can see it.
 
+    @param distance
 **/
-static void concatenate() {
-  ObjString* b = AS_STRING(peek(0));
-  ObjString* a = AS_STRING(peek(1));
+static void flattenAt(int distance) {
+  Value value = peek(distance);
+  if (IS_ROPE(value)) {
+    vm.stackTop[-1 - distance] = OBJ_VAL(flattenRope(AS_ROPE(value)));
+  }
+}
 
-  int length = a->length + b->length;
-  char* chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
+/**
+    @brief Compare two flat strings or slices by their characters.
+    Interned strings are equal only if they are the same object.
+
+    @param a
+    @param b
+    @return true
+    @return false
+**/
+static bool stringsEqual(Obj* a, Obj* b) {
+  if (a->type == OBJ_STRING && b->type == OBJ_STRING) return a == b;
 
-  ObjString* result = takeString(chars, length);
+  int length = stringLength(a);
+  return length == stringLength(b) &&
+         memcmp(stringChars(a), stringChars(b), length) == 0;
+}
+
+/**
+    @brief Concatenate the two strings on top of the stack. Short results
+    are copied right away; longer ones become a rope that is flattened
+    only when its contents are needed.
+
+    @return bool False, with a runtime error reported, if the result
+            would be too long for a string.
+**/
+static bool concatenate() {
+  Obj* b = AS_OBJ(peek(0));
+  Obj* a = AS_OBJ(peek(1));
+
+  int64_t combined = (int64_t)stringLength(a) + stringLength(b);
+  if (combined > INT_MAX) {
+    runtimeError("String is too long.");
+    return false;
+  }
+
+  int length = (int)combined;
+  if (length < ROPE_MIN_LENGTH) {
+    // Ropes are never shorter than ROPE_MIN_LENGTH, so both are strings
+    // or slices.
+    int leftLength = stringLength(a);
+
+    char chars[ROPE_MIN_LENGTH];
+    memcpy(chars, stringChars(a), leftLength);
+    memcpy(chars + leftLength, stringChars(b), length - leftLength);
+
+    ObjString* result = copyString(chars, length);
+    pop();
+    pop();
+    push(OBJ_VAL(result));
+    return true;
+  }
+
+  if (ropeDepth(a) >= ROPE_MAX_DEPTH) flattenAt(1);
+  if (ropeDepth(b) >= ROPE_MAX_DEPTH) flattenAt(0);
+
+  ObjRope* result = newRope(AS_OBJ(peek(1)), AS_OBJ(peek(0)));
   pop();
   pop();
   push(OBJ_VAL(result));
+  return true;
 }
 
 /**
@@ -395,9 +971,12 @@ static InterpretResult run() {
 #define READ_BYTE() (*frame->ip++)
 #define READ_SHORT() \
     (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_WIDE() \
+    (frame->ip += 3, \
+     (frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1])
+#define CONSTANT_AT(index) \
+    (frame->closure->function->chunk.constants.values[index])
+#define STRING_AT(index) AS_STRING(CONSTANT_AT(index))
 
 #define BINARY_OP(valueType, op) \
     do { \
@@ -411,23 +990,38 @@ static InterpretResult run() {
       push(valueType(a op b)); \
     } while (false)
 
+// For operands already proven to be numbers.
+#define NUMBER_OP(valueType, op) \
+    do { \
+      double b = AS_NUMBER(pop()); \
+      double a = AS_NUMBER(pop()); \
+      push(valueType(a op b)); \
+    } while (false)
+
   for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
+    writeOutputString("          ");
     for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
+      writeOutputString("[ ");
       printValue(*slot);
-      printf(" ]");
+      writeOutputString(" ]");
     }
-    printf("\n");
+    writeOutputString("\n");
     disassembleInstruction(&frame->closure->function->chunk,
         (int)(frame->ip - frame->closure->function->chunk.code));
 #endif
 
+    // Instructions with an index or jump operand read it into operand,
+    // then fall into a labelled body that OP_WIDE can also jump to once
+    // it has read the 24-bit form.
     uint8_t instruction;
+    int operand;
+    bool wide;
     switch (instruction = READ_BYTE()) {
-      case OP_CONSTANT: {
-        Value constant = READ_CONSTANT();
+      case OP_CONSTANT:
+        operand = READ_BYTE();
+      constant: {
+        Value constant = CONSTANT_AT(operand);
         push(constant);
         break;
       }
@@ -435,21 +1029,24 @@ static InterpretResult run() {
       case OP_TRUE: push(BOOL_VAL(true)); break;
       case OP_FALSE: push(BOOL_VAL(false)); break;
       case OP_POP: pop(); break;
+      case OP_DUP: push(peek(0)); break;
 
-      case OP_GET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        push(frame->slots[slot]);
+      case OP_GET_LOCAL:
+        operand = READ_BYTE();
+      getLocal:
+        push(frame->slots[operand]);
         break;
-      }
 
-      case OP_SET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek(0);
+      case OP_SET_LOCAL:
+        operand = READ_BYTE();
+      setLocal:
+        frame->slots[operand] = peek(0);
         break;
-      }
 
-      case OP_GET_GLOBAL: {
-        ObjString* name = READ_STRING();
+      case OP_GET_GLOBAL:
+        operand = READ_BYTE();
+      getGlobal: {
+        ObjString* name = STRING_AT(operand);
         Value value;
         if (!tableGet(&vm.globals, name, &value)) {
           runtimeError("Undefined variable '%s'.", name->chars);
@@ -459,15 +1056,19 @@ static InterpretResult run() {
         break;
       }
 
-      case OP_DEFINE_GLOBAL: {
-        ObjString* name = READ_STRING();
+      case OP_DEFINE_GLOBAL:
+        operand = READ_BYTE();
+      defineGlobal: {
+        ObjString* name = STRING_AT(operand);
         tableSet(&vm.globals, name, peek(0));
         pop();
         break;
       }
 
-      case OP_SET_GLOBAL: {
-        ObjString* name = READ_STRING();
+      case OP_SET_GLOBAL:
+        operand = READ_BYTE();
+      setGlobal: {
+        ObjString* name = STRING_AT(operand);
         if (tableSet(&vm.globals, name, peek(0))) {
           tableDelete(&vm.globals, name); // [delete]
           runtimeError("Undefined variable '%s'.", name->chars);
@@ -476,26 +1077,28 @@ static InterpretResult run() {
         break;
       }
 
-      case OP_GET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        push(*frame->closure->upvalues[slot]->location);
+      case OP_GET_UPVALUE:
+        operand = READ_BYTE();
+      getUpvalue:
+        push(*frame->closure->upvalues[operand]->location);
         break;
-      }
 
-      case OP_SET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(0);
+      case OP_SET_UPVALUE:
+        operand = READ_BYTE();
+      setUpvalue:
+        *frame->closure->upvalues[operand]->location = peek(0);
         break;
-      }
 
-      case OP_GET_PROPERTY: {
+      case OP_GET_PROPERTY:
+        operand = READ_BYTE();
+      getProperty: {
         if (!IS_INSTANCE(peek(0))) {
           runtimeError("Only instances have properties.");
           return INTERPRET_RUNTIME_ERROR;
         }
 
         ObjInstance* instance = AS_INSTANCE(peek(0));
-        ObjString* name = READ_STRING();
+        ObjString* name = STRING_AT(operand);
 
         Value value;
         if (tableGet(&instance->fields, name, &value)) {
@@ -510,14 +1113,16 @@ static InterpretResult run() {
         break;
       }
 
-      case OP_SET_PROPERTY: {
+      case OP_SET_PROPERTY:
+        operand = READ_BYTE();
+      setProperty: {
         if (!IS_INSTANCE(peek(1))) {
           runtimeError("Only instances have fields.");
           return INTERPRET_RUNTIME_ERROR;
         }
 
         ObjInstance* instance = AS_INSTANCE(peek(1));
-        tableSet(&instance->fields, READ_STRING(), peek(0));
+        tableSet(&instance->fields, STRING_AT(operand), peek(0));
 
         Value value = pop();
         pop();
@@ -525,8 +1130,10 @@ static InterpretResult run() {
         break;
       }
 
-      case OP_GET_SUPER: {
-        ObjString* name = READ_STRING();
+      case OP_GET_SUPER:
+        operand = READ_BYTE();
+      getSuper: {
+        ObjString* name = STRING_AT(operand);
         ObjClass* superclass = AS_CLASS(pop());
         if (!bindMethod(superclass, name)) {
           return INTERPRET_RUNTIME_ERROR;
@@ -535,6 +1142,15 @@ static InterpretResult run() {
       }
 
       case OP_EQUAL: {
+        if (isStringValue(peek(0)) && isStringValue(peek(1))) {
+          flattenAt(0);
+          flattenAt(1);
+          Obj* b = AS_OBJ(pop());
+          Obj* a = AS_OBJ(pop());
+          push(BOOL_VAL(stringsEqual(a, b)));
+          break;
+        }
+
         Value b = pop();
         Value a = pop();
         push(BOOL_VAL(valuesEqual(a, b)));
@@ -544,8 +1160,8 @@ static InterpretResult run() {
       case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
       case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
       case OP_ADD: {
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-          concatenate();
+        if (isStringValue(peek(0)) && isStringValue(peek(1))) {
+          if (!concatenate()) return INTERPRET_RUNTIME_ERROR;
         } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
           double b = AS_NUMBER(pop());
           double a = AS_NUMBER(pop());
@@ -559,6 +1175,12 @@ static InterpretResult run() {
       case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
       case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
       case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
+      case OP_GREATER_NUMBER:  NUMBER_OP(BOOL_VAL, >); break;
+      case OP_LESS_NUMBER:     NUMBER_OP(BOOL_VAL, <); break;
+      case OP_ADD_NUMBER:      NUMBER_OP(NUMBER_VAL, +); break;
+      case OP_SUBTRACT_NUMBER: NUMBER_OP(NUMBER_VAL, -); break;
+      case OP_MULTIPLY_NUMBER: NUMBER_OP(NUMBER_VAL, *); break;
+      case OP_DIVIDE_NUMBER:   NUMBER_OP(NUMBER_VAL, /); break;
       case OP_NOT:
         push(BOOL_VAL(isFalsey(pop())));
         break;
@@ -573,26 +1195,60 @@ static InterpretResult run() {
 
       case OP_PRINT: {
         printValue(pop());
-        printf("\n");
+        writeOutput("\n", 1);
         break;
       }
 
-      case OP_JUMP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip += offset;
+      case OP_JUMP:
+        operand = READ_SHORT();
+      jump:
+        frame->ip += operand;
         break;
-      }
 
-      case OP_JUMP_IF_FALSE: {
-        uint16_t offset = READ_SHORT();
-        if (isFalsey(peek(0))) frame->ip += offset;
+      case OP_JUMP_IF_FALSE:
+        operand = READ_SHORT();
+      jumpIfFalse:
+        if (isFalsey(peek(0))) frame->ip += operand;
         break;
-      }
 
-      case OP_LOOP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip -= offset;
+      case OP_JUMP_IF_TRUE:
+        operand = READ_SHORT();
+      jumpIfTrue:
+        if (!isFalsey(peek(0))) frame->ip += operand;
         break;
+
+      case OP_LOOP:
+        operand = READ_SHORT();
+      loop:
+        frame->ip -= operand;
+        break;
+
+      case OP_LOOP_IF_TRUE:
+        operand = READ_SHORT();
+      loopIfTrue:
+        if (!isFalsey(pop())) frame->ip -= operand;
+        break;
+
+      case OP_FOR_LOOP:
+        operand = READ_SHORT();
+      forLoop: {
+        Value* counter = &frame->slots[READ_BYTE()];
+        Value step = CONSTANT_AT(READ_BYTE());
+        if (IS_NUMBER(*counter) && IS_NUMBER(peek(0))) {
+          double next = AS_NUMBER(*counter) + AS_NUMBER(step);
+          *counter = NUMBER_VAL(next);
+          if (next < AS_NUMBER(pop())) frame->ip -= operand;
+          break;
+        }
+
+        // Fail the same way as the addition and comparison it replaces.
+        if (!IS_NUMBER(*counter)) {
+          runtimeError("Operands must be two numbers or two strings.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        *counter = NUMBER_VAL(AS_NUMBER(*counter) + AS_NUMBER(step));
+        runtimeError("Operands must be numbers.");
+        return INTERPRET_RUNTIME_ERROR;
       }
 
       case OP_CALL: {
@@ -604,8 +1260,19 @@ static InterpretResult run() {
         break;
       }
 
-      case OP_INVOKE: {
-        ObjString* method = READ_STRING();
+      case OP_TAIL_CALL: {
+        int argCount = READ_BYTE();
+        if (!tailCall(peek(argCount), argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        frame = &vm.frames[vm.frameCount - 1];
+        break;
+      }
+
+      case OP_INVOKE:
+        operand = READ_BYTE();
+      invoke: {
+        ObjString* method = STRING_AT(operand);
         int argCount = READ_BYTE();
         if (!invoke(method, argCount)) {
           return INTERPRET_RUNTIME_ERROR;
@@ -614,8 +1281,10 @@ static InterpretResult run() {
         break;
       }
 
-      case OP_SUPER_INVOKE: {
-        ObjString* method = READ_STRING();
+      case OP_SUPER_INVOKE:
+        operand = READ_BYTE();
+      superInvoke: {
+        ObjString* method = STRING_AT(operand);
         int argCount = READ_BYTE();
         ObjClass* superclass = AS_CLASS(pop());
         if (!invokeFromClass(superclass, method, argCount)) {
@@ -625,13 +1294,16 @@ static InterpretResult run() {
         break;
       }
 
-      case OP_CLOSURE: {
-        ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+      case OP_CLOSURE:
+        operand = READ_BYTE();
+        wide = false;
+      closure: {
+        ObjFunction* function = AS_FUNCTION(CONSTANT_AT(operand));
         ObjClosure* closure = newClosure(function);
         push(OBJ_VAL(closure));
         for (int i = 0; i < closure->upvalueCount; i++) {
           uint8_t isLocal = READ_BYTE();
-          uint8_t index = READ_BYTE();
+          int index = wide ? READ_WIDE() : READ_BYTE();
           if (isLocal) {
             closure->upvalues[i] = captureUpvalue(frame->slots + index);
           } else {
@@ -641,15 +1313,51 @@ static InterpretResult run() {
         break;
       }
 
+      case OP_FRAME_CLOSURE:
+        operand = READ_BYTE();
+        wide = false;
+      frameClosure: {
+        // The closure and its upvalues die with the frame, so a captured
+        // slot is read in place and never needs closing.
+        ObjFunction* function = AS_FUNCTION(CONSTANT_AT(operand));
+        ObjClosure* closure = newFrameClosure(function);
+        if (closure == NULL) goto closure;
+
+        push(OBJ_VAL(closure));
+        ObjUpvalue* upvalues = frameClosureUpvalues(closure);
+        for (int i = 0; i < closure->upvalueCount; i++) {
+          uint8_t isLocal = READ_BYTE();
+          int index = wide ? READ_WIDE() : READ_BYTE();
+          if (isLocal) {
+            upvalues[i].location = frame->slots + index;
+            closure->upvalues[i] = &upvalues[i];
+          } else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+          }
+        }
+        break;
+      }
+
       case OP_CLOSE_UPVALUE:
         closeUpvalues(vm.stackTop - 1);
         pop();
         break;
 
+      case OP_POP_FRAME_CLOSURE: {
+        // Anything carved out after the closure belonged to scopes that
+        // have already ended.
+        Value local = pop();
+        if (IS_OBJ(local) && AS_OBJ(local)->inFrame) {
+          vm.frameArenaUsed = (uint8_t*)AS_OBJ(local) - vm.frameArena;
+        }
+        break;
+      }
+
       case OP_RETURN: {
         Value result = pop();
 
         closeUpvalues(frame->slots);
+        vm.frameArenaUsed = frame->arenaMark;
 
         vm.frameCount--;
         if (vm.frameCount == 0) {
@@ -665,7 +1373,9 @@ static InterpretResult run() {
       }
 
       case OP_CLASS:
-        push(OBJ_VAL(newClass(READ_STRING())));
+        operand = READ_BYTE();
+      klass:
+        push(OBJ_VAL(newClass(STRING_AT(operand))));
         break;
 
       case OP_INHERIT: {
@@ -682,16 +1392,51 @@ static InterpretResult run() {
       }
 
       case OP_METHOD:
-        defineMethod(READ_STRING());
+        operand = READ_BYTE();
+      method:
+        defineMethod(STRING_AT(operand));
+        break;
+
+      case OP_WIDE:
+        instruction = READ_BYTE();
+        operand = READ_WIDE();
+        wide = true;
+        switch (instruction) {
+          case OP_CONSTANT:      goto constant;
+          case OP_GET_LOCAL:     goto getLocal;
+          case OP_SET_LOCAL:     goto setLocal;
+          case OP_GET_GLOBAL:    goto getGlobal;
+          case OP_DEFINE_GLOBAL: goto defineGlobal;
+          case OP_SET_GLOBAL:    goto setGlobal;
+          case OP_GET_UPVALUE:   goto getUpvalue;
+          case OP_SET_UPVALUE:   goto setUpvalue;
+          case OP_GET_PROPERTY:  goto getProperty;
+          case OP_SET_PROPERTY:  goto setProperty;
+          case OP_GET_SUPER:     goto getSuper;
+          case OP_JUMP:          goto jump;
+          case OP_JUMP_IF_FALSE: goto jumpIfFalse;
+          case OP_JUMP_IF_TRUE:  goto jumpIfTrue;
+          case OP_LOOP:          goto loop;
+          case OP_LOOP_IF_TRUE:  goto loopIfTrue;
+          case OP_FOR_LOOP:      goto forLoop;
+          case OP_INVOKE:        goto invoke;
+          case OP_SUPER_INVOKE:  goto superInvoke;
+          case OP_CLOSURE:       goto closure;
+          case OP_FRAME_CLOSURE: goto frameClosure;
+          case OP_CLASS:         goto klass;
+          case OP_METHOD:        goto method;
+        }
         break;
     }
   }
 
 #undef READ_BYTE
 #undef READ_SHORT
-#undef READ_CONSTANT
-#undef READ_STRING
+#undef READ_WIDE
+#undef CONSTANT_AT
+#undef STRING_AT
 #undef BINARY_OP
+#undef NUMBER_OP
 }
 
 void hack(bool b) {
@@ -708,9 +1453,22 @@ void hack(bool b) {
     @return InterpretResult
 **/
 InterpretResult interpret(const char* source) {
-  ObjFunction* function = compile(source);
+  CompileContext context;
+  context.errors = stderr;
+  ObjFunction* function = compile(&context, source);
   if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
+  return interpretFunction(function);
+}
+
+/**
+    @brief Run a script that is already compiled, such as one loaded
+           from a cache file.
+
+    @param function The script's top-level function.
+    @return InterpretResult
+**/
+InterpretResult interpretFunction(ObjFunction* function) {
   push(OBJ_VAL(function));
   ObjClosure* closure = newClosure(function);
   pop();
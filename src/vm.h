@@ -7,50 +7,96 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include "cache.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Call frames and stack slots are allocated on demand, starting small.
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL (4 * UINT8_COUNT)
+// Default limit on call depth; reaching it is a stack overflow.
+#define FRAMES_MAX (16 * 1024)
+// Free stack slots guaranteed to a frame on entry beyond its locals, for
+// the temporaries of the expressions it evaluates.
+#define FRAME_STACK_RESERVE (2 * UINT8_COUNT)
+// Frames listed in a runtime error's stack trace before eliding.
+#define TRACE_FRAMES_MAX 32
+// Bytes set aside for closures that never outlive their frame. Once it
+// is full, such closures are allocated on the heap like any other.
+#define FRAME_ARENA_SIZE (64 * 1024)
 
 typedef struct {
   ObjClosure* closure;
   uint8_t* ip;
   Value* slots;
+  // Frame arena usage on entry, restored when the frame returns.
+  size_t arenaMark;
 } CallFrame;
 
 typedef struct {
-  CallFrame frames[FRAMES_MAX];
+  CallFrame* frames;
   int frameCount;
+  int frameCapacity;
+  int frameLimit;
 
-  Value stack[STACK_MAX];
+  Value* stack;
   Value* stackTop;
+  int stackCapacity;
   Table globals;
   Table strings;
+  Table stringBuilderMethods;
   ObjString* initString;
   ObjUpvalue* openUpvalues;
+  uint8_t* frameArena;
+  size_t frameArenaUsed;
 
   size_t bytesAllocated;
   size_t nextGC;
 
   Obj* objects;
+  StringBlock* stringBlocks;
+  CacheImage* cacheImages;
+  // Scripts compiled ahead of being run, in the order they run.
+  ValueArray scripts;
+  // Compilations in progress, whose functions the collector must keep.
+  struct sCompileContext* compiling;
+  bool batchingStrings;
+  int optimizeLevel;
   int grayCount;
   int grayCapacity;
   Obj** grayStack;
 } VM;
 
+/**
+    @brief The objects of a VM that has been freed, for another VM to
+    adopt. A compile worker hands back the functions it compiled this
+    way.
+**/
+typedef struct {
+  Obj* objects;
+  StringBlock* stringBlocks;
+  CacheImage* cacheImages;
+  size_t bytesAllocated;
+} Heap;
+
 typedef enum {
   INTERPRET_OK,
   INTERPRET_COMPILE_ERROR,
   INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+extern THREAD_LOCAL VM vm;
 
 void initVM();
 void freeVM();
+Heap detachHeap();
+void adoptHeap(Heap* heap);
+void adoptFunction(ObjFunction* function);
 InterpretResult interpret(const char* source);
+InterpretResult interpretFunction(ObjFunction* function);
+int nativeIndex(NativeFn function);
+NativeFn nativeAt(int index);
 void push(Value value);
 Value pop();
 
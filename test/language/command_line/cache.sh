@@ -0,0 +1,17 @@
+# The first run compiles the script and writes its cache file. The
+# second runs it from the mapped cache without writing it again.
+clocks=$1
+cp "$2" "$3/script.lox"
+cd "$3" || exit 1
+
+"$clocks" --cache script.lox
+test -f script.loxc && echo "cache written"
+before=$(ls -i script.loxc)
+
+"$clocks" --cache script.lox
+after=$(ls -i script.loxc)
+test "$before" = "$after" && echo "cache reused"
+
+# A cache is only used for the optimization level it was made at.
+"$clocks" -O0 --cache script.lox
+test "$(ls -i script.loxc)" != "$after" && echo "cache replaced"
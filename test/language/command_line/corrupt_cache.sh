@@ -0,0 +1,32 @@
+# A damaged cache file is ignored: the script is compiled again, runs
+# as it should, and a good cache replaces the bad one.
+clocks=$1
+cp "$2" "$3/script.lox"
+cd "$3" || exit 1
+
+"$clocks" --cache script.lox
+cp script.loxc good.loxc
+size=$(wc -c < good.loxc)
+
+echo "flipped byte:"
+cp good.loxc script.loxc
+printf '\377' | dd of=script.loxc bs=1 seek=$((size / 2)) conv=notrunc \
+    2> /dev/null
+"$clocks" --cache script.lox
+cmp -s script.loxc good.loxc && echo "cache rewritten"
+
+echo "truncated:"
+head -c $((size - 7)) good.loxc > script.loxc
+"$clocks" --cache script.lox
+cmp -s script.loxc good.loxc && echo "cache rewritten"
+
+echo "extended:"
+cp good.loxc script.loxc
+printf 'extra' >> script.loxc
+"$clocks" --cache script.lox
+cmp -s script.loxc good.loxc && echo "cache rewritten"
+
+echo "empty:"
+: > script.loxc
+"$clocks" --cache script.lox
+cmp -s script.loxc good.loxc && echo "cache rewritten"
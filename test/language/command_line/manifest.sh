@@ -0,0 +1,34 @@
+# A manifest lists the scripts of one program. They run in the order
+# listed, however many threads compile them.
+clocks=$1
+cp "$2" "$3/manifest.lox"
+cd "$3" || exit 1
+
+echo 'var greeting = "hello";' > first.lox
+echo 'print "last";' > last.lox
+printf 'first.lox\n\nmanifest.lox\nlast.lox\n' > program.txt
+
+for jobs in 1 2 4; do
+  echo "jobs $jobs:"
+  "$clocks" --jobs=$jobs @program.txt
+done
+
+echo "with cache:"
+"$clocks" --jobs=2 --cache @program.txt
+"$clocks" --jobs=2 --cache @program.txt
+ls first.loxc manifest.loxc last.loxc
+
+echo "empty manifest:"
+: > empty.txt
+"$clocks" @empty.txt
+echo "exit $?"
+
+echo "compile errors:"
+echo 'print ;' > broken.lox
+printf 'broken.lox\nfirst.lox\nbroken.lox\n' > broken.txt
+"$clocks" --jobs=2 @broken.txt
+echo "exit $?"
+
+echo "missing manifest:"
+"$clocks" @missing.txt
+echo "exit $?"
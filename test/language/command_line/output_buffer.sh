@@ -0,0 +1,14 @@
+# Output is the same whatever the buffer size or mode, and is flushed
+# before a runtime error is reported.
+clocks=$1
+
+for flags in "" --output-buffer=1 --output-buffer=7 --line-buffered \
+    "--output-buffer=3 --line-buffered"; do
+  echo "flags: $flags"
+  "$clocks" $flags "$2"
+  echo "exit $?"
+done
+
+echo "bad size:"
+"$clocks" --output-buffer=0 "$2"
+echo "exit $?"
@@ -0,0 +1,25 @@
+# Saves the heap after one script and restores it before another, which
+# picks up where the first left off.
+clocks=$1
+cd "$3" || exit 1
+
+"$clocks" --snapshot=heap.img "$2"
+cat > resume.lox <<'LOX'
+print account.owner;
+print account.deposit(5).balance;
+print counter();
+print builder.toString();
+print name == "shared";
+print slice;
+account.deposit(1);
+LOX
+"$clocks" --restore=heap.img --snapshot=again.img resume.lox
+
+# A snapshot of a restored heap restores the same way.
+echo 'print account.balance;' > balance.lox
+"$clocks" --restore=again.img balance.lox
+
+echo "bad snapshot:"
+echo "garbage" > bad.img
+"$clocks" --restore=bad.img balance.lox
+echo "exit $?"
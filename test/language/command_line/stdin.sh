@@ -0,0 +1,19 @@
+# "-" reads the script from stdin, whether it is a file or a pipe. A
+# streamed script is never cached.
+clocks=$1
+cd "$3" || exit 1
+
+echo "redirected:"
+"$clocks" - < "$2"
+
+echo "piped:"
+cat "$2" | "$clocks" --cache -
+ls *.loxc 2> /dev/null || echo "nothing cached"
+
+echo "with a file:"
+echo 'print "after stdin";' > after.lox
+cat "$2" | "$clocks" - after.lox
+
+echo "compile error:"
+echo 'print 1 +;' | "$clocks" -
+echo "exit $?"